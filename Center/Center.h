@@ -2,6 +2,13 @@
 #include <iostream>
 #include <string.h>
 
+#include <set>
+
+#include "ContractSnapshot.h"
+#include "ContractFileSnapshot.h"
+#include "ZooKeeperBackend.h"
+#include "ServiceRegistrar.h"
+
 /**
  * @brief 集群中心客户端
  * 每个 DenOS 进程启动时，都会向 ZooKeeper 注册自己的服务。
@@ -29,6 +36,8 @@ public:
      * @param name 服务的名字
      * @param contract 服务的通信方式
      * @return 返回 0 表示已经发起注册流程，其他值表示失败
+     * @note 每个服务单独写入 ZooKeeper，不经过 registrar()；启动时需要批量注册大量服务的进程
+     *       直接调用 registrar()->Add() 加入节点，再调用 registrar()->Flush() 用 multi 请求批量写入。
      */
 	 int RegisterService(const std::string& name, const Contract& contract);
 	 
@@ -58,6 +67,7 @@ public:
     /**
      * @brief 查询一个服务去发起请求
      * 注意这是一个异步的接口，有可能会返回 -1 表示服务合同还未拿到。需要重复的去获取。
+     * 目前不读取合同快照，需要在多个工作线程中无锁选择合同时使用 RouteContract()。
      * @param name 服务的名字
      * @param callback 当获得对应的服务的客户端的回调
      * @param client_cb 预期每个新的 Client 所注册的默认回调，用来接收连接、中断、收听通知。
@@ -95,18 +105,165 @@ public:
 	 inline int process_flags() const{
 		 return process_flags;
 	 }
-	 // 在 ZK 写入本进程对此服务的合约
+	 // 在 ZK 写入本进程对此服务的合约，不经过 registrar_，需要批量写入时调用者直接使用 registrar()->Add() 和 Flush()
 	 void AddProcessContract(const std::string& service_name, 
 							const std::string& contract_data);
 	 //清理相关的对象
 	 void CloseClient(Client* client);
 	 
-	 //设置合同缓存
-	 void SetContractsCache(const std::string& service_name,ContractCache& cache);
+	/**
+     * 设置合同缓存，由 ZooKeeper 的 watcher 回调调用
+     * 复制一份当前快照，替换此服务的合同后整体发布，不会阻塞正在路由的其他线程。
+     * @param service_name 服务名字
+     * @param cache 此服务最新的合同集合，为空表示此服务已经没有进程
+     */
+	 void SetContractsCache(const std::string& service_name, const ContractCache& cache){
+		 const ContractSet* current = contracts_.writer_view();
+		 ContractSet* next = current ? new ContractSet(*current) : new ContractSet();
+		 if(cache.empty()){
+			 next->erase(service_name);
+		 }else{
+			 (*next)[service_name] = cache;
+		 }
+		 contracts_.Publish(next);
+		 stale_services_.erase(service_name);
+		 snapshot_dirty_ = true;
+	 }
+
+	/**
+     * 启动时从本地文件加载上次已知的合同集合并立即发布，加载到的服务都标记为“待校正”，
+     * 直到 ZooKeeper 回调了这个服务的最新合同。
+     * @param path 快照文件路径，之后 SaveContractsSnapshot() 也写入这个文件
+     * @return 返回 0 表示加载成功，-1 表示没有快照文件，-2 表示快照文件损坏
+     * @note Init() 不会自动调用，需要快照的进程在 Init() 之前或之后自行调用一次；
+     *       之后还要自行调用 SaveContractsSnapshot() 和 DropStaleContracts()，快照才会更新和校正。
+     */
+	 int LoadContractsSnapshot(const std::string& path){
+		 file_snapshot_.set_path(path);
+		 ContractSet* loaded = new ContractSet();
+		 int ret = file_snapshot_.Load(loaded);
+		 if(ret != 0){
+			 delete loaded;
+			 return ret;
+		 }
+		 // ZooKeeper 可能已经先回调了部分服务，以 ZooKeeper 的数据为准
+		 const ContractSet* current = contracts_.writer_view();
+		 if(current != NULL){
+			 for(ContractSet::const_iterator it = current->begin(); it != current->end(); ++it){
+				 (*loaded)[it->first] = it->second;
+			 }
+		 }
+		 for(ContractSet::const_iterator it = loaded->begin(); it != loaded->end(); ++it){
+			 if(current == NULL || current->find(it->first) == current->end()){
+				 stale_services_.insert(it->first);
+			 }
+		 }
+		 contracts_.Publish(loaded);
+		 return 0;
+	 }
+
+	/**
+     * 如果合同有变化，把当前的合同快照写入本地文件，没有变化时直接返回，可以每次 Update() 之后调用。
+     * 需要由调用者在 watcher 回调所在的线程定期调用，Update() 不会自动调用。
+     * @return 返回 0 表示未调用过 LoadContractsSnapshot()、无需写入或写入成功，
+     *         其他值表示写入失败，下次会再次尝试
+     */
+	 int SaveContractsSnapshot(){
+		 if(file_snapshot_.path().empty() || !snapshot_dirty_ || contracts_.writer_view() == NULL){
+			 return 0;
+		 }
+		 int ret = file_snapshot_.Save(*contracts_.writer_view());
+		 if(ret == 0){
+			 snapshot_dirty_ = false;
+		 }
+		 return ret;
+	 }
+
+	/**
+     * 删除快照里存在、但在 ZooKeeper 中已经不存在的服务。
+     * 需要由调用者在确认 ZooKeeper 完成首次全量同步后调用一次，不调用时这些服务的旧合同会一直保留。
+     * @return 删除的服务数量
+     */
+	 int DropStaleContracts(){
+		 if(stale_services_.empty()){
+			 return 0;
+		 }
+		 ContractSet* next = new ContractSet(*contracts_.writer_view());
+		 int dropped = 0;
+		 for(std::set<std::string>::iterator it = stale_services_.begin();
+		     it != stale_services_.end(); ++it){
+			 dropped += next->erase(*it);
+		 }
+		 stale_services_.clear();
+		 contracts_.Publish(next);
+		 snapshot_dirty_ = true;
+		 return dropped;
+	 }
+
+	/**
+     * 在合同快照上为一个服务选择合同，可以在任意线程调用，读取快照不加锁，
+     * 多个工作线程同时调用时不需要加锁。
+     * @param name 服务的名字
+     * @param router 路由器对象，为 NULL 时使用默认的 Router 规则；
+     *        有状态的路由器（如 ConsistentHashRouter）每个服务使用一个，并自行保证线程安全
+     * @param route_param 路由参数
+     * @param content 输出参数，选中的合同内容
+     * @return 返回 0 表示成功，返回 -1 表示服务合同还未拿到
+     */
+	 int RouteContract(const std::string& name, Router* router, void* route_param,
+	                   std::string* content) const{
+		 SnapshotPtr<ContractSet>::ReadGuard guard(contracts_);
+		 if(guard.get() == NULL){
+			 return -1;
+		 }
+		 ContractSet::const_iterator it = guard->find(name);
+		 if(it == guard->end() || it->second.empty()){
+			 return -1;
+		 }
+		 if(router != NULL){
+			 router->RouteToSevice(it->second, content, route_param);
+		 }else{
+			 *content = *it->second.begin();
+		 }
+		 return content->empty() ? -1 : 0;
+	 }
+
+	 /// 合同快照，读者使用 SnapshotPtr<ContractSet>::ReadGuard 访问
+	 inline const SnapshotPtr<ContractSet>& contracts() const{
+		 return contracts_;
+	 }
 	 
 	 // 建立存储节点父目录时，增加一个监听器，监听这些节点增加和删除变化
 	 virtual void CreatePrefixNode();
 	 
+	/**
+     * 设置给 ServiceRegistrar 等组件使用的 ZooKeeper 后端，Center 自身的读写仍然经过 ZooKeeperMap。
+     * Init() 不会建立后端，需要的进程自行建立 ZooKeeperClientBackend，或者在测试和压测中传入
+     * 连接到同一个 FakeZooKeeperEnsemble 的 FakeZooKeeperBackend，并自行调用它的 Update()。
+     * @param backend 后端对象，所有权不转移，生命周期需要长于此 Center
+     */
+	 inline void set_backend(ZooKeeperBackend* backend){
+		 backend_ = backend;
+	 }
+
+	 inline ZooKeeperBackend* backend() const{
+		 return backend_;
+	 }
+
+	/**
+     * 设置批量注册服务合同的 ServiceRegistrar，Init() 不会建立它，Center 自身也不会向它加入节点。
+     * 调用者用 backend() 建立 ServiceRegistrar 后设置进来，用 Add() 加入节点，并在每次 Update() 之后
+     * 调用它的 Flush()，否则加入的节点不会写入，退避到期的节点也不会重试。
+     * @param registrar 所有权不转移，生命周期需要长于此 Center
+     */
+	 inline void set_registrar(ServiceRegistrar* registrar){
+		 registrar_ = registrar;
+	 }
+
+	 inline ServiceRegistrar* registrar() const{
+		 return registrar_;
+	 }
+
 	 // 初始化 zookeeper 客户端连接，会修改 ZKMAP_KEY_PREFIX 为集群专用路径
 	 virtual int Init(Config* config = NULL);
 	 
@@ -119,4 +276,16 @@ public:
 	 void ClearClientMember(Client* client, const std::string& content);
 	 
 private:	 
+	 // 通过 set_backend() 设置的后端，未设置时为 NULL
+	 ZooKeeperBackend* backend_ = NULL;
+	 // 通过 set_registrar() 设置，只是保存给调用者使用，未设置时为 NULL
+	 ServiceRegistrar* registrar_ = NULL;
+	 // 所有服务的合同快照，只有 watcher 回调所在的线程写入
+	 SnapshotPtr<ContractSet> contracts_;
+	 // 本地文件快照，未调用 LoadContractsSnapshot() 时路径为空
+	 ContractFileSnapshot file_snapshot_;
+	 // 合同有变化，还未写入本地文件
+	 bool snapshot_dirty_ = false;
+	 // 从本地文件加载、还未得到 ZooKeeper 校正的服务
+	 std::set<std::string> stale_services_;
  };
\ No newline at end of file
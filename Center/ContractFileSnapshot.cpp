@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ContractFileSnapshot.h"
+
+namespace {
+
+void AppendUint32(std::string* buf, uint32_t value)
+{
+	buf->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendString(std::string* buf, const std::string& value)
+{
+	AppendUint32(buf, static_cast<uint32_t>(value.size()));
+	buf->append(value);
+}
+
+// 从 mmap 的数据中顺序读取，越界时返回 false
+class Reader
+{
+public:
+	Reader(const char* data, size_t len) : data_(data), len_(len), pos_(0) {}
+
+	bool ReadUint32(uint32_t* value) {
+		if (len_ - pos_ < sizeof(*value)) {
+			return false;
+		}
+		memcpy(value, data_ + pos_, sizeof(*value));
+		pos_ += sizeof(*value);
+		return true;
+	}
+
+	bool ReadString(std::string* value) {
+		uint32_t size = 0;
+		if (!ReadUint32(&size) || len_ - pos_ < size) {
+			return false;
+		}
+		value->assign(data_ + pos_, size);
+		pos_ += size;
+		return true;
+	}
+
+	inline bool finished() const {
+		return pos_ == len_;
+	}
+
+private:
+	const char* data_;
+	size_t len_;
+	size_t pos_;
+};
+
+}  // namespace
+
+ContractFileSnapshot::ContractFileSnapshot()
+	: generation_(0)
+{
+}
+
+ContractFileSnapshot::ContractFileSnapshot(const std::string& path)
+	: path_(path), generation_(0)
+{
+}
+
+ContractFileSnapshot::~ContractFileSnapshot()
+{
+}
+
+uint64_t ContractFileSnapshot::Checksum(const char* data, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= static_cast<unsigned char>(data[i]);
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+int ContractFileSnapshot::Load(ContractSet* contracts)
+{
+	int fd = open(path_.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(FileHeader))) {
+		close(fd);
+		return -2;
+	}
+	size_t size = static_cast<size_t>(st.st_size);
+	void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return -2;
+	}
+
+	const char* data = static_cast<const char*>(addr);
+	FileHeader header;
+	memcpy(&header, data, sizeof(header));
+	const char* body = data + sizeof(header);
+	if (header.magic != MAGIC || header.version != VERSION
+		|| header.body_size != size - sizeof(header)
+		|| header.checksum != Checksum(body, header.body_size)) {
+		munmap(addr, size);
+		return -2;
+	}
+
+	ContractSet loaded;
+	Reader reader(body, header.body_size);
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < header.service_count; i++) {
+		std::string name;
+		uint32_t count = 0;
+		ok = reader.ReadString(&name) && reader.ReadUint32(&count);
+		ContractCache& cache = loaded[name];
+		for (uint32_t j = 0; ok && j < count; j++) {
+			std::string contract;
+			ok = reader.ReadString(&contract);
+			if (ok) {
+				cache.insert(cache.end(), contract);
+			}
+		}
+	}
+	munmap(addr, size);
+	if (!ok || !reader.finished()) {
+		return -2;
+	}
+
+	for (ContractSet::iterator it = loaded.begin(); it != loaded.end(); ++it) {
+		(*contracts)[it->first] = it->second;
+	}
+	generation_ = header.generation;
+	return 0;
+}
+
+int ContractFileSnapshot::Save(const ContractSet& contracts)
+{
+	if (path_.empty()) {
+		return -1;
+	}
+	std::string body;
+	for (ContractSet::const_iterator it = contracts.begin(); it != contracts.end(); ++it) {
+		AppendString(&body, it->first);
+		AppendUint32(&body, static_cast<uint32_t>(it->second.size()));
+		for (ContractCache::const_iterator c = it->second.begin(); c != it->second.end(); ++c) {
+			AppendString(&body, *c);
+		}
+	}
+
+	FileHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = MAGIC;
+	header.version = VERSION;
+	header.generation = generation_ + 1;
+	header.body_size = body.size();
+	header.checksum = Checksum(body.data(), body.size());
+	header.service_count = static_cast<uint32_t>(contracts.size());
+
+	std::string tmp_path = path_ + ".tmp";
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	bool ok = write(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header))
+		&& write(fd, body.data(), body.size()) == static_cast<ssize_t>(body.size())
+		&& fsync(fd) == 0;
+	close(fd);
+	if (!ok || rename(tmp_path.c_str(), path_.c_str()) != 0) {
+		unlink(tmp_path.c_str());
+		return -1;
+	}
+	generation_ = header.generation;
+	return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef _CENTER_CONTRACT_FILE_SNAPSHOT_H_
+#define _CENTER_CONTRACT_FILE_SNAPSHOT_H_
+
+#include <iostream>
+#include <string>
+#include <stdint.h>
+
+/**
+ * @brief 服务合同的本地文件快照
+ * 进程重启时直接从本地文件加载上次已知的合同集合，不必等待 ZooKeeper 把所有合同重新拉取一遍，
+ * QueryService 在启动后立即可用；随后 ZooKeeper 的 watcher 回调会在后台逐个服务进行校正。
+ *
+ * 文件格式（本机字节序，文件可以直接 mmap 读取）：
+ * [FileHeader] [服务数 × ([名字长度:4][名字] [合同数:4] [合同数 × ([长度:4][合同内容])])]
+ * 写入时先写临时文件再 rename，所以读者永远不会看到写了一半的文件。
+ */
+class ContractFileSnapshot
+{
+public:
+	static const uint32_t MAGIC = 0x4E535443;   // "CTSN"
+	static const uint32_t VERSION = 1;
+
+	struct FileHeader {
+		uint32_t magic;
+		uint32_t version;
+		uint64_t generation;     // 每次保存递增，用来判断快照的新旧
+		uint64_t body_size;      // 文件头之后的数据长度
+		uint64_t checksum;       // 数据部分的 FNV-1a 校验值
+		uint32_t service_count;
+		uint32_t reserved;
+	};
+
+	/// @brief 未指定路径的快照，Load()/Save() 调用 set_path() 之前都失败
+	ContractFileSnapshot();
+	explicit ContractFileSnapshot(const std::string& path);
+	virtual ~ContractFileSnapshot();
+
+	/// @brief 更换快照文件，快照代数重新从 0 开始
+	inline void set_path(const std::string& path) {
+		path_ = path;
+		generation_ = 0;
+	}
+
+	/**
+	 * @brief 从文件加载合同快照
+	 * @param contracts 输出参数，加载到的合同会追加进去
+	 * @return 返回 0 表示成功，-1 表示文件不存在，-2 表示文件损坏或版本不符
+	 */
+	int Load(ContractSet* contracts);
+
+	/**
+	 * @brief 把合同集合整体写入文件
+	 * @param contracts 需要保存的合同集合
+	 * @return 返回 0 表示成功，其他值表示写入失败，原有文件保持不变
+	 */
+	int Save(const ContractSet& contracts);
+
+	/// @brief 最后一次加载或保存的快照代数
+	inline uint64_t generation() const {
+		return generation_;
+	}
+
+	inline const std::string& path() const {
+		return path_;
+	}
+
+private:
+	static uint64_t Checksum(const char* data, size_t len);
+
+	std::string path_;
+	uint64_t generation_;
+};
+
+#endif  // _CENTER_CONTRACT_FILE_SNAPSHOT_H_
@@ -0,0 +1,236 @@
+#ifndef _CENTER_CONTRACT_SNAPSHOT_H_
+#define _CENTER_CONTRACT_SNAPSHOT_H_
+
+#include <iostream>
+#include <map>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * @brief 读者编号的分配器，线程退出时通过 pthread key 的析构函数归还编号
+ * 编号在所有 SnapshotPtr 之间共用。对象在堆上分配、从不释放，进程退出时仍有线程在结束也能安全归还。
+ */
+struct EpochReaderIds
+{
+	pthread_mutex_t mutex;
+	pthread_key_t key;
+	std::vector<int> free_ids;  // 已经退出的线程归还的编号
+	int next_id;                // 从未分配过的最小编号
+
+	static EpochReaderIds* Instance() {
+		static EpochReaderIds* ids = Create();
+		return ids;
+	}
+
+	static EpochReaderIds* Create() {
+		EpochReaderIds* ids = new EpochReaderIds;
+		pthread_mutex_init(&ids->mutex, NULL);
+		pthread_key_create(&ids->key, Release);
+		ids->next_id = 0;
+		return ids;
+	}
+
+	// 线程退出时调用，value 为编号加 1
+	static void Release(void* value) {
+		EpochReaderIds* ids = Instance();
+		pthread_mutex_lock(&ids->mutex);
+		ids->free_ids.push_back(static_cast<int>(reinterpret_cast<intptr_t>(value)) - 1);
+		pthread_mutex_unlock(&ids->mutex);
+	}
+
+	int Acquire(int max_readers) {
+		int id = -1;
+		pthread_mutex_lock(&mutex);
+		if (!free_ids.empty()) {
+			id = free_ids.back();
+			free_ids.pop_back();
+		} else if (next_id < max_readers) {
+			id = next_id++;
+		}
+		pthread_mutex_unlock(&mutex);
+		if (id >= 0) {
+			pthread_setspecific(key, reinterpret_cast<void*>(static_cast<intptr_t>(id) + 1));
+		}
+		return id;
+	}
+};
+
+/**
+ * @brief 获取当前线程的读者编号
+ * 每个线程第一次调用时分配一个编号，之后一直不变，线程退出后编号可以分给新的线程。
+ * @return 读者编号，同时存在的线程超过 max_readers 时返回 -1，并且该线程以后一直返回 -1
+ */
+inline int EpochReaderId(int max_readers)
+{
+	// -2 表示还没有分配，-1 表示没有分到编号，结果都缓存起来，只有第一次调用需要加锁
+	static __thread int reader_id = -2;
+	if (reader_id == -2) {
+		reader_id = EpochReaderIds::Instance()->Acquire(max_readers);
+	}
+	return reader_id;
+}
+
+/**
+ * @brief RCU 风格的只读快照指针
+ * 写者（ZooKeeper 的 watcher 回调）构造一份新的数据，通过原子交换整体发布，旧的数据挂在
+ * 回收列表上，等所有可能持有它的读者都离开之后才释放（基于 epoch 的回收）。
+ * 读者（调用 QueryService 的工作线程）只需要写一次自己的 epoch 槽位、读一次指针，不加锁、
+ * 不等待，写者发布时也不会阻塞读者。
+ * @note 只允许一个写者线程，快照发布后不能再修改。
+ */
+template<typename T>
+class SnapshotPtr
+{
+public:
+	static const int MAX_READER_THREADS = 128;
+
+	/**
+	 * @brief 读者的作用域守卫，守卫存在期间 get() 返回的快照不会被释放
+	 * 同一个线程可以嵌套使用。
+	 */
+	class ReadGuard
+	{
+	public:
+		explicit ReadGuard(const SnapshotPtr<T>& owner) : owner_(owner), slot_(NULL) {
+			int id = EpochReaderId(MAX_READER_THREADS);
+			if (id >= 0) {
+				slot_ = &owner_.slots_[id];
+				if (slot_->depth++ == 0) {
+					// 先登记 epoch 再读指针，写者通过全屏障保证看得到这次登记
+					__atomic_store_n(&slot_->epoch,
+					                 __atomic_load_n(&owner_.epoch_, __ATOMIC_SEQ_CST),
+					                 __ATOMIC_SEQ_CST);
+				}
+			} else {
+				// 没有分到槽位的线程共用一个计数，计数不为 0 时写者不回收任何快照
+				__atomic_add_fetch(&owner_.overflow_readers_, 1, __ATOMIC_SEQ_CST);
+			}
+			snapshot_ = __atomic_load_n(&owner_.current_, __ATOMIC_SEQ_CST);
+		}
+
+		~ReadGuard() {
+			if (slot_ == NULL) {
+				__atomic_sub_fetch(&owner_.overflow_readers_, 1, __ATOMIC_RELEASE);
+			} else if (--slot_->depth == 0) {
+				__atomic_store_n(&slot_->epoch, 0, __ATOMIC_RELEASE);
+			}
+		}
+
+		inline const T* get() const {
+			return snapshot_;
+		}
+
+		inline const T* operator->() const {
+			return snapshot_;
+		}
+
+	private:
+		ReadGuard(const ReadGuard&);
+		ReadGuard& operator=(const ReadGuard&);
+
+		const SnapshotPtr<T>& owner_;
+		typename SnapshotPtr<T>::Slot* slot_;
+		const T* snapshot_;
+	};
+
+	explicit SnapshotPtr(T* initial = NULL) : current_(initial), epoch_(1), overflow_readers_(0) {
+		for (int i = 0; i < MAX_READER_THREADS; i++) {
+			slots_[i].epoch = 0;
+			slots_[i].depth = 0;
+		}
+	}
+
+	~SnapshotPtr() {
+		for (size_t i = 0; i < retired_.size(); i++) {
+			delete retired_[i].snapshot;
+		}
+		delete current_;
+	}
+
+	/**
+	 * @brief 发布一份新的快照，旧的快照进入回收列表
+	 * @param next 新的快照，所有权转移给此对象
+	 * @note 只能在写者线程调用
+	 */
+	void Publish(T* next) {
+		Retired old;
+		old.snapshot = __atomic_exchange_n(&current_, next, __ATOMIC_SEQ_CST);
+		old.epoch = __atomic_fetch_add(&epoch_, 1, __ATOMIC_SEQ_CST);
+		if (old.snapshot != NULL) {
+			retired_.push_back(old);
+		}
+		Reclaim();
+	}
+
+	/**
+	 * @brief 释放已经没有读者持有的旧快照
+	 * @return 仍在等待回收的快照数量
+	 * @note 只能在写者线程调用，Publish() 会自动调用，也可以在 Update() 中定期调用
+	 */
+	int Reclaim() {
+		if (retired_.empty()) {
+			return 0;
+		}
+		if (__atomic_load_n(&overflow_readers_, __ATOMIC_SEQ_CST) != 0) {
+			return static_cast<int>(retired_.size());
+		}
+		// 在旧快照退休之后才进入的读者 epoch 一定更大，只有 epoch 小于等于退休时刻的读者可能还持有它
+		uint64_t min_active = UINT64_MAX;
+		for (int i = 0; i < MAX_READER_THREADS; i++) {
+			uint64_t e = __atomic_load_n(&slots_[i].epoch, __ATOMIC_SEQ_CST);
+			if (e != 0 && e < min_active) {
+				min_active = e;
+			}
+		}
+		size_t kept = 0;
+		for (size_t i = 0; i < retired_.size(); i++) {
+			if (retired_[i].epoch < min_active) {
+				delete retired_[i].snapshot;
+			} else {
+				retired_[kept++] = retired_[i];
+			}
+		}
+		retired_.resize(kept);
+		return static_cast<int>(kept);
+	}
+
+	/**
+	 * @brief 写者读取当前快照，用来复制出下一份快照
+	 * @note 只能在写者线程调用
+	 */
+	inline const T* writer_view() const {
+		return current_;
+	}
+
+private:
+	SnapshotPtr(const SnapshotPtr&);
+	SnapshotPtr& operator=(const SnapshotPtr&);
+
+	// 每个读者独占一条 cache line，避免读者之间的伪共享
+	struct Slot {
+		uint64_t epoch;     // 0 表示不在读
+		int depth;          // 同一线程的嵌套层数，只有本线程访问
+		char padding[64 - sizeof(uint64_t) - sizeof(int)];
+	};
+
+	struct Retired {
+		T* snapshot;
+		uint64_t epoch;
+	};
+
+	T* current_;
+	uint64_t epoch_;
+	mutable int overflow_readers_;
+	mutable Slot slots_[MAX_READER_THREADS];
+	std::vector<Retired> retired_;
+};
+
+/**
+ * @brief 集群中所有服务合同的快照
+ * key 为服务名字，value 为该服务所有进程的合同缓存
+ */
+typedef std::map<std::string, ContractCache> ContractSet;
+
+#endif  // _CENTER_CONTRACT_SNAPSHOT_H_
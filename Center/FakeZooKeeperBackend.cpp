@@ -0,0 +1,508 @@
+#include <stdio.h>
+
+#include "FakeZooKeeperBackend.h"
+
+FakeZooKeeperEnsemble::FakeZooKeeperEnsemble()
+	: next_session_id_(1), in_multi_(false)
+{
+	Node& root = nodes_["/"];
+	root.version = 0;
+	root.ephemeral_owner = 0;
+	root.sequence = 0;
+}
+
+FakeZooKeeperEnsemble::~FakeZooKeeperEnsemble()
+{
+}
+
+bool FakeZooKeeperEnsemble::ValidPath(const std::string& path)
+{
+	if (path.empty() || path[0] != '/') {
+		return false;
+	}
+	if (path.size() > 1 && path[path.size() - 1] == '/') {
+		return false;
+	}
+	return path.find("//") == std::string::npos;
+}
+
+std::string FakeZooKeeperEnsemble::ParentPath(const std::string& path)
+{
+	size_t pos = path.rfind('/');
+	return pos == 0 ? "/" : path.substr(0, pos);
+}
+
+int64_t FakeZooKeeperEnsemble::OpenSession(FakeZooKeeperBackend* client)
+{
+	int64_t session_id = next_session_id_++;
+	sessions_[session_id] = client;
+	return session_id;
+}
+
+int FakeZooKeeperEnsemble::ExpireSession(int64_t session_id)
+{
+	std::map<int64_t, FakeZooKeeperBackend*>::iterator it = sessions_.find(session_id);
+	if (it == sessions_.end()) {
+		return kZkSessionExpired;
+	}
+	FakeZooKeeperBackend* client = it->second;
+	CloseSession(session_id);
+	client->OnExpired();
+	return kZkOk;
+}
+
+void FakeZooKeeperEnsemble::CloseSession(int64_t session_id)
+{
+	std::map<int64_t, FakeZooKeeperBackend*>::iterator it = sessions_.find(session_id);
+	if (it == sessions_.end()) {
+		return;
+	}
+	FakeZooKeeperBackend* client = it->second;
+	sessions_.erase(it);
+
+	// 先清除这个客户端自己的监听，删除临时节点时就不会再通知它
+	WatchTable* tables[] = { &data_watches_, &child_watches_ };
+	for (size_t t = 0; t < sizeof(tables) / sizeof(tables[0]); t++) {
+		WatchTable::iterator w = tables[t]->begin();
+		while (w != tables[t]->end()) {
+			std::vector<Watch>& watches = w->second;
+			size_t kept = 0;
+			for (size_t i = 0; i < watches.size(); i++) {
+				if (watches[i].client != client) {
+					watches[kept++] = watches[i];
+				}
+			}
+			watches.resize(kept);
+			if (watches.empty()) {
+				tables[t]->erase(w++);
+			} else {
+				++w;
+			}
+		}
+	}
+
+	std::map<int64_t, std::set<std::string> >::iterator eph = ephemerals_.find(session_id);
+	if (eph != ephemerals_.end()) {
+		std::set<std::string> paths;
+		paths.swap(eph->second);
+		ephemerals_.erase(eph);
+		for (std::set<std::string>::iterator p = paths.begin(); p != paths.end(); ++p) {
+			Delete(*p, -1);
+		}
+	}
+}
+
+void FakeZooKeeperEnsemble::AddWatch(WatchTable* table, const std::string& path,
+                                     FakeZooKeeperBackend* client, ZooKeeperWatcher* watcher)
+{
+	if (watcher == NULL) {
+		return;
+	}
+	std::vector<Watch>& watches = (*table)[path];
+	for (size_t i = 0; i < watches.size(); i++) {
+		// 和 ZooKeeper 一样，同一个监听对同一个节点只注册一次
+		if (watches[i].client == client && watches[i].watcher == watcher) {
+			return;
+		}
+	}
+	Watch watch;
+	watch.client = client;
+	watch.watcher = watcher;
+	watches.push_back(watch);
+}
+
+void FakeZooKeeperEnsemble::Trigger(WatchTable* table, const std::string& path, int type)
+{
+	if (in_multi_) {
+		PendingTrigger pending;
+		pending.table = table;
+		pending.path = path;
+		pending.type = type;
+		pending_triggers_.push_back(pending);
+		return;
+	}
+	WatchTable::iterator it = table->find(path);
+	if (it == table->end()) {
+		return;
+	}
+	std::vector<Watch> watches;
+	watches.swap(it->second);
+	table->erase(it);
+	for (size_t i = 0; i < watches.size(); i++) {
+		watches[i].client->PushEvent(watches[i].watcher, type, kZkConnectedState, path);
+	}
+}
+
+int FakeZooKeeperEnsemble::Create(int64_t session_id, const std::string& path,
+                                  const std::string& value, int flags, std::string* created_path)
+{
+	if (!ValidPath(path) || path == "/") {
+		return kZkBadArguments;
+	}
+	std::map<std::string, Node>::iterator parent = nodes_.find(ParentPath(path));
+	if (parent == nodes_.end()) {
+		return kZkNoNode;
+	}
+	if (parent->second.ephemeral_owner != 0) {
+		return kZkNoChildrenForEphemerals;
+	}
+
+	std::string real_path = path;
+	if (flags & kZkSequence) {
+		char seq[16];
+		snprintf(seq, sizeof(seq), "%010d", parent->second.sequence);
+		real_path += seq;
+	}
+	if (nodes_.find(real_path) != nodes_.end()) {
+		return kZkNodeExists;
+	}
+	parent->second.sequence++;
+	parent->second.children.insert(real_path.substr(real_path.rfind('/') + 1));
+
+	Node& node = nodes_[real_path];
+	node.value = value;
+	node.version = 0;
+	node.ephemeral_owner = (flags & kZkEphemeral) ? session_id : 0;
+	node.sequence = 0;
+	if (node.ephemeral_owner != 0) {
+		ephemerals_[session_id].insert(real_path);
+	}
+	if (created_path != NULL) {
+		*created_path = real_path;
+	}
+
+	Trigger(&data_watches_, real_path, kZkCreatedEvent);
+	Trigger(&child_watches_, ParentPath(real_path), kZkChildEvent);
+	return kZkOk;
+}
+
+int FakeZooKeeperEnsemble::Delete(const std::string& path, int version)
+{
+	if (!ValidPath(path) || path == "/") {
+		return kZkBadArguments;
+	}
+	std::map<std::string, Node>::iterator it = nodes_.find(path);
+	if (it == nodes_.end()) {
+		return kZkNoNode;
+	}
+	if (version >= 0 && version != it->second.version) {
+		return kZkBadVersion;
+	}
+	if (!it->second.children.empty()) {
+		return kZkNotEmpty;
+	}
+	if (it->second.ephemeral_owner != 0) {
+		std::map<int64_t, std::set<std::string> >::iterator eph =
+			ephemerals_.find(it->second.ephemeral_owner);
+		if (eph != ephemerals_.end()) {
+			eph->second.erase(path);
+		}
+	}
+	nodes_.erase(it);
+	std::string parent = ParentPath(path);
+	nodes_[parent].children.erase(path.substr(path.rfind('/') + 1));
+
+	Trigger(&data_watches_, path, kZkDeletedEvent);
+	Trigger(&child_watches_, path, kZkDeletedEvent);
+	Trigger(&child_watches_, parent, kZkChildEvent);
+	return kZkOk;
+}
+
+int FakeZooKeeperEnsemble::Set(const std::string& path, const std::string& value, int version)
+{
+	std::map<std::string, Node>::iterator it = nodes_.find(path);
+	if (it == nodes_.end()) {
+		return ValidPath(path) ? kZkNoNode : kZkBadArguments;
+	}
+	if (version >= 0 && version != it->second.version) {
+		return kZkBadVersion;
+	}
+	it->second.value = value;
+	it->second.version++;
+	Trigger(&data_watches_, path, kZkChangedEvent);
+	return kZkOk;
+}
+
+int FakeZooKeeperEnsemble::Get(FakeZooKeeperBackend* client, const std::string& path,
+                               std::string* value, ZooKeeperWatcher* watcher)
+{
+	std::map<std::string, Node>::iterator it = nodes_.find(path);
+	if (it == nodes_.end()) {
+		return ValidPath(path) ? kZkNoNode : kZkBadArguments;
+	}
+	if (value != NULL) {
+		*value = it->second.value;
+	}
+	AddWatch(&data_watches_, path, client, watcher);
+	return kZkOk;
+}
+
+int FakeZooKeeperEnsemble::Exists(FakeZooKeeperBackend* client, const std::string& path,
+                                  ZooKeeperWatcher* watcher)
+{
+	if (!ValidPath(path)) {
+		return kZkBadArguments;
+	}
+	// 节点不存在时也注册监听，等待节点建立
+	AddWatch(&data_watches_, path, client, watcher);
+	return nodes_.find(path) != nodes_.end() ? kZkOk : kZkNoNode;
+}
+
+int FakeZooKeeperEnsemble::GetChildren(FakeZooKeeperBackend* client, const std::string& path,
+                                       std::vector<std::string>* children,
+                                       ZooKeeperWatcher* watcher)
+{
+	std::map<std::string, Node>::iterator it = nodes_.find(path);
+	if (it == nodes_.end()) {
+		return ValidPath(path) ? kZkNoNode : kZkBadArguments;
+	}
+	if (children != NULL) {
+		children->assign(it->second.children.begin(), it->second.children.end());
+	}
+	AddWatch(&child_watches_, path, client, watcher);
+	return kZkOk;
+}
+
+void FakeZooKeeperEnsemble::RecordUndo(std::vector<Undo>* undo, const std::string& path)
+{
+	Undo record;
+	record.path = path;
+	std::map<std::string, Node>::iterator it = nodes_.find(path);
+	record.existed = it != nodes_.end();
+	if (record.existed) {
+		record.node = it->second;
+	}
+	undo->push_back(record);
+}
+
+void FakeZooKeeperEnsemble::Rollback(const std::vector<Undo>& undo)
+{
+	for (size_t i = undo.size(); i > 0; i--) {
+		const Undo& record = undo[i - 1];
+		std::map<std::string, Node>::iterator it = nodes_.find(record.path);
+		if (it != nodes_.end() && it->second.ephemeral_owner != 0) {
+			ephemerals_[it->second.ephemeral_owner].erase(record.path);
+		}
+		if (!record.existed) {
+			if (it != nodes_.end()) {
+				nodes_.erase(it);
+			}
+			continue;
+		}
+		nodes_[record.path] = record.node;
+		if (record.node.ephemeral_owner != 0) {
+			ephemerals_[record.node.ephemeral_owner].insert(record.path);
+		}
+	}
+}
+
+int FakeZooKeeperEnsemble::Multi(int64_t session_id, const std::vector<ZkOp>& ops,
+                                 std::vector<ZkOpResult>* results)
+{
+	results->assign(ops.size(), ZkOpResult());
+	std::vector<Undo> undo;
+	in_multi_ = true;
+	int rc = kZkOk;
+	size_t failed = ops.size();
+	for (size_t i = 0; i < ops.size() && rc == kZkOk; i++) {
+		const ZkOp& op = ops[i];
+		switch (op.type) {
+			case kZkCreateOp:
+				RecordUndo(&undo, ParentPath(op.path));
+				rc = Create(session_id, op.path, op.value, op.flags, &(*results)[i].created_path);
+				if (rc == kZkOk) {
+					Undo created;
+					created.path = (*results)[i].created_path;
+					created.existed = false;
+					undo.push_back(created);
+				}
+				break;
+			case kZkDeleteOp:
+				RecordUndo(&undo, op.path);
+				RecordUndo(&undo, ParentPath(op.path));
+				rc = Delete(op.path, op.version);
+				break;
+			case kZkSetOp:
+				RecordUndo(&undo, op.path);
+				rc = Set(op.path, op.value, op.version);
+				break;
+			case kZkCheckOp: {
+				std::map<std::string, Node>::iterator it = nodes_.find(op.path);
+				if (it == nodes_.end()) {
+					rc = kZkNoNode;
+				} else if (op.version >= 0 && op.version != it->second.version) {
+					rc = kZkBadVersion;
+				}
+				break;
+			}
+			default:
+				rc = kZkBadArguments;
+				break;
+		}
+		(*results)[i].rc = rc;
+		if (rc != kZkOk) {
+			failed = i;
+		}
+	}
+	in_multi_ = false;
+
+	std::vector<PendingTrigger> pending;
+	pending.swap(pending_triggers_);
+	if (rc != kZkOk) {
+		Rollback(undo);
+		// 和 ZooKeeper 一样，出错操作之外的结果都标记为未执行
+		for (size_t i = 0; i < results->size(); i++) {
+			if (i != failed) {
+				(*results)[i].rc = kZkRuntimeInconsistency;
+				(*results)[i].created_path.clear();
+			}
+		}
+		return rc;
+	}
+	for (size_t i = 0; i < pending.size(); i++) {
+		Trigger(pending[i].table, pending[i].path, pending[i].type);
+	}
+	return kZkOk;
+}
+
+FakeZooKeeperBackend::FakeZooKeeperBackend(FakeZooKeeperEnsemble* ensemble)
+	: ensemble_(ensemble), session_watcher_(NULL), session_id_(0), expired_(false)
+{
+}
+
+FakeZooKeeperBackend::~FakeZooKeeperBackend()
+{
+	Close();
+}
+
+int FakeZooKeeperBackend::Connect(const std::string& hosts, int recv_timeout_ms,
+                                  ZooKeeperWatcher* session_watcher)
+{
+	if (session_id_ != 0) {
+		return kZkInvalidState;
+	}
+	session_watcher_ = session_watcher;
+	session_id_ = ensemble_->OpenSession(this);
+	expired_ = false;
+	PushEvent(NULL, kZkSessionEvent, kZkConnectedState, "");
+	return kZkOk;
+}
+
+void FakeZooKeeperBackend::Close()
+{
+	if (session_id_ != 0 && !expired_) {
+		ensemble_->CloseSession(session_id_);
+	}
+	session_id_ = 0;
+	expired_ = false;
+	events_.clear();
+	// 与真实的客户端一致，已经完成、还未回调的批量操作在关闭时回调
+	std::vector<MultiDone> multi_done;
+	multi_done.swap(multi_done_);
+	for (size_t i = 0; i < multi_done.size(); i++) {
+		multi_done[i].callback->OnMulti(multi_done[i].rc, multi_done[i].results);
+	}
+}
+
+void FakeZooKeeperBackend::OnExpired()
+{
+	expired_ = true;
+	PushEvent(NULL, kZkSessionEvent, kZkExpiredSessionState, "");
+}
+
+int FakeZooKeeperBackend::Update()
+{
+	std::vector<Event> events;
+	events.swap(events_);
+	for (size_t i = 0; i < events.size(); i++) {
+		ZooKeeperWatcher* watcher = events[i].watcher ? events[i].watcher : session_watcher_;
+		if (watcher != NULL) {
+			watcher->OnWatch(events[i].type, events[i].state, events[i].path);
+		}
+	}
+
+	std::vector<MultiDone> multi_done;
+	multi_done.swap(multi_done_);
+	for (size_t i = 0; i < multi_done.size(); i++) {
+		multi_done[i].callback->OnMulti(multi_done[i].rc, multi_done[i].results);
+	}
+	return static_cast<int>(events.size() + multi_done.size());
+}
+
+void FakeZooKeeperBackend::PushEvent(ZooKeeperWatcher* watcher, int type, int state,
+                                     const std::string& path)
+{
+	Event event;
+	event.watcher = watcher;
+	event.type = type;
+	event.state = state;
+	event.path = path;
+	events_.push_back(event);
+}
+
+#define FAKE_ZK_CHECK_SESSION() \
+	if (session_id_ == 0) { \
+		return kZkInvalidState; \
+	} \
+	if (expired_) { \
+		return kZkSessionExpired; \
+	}
+
+int FakeZooKeeperBackend::Create(const std::string& path, const std::string& value, int flags,
+                                 std::string* created_path)
+{
+	FAKE_ZK_CHECK_SESSION();
+	return ensemble_->Create(session_id_, path, value, flags, created_path);
+}
+
+int FakeZooKeeperBackend::Delete(const std::string& path, int version)
+{
+	FAKE_ZK_CHECK_SESSION();
+	return ensemble_->Delete(path, version);
+}
+
+int FakeZooKeeperBackend::Set(const std::string& path, const std::string& value, int version)
+{
+	FAKE_ZK_CHECK_SESSION();
+	return ensemble_->Set(path, value, version);
+}
+
+int FakeZooKeeperBackend::Get(const std::string& path, std::string* value,
+                              ZooKeeperWatcher* watcher)
+{
+	FAKE_ZK_CHECK_SESSION();
+	return ensemble_->Get(this, path, value, watcher);
+}
+
+int FakeZooKeeperBackend::Exists(const std::string& path, ZooKeeperWatcher* watcher)
+{
+	FAKE_ZK_CHECK_SESSION();
+	return ensemble_->Exists(this, path, watcher);
+}
+
+int FakeZooKeeperBackend::GetChildren(const std::string& path,
+                                      std::vector<std::string>* children,
+                                      ZooKeeperWatcher* watcher)
+{
+	FAKE_ZK_CHECK_SESSION();
+	return ensemble_->GetChildren(this, path, children, watcher);
+}
+
+int FakeZooKeeperBackend::AMulti(const std::vector<ZkOp>& ops, ZkMultiCallback* callback)
+{
+	FAKE_ZK_CHECK_SESSION();
+	if (ops.empty() || callback == NULL) {
+		return kZkBadArguments;
+	}
+	// 立即在模拟集群上执行，结果和真实后端一样在 Update() 中回调
+	MultiDone done;
+	done.callback = callback;
+	done.rc = ensemble_->Multi(session_id_, ops, &done.results);
+	multi_done_.push_back(done);
+	return kZkOk;
+}
+
+int64_t FakeZooKeeperBackend::session_id() const
+{
+	return expired_ ? 0 : session_id_;
+}
@@ -0,0 +1,164 @@
+#ifndef _CENTER_FAKE_ZOOKEEPER_BACKEND_H_
+#define _CENTER_FAKE_ZOOKEEPER_BACKEND_H_
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "ZooKeeperBackend.h"
+
+class FakeZooKeeperBackend;
+
+/**
+ * @brief 进程内模拟的 ZooKeeper 集群
+ * 保存一棵 znode 树，支持临时节点、顺序节点、一次性监听以及会话过期模拟。多个
+ * FakeZooKeeperBackend 连接同一个对象，就相当于多个进程连接同一个 ZooKeeper 集群，
+ * 可以在一台机器上模拟成千上万个进程的注册、查询和成员变化。
+ * @note 没有加锁，所有模拟的进程需要在同一个线程中驱动。
+ */
+class FakeZooKeeperEnsemble
+{
+public:
+	FakeZooKeeperEnsemble();
+	virtual ~FakeZooKeeperEnsemble();
+
+	/**
+	 * @brief 模拟服务器判定会话过期：删除此会话的临时节点、清除它的监听，并通知客户端
+	 * @return kZkOk 成功，kZkSessionExpired 表示会话已经不存在
+	 */
+	int ExpireSession(int64_t session_id);
+
+	/// @brief 当前的 znode 数量（不含根节点）
+	inline size_t node_num() const {
+		return nodes_.size() - 1;
+	}
+
+	/// @brief 当前存活的会话数量
+	inline size_t session_num() const {
+		return sessions_.size();
+	}
+
+private:
+	friend class FakeZooKeeperBackend;
+
+	struct Node {
+		std::string value;
+		int version;
+		int64_t ephemeral_owner;            // 0 表示持久节点
+		int sequence;                       // 下一个顺序子节点的序号
+		std::set<std::string> children;
+	};
+
+	struct Watch {
+		FakeZooKeeperBackend* client;
+		ZooKeeperWatcher* watcher;
+	};
+	typedef std::map<std::string, std::vector<Watch> > WatchTable;
+
+	// 批量操作的回滚记录：existed 为 false 表示回滚时删除此节点，否则恢复为 node
+	struct Undo {
+		std::string path;
+		bool existed;
+		Node node;
+	};
+
+	struct PendingTrigger {
+		WatchTable* table;
+		std::string path;
+		int type;
+	};
+
+	void RecordUndo(std::vector<Undo>* undo, const std::string& path);
+	void Rollback(const std::vector<Undo>& undo);
+
+	int64_t OpenSession(FakeZooKeeperBackend* client);
+	void CloseSession(int64_t session_id);
+
+	int Create(int64_t session_id, const std::string& path, const std::string& value,
+	           int flags, std::string* created_path);
+	int Delete(const std::string& path, int version);
+	int Set(const std::string& path, const std::string& value, int version);
+	int Get(FakeZooKeeperBackend* client, const std::string& path, std::string* value,
+	        ZooKeeperWatcher* watcher);
+	int Exists(FakeZooKeeperBackend* client, const std::string& path, ZooKeeperWatcher* watcher);
+	int GetChildren(FakeZooKeeperBackend* client, const std::string& path,
+	                std::vector<std::string>* children, ZooKeeperWatcher* watcher);
+	// 原子执行一组操作，任何一个失败都会回滚全部已执行的操作
+	int Multi(int64_t session_id, const std::vector<ZkOp>& ops, std::vector<ZkOpResult>* results);
+
+	// 触发并移除 path 上的监听，批量操作执行期间先暂存，成功后再触发
+	void Trigger(WatchTable* table, const std::string& path, int type);
+	void AddWatch(WatchTable* table, const std::string& path,
+	              FakeZooKeeperBackend* client, ZooKeeperWatcher* watcher);
+
+	static bool ValidPath(const std::string& path);
+	static std::string ParentPath(const std::string& path);
+
+	std::map<std::string, Node> nodes_;
+	WatchTable data_watches_;                       // Get/Exists 注册的监听
+	WatchTable child_watches_;                      // GetChildren 注册的监听
+	std::map<int64_t, FakeZooKeeperBackend*> sessions_;
+	std::map<int64_t, std::set<std::string> > ephemerals_;
+	int64_t next_session_id_;
+	bool in_multi_;
+	std::vector<PendingTrigger> pending_triggers_;
+};
+
+/**
+ * @brief 连接到 FakeZooKeeperEnsemble 的后端，代表一个模拟的进程
+ * 监听回调和真实后端一样，在 Update() 中发起。
+ */
+class FakeZooKeeperBackend : public ZooKeeperBackend
+{
+public:
+	explicit FakeZooKeeperBackend(FakeZooKeeperEnsemble* ensemble);
+	virtual ~FakeZooKeeperBackend();
+
+	virtual int Connect(const std::string& hosts, int recv_timeout_ms,
+	                    ZooKeeperWatcher* session_watcher);
+	virtual void Close();
+	virtual int Update();
+
+	virtual int Create(const std::string& path, const std::string& value, int flags,
+	                   std::string* created_path);
+	virtual int Delete(const std::string& path, int version = -1);
+	virtual int Set(const std::string& path, const std::string& value, int version = -1);
+	virtual int Get(const std::string& path, std::string* value, ZooKeeperWatcher* watcher = NULL);
+	virtual int Exists(const std::string& path, ZooKeeperWatcher* watcher = NULL);
+	virtual int GetChildren(const std::string& path, std::vector<std::string>* children,
+	                        ZooKeeperWatcher* watcher = NULL);
+	virtual int AMulti(const std::vector<ZkOp>& ops, ZkMultiCallback* callback);
+	virtual int64_t session_id() const;
+
+private:
+	friend class FakeZooKeeperEnsemble;
+
+	struct MultiDone {
+		ZkMultiCallback* callback;
+		int rc;
+		std::vector<ZkOpResult> results;
+	};
+
+	struct Event {
+		ZooKeeperWatcher* watcher;
+		int type;
+		int state;
+		std::string path;
+	};
+
+	void PushEvent(ZooKeeperWatcher* watcher, int type, int state, const std::string& path);
+	// 会话被集群判定过期
+	void OnExpired();
+
+	FakeZooKeeperEnsemble* ensemble_;
+	ZooKeeperWatcher* session_watcher_;
+	int64_t session_id_;
+	bool expired_;
+	std::vector<Event> events_;
+	std::vector<MultiDone> multi_done_;
+};
+
+#endif  // _CENTER_FAKE_ZOOKEEPER_BACKEND_H_
@@ -0,0 +1,179 @@
+#include <assert.h>
+#include <set>
+#include <time.h>
+
+#include "ServiceRegistrar.h"
+
+ServiceRegistrar::ServiceRegistrar(ZooKeeperBackend* backend, int max_batch)
+	: backend_(backend), max_batch_(max_batch > 0 ? max_batch : 1), last_error_(kZkOk)
+{
+}
+
+ServiceRegistrar::~ServiceRegistrar()
+{
+	// 后端还持有 this，回调时会访问已经释放的对象
+	assert(in_flight_.empty());
+}
+
+void ServiceRegistrar::Add(const std::string& parent_path, const std::string& node_path,
+                           const std::string& value, int flags)
+{
+	Entry entry;
+	entry.parent_path = parent_path;
+	entry.op.type = kZkCreateOp;
+	entry.op.path = node_path;
+	entry.op.value = value;
+	entry.op.flags = flags;
+	pending_.push_back(entry);
+}
+
+int ServiceRegistrar::Flush()
+{
+	return FlushReady(true);
+}
+
+int ServiceRegistrar::FlushReady(bool ensure_parents)
+{
+	if (!in_flight_.empty() || pending_.empty()) {
+		return 0;
+	}
+
+	// 退避中的节点保持原来的顺序留在 pending_ 中
+	int64_t now = NowMs();
+	std::vector<Entry> batch;
+	std::vector<Entry> rest;
+	std::set<std::string> parents;
+	for (size_t i = 0; i < pending_.size(); i++) {
+		Entry& entry = pending_[i];
+		if (batch.size() >= static_cast<size_t>(max_batch_) || entry.retry_at_ms > now
+			|| (entry.ensure_parent && !ensure_parents)) {
+			rest.push_back(entry);
+			continue;
+		}
+		if (entry.ensure_parent) {
+			// 同一个目录只建立一次，建立失败的节点退避后再试
+			if (parents.count(entry.parent_path) == 0) {
+				int ret = EnsurePath(entry.parent_path);
+				if (ret != kZkOk) {
+					last_error_ = ret;
+					Backoff(&entry, now);
+					rest.push_back(entry);
+					continue;
+				}
+				parents.insert(entry.parent_path);
+			}
+			entry.ensure_parent = false;
+		}
+		batch.push_back(entry);
+	}
+	if (batch.empty()) {
+		pending_.swap(rest);
+		return 0;
+	}
+
+	std::vector<ZkOp> ops;
+	ops.reserve(batch.size());
+	for (size_t i = 0; i < batch.size(); i++) {
+		ops.push_back(batch[i].op);
+	}
+
+	int ret = backend_->AMulti(ops, this);
+	if (ret != kZkOk) {
+		last_error_ = ret;
+		return ret;
+	}
+	in_flight_.swap(batch);
+	pending_.swap(rest);
+	return static_cast<int>(in_flight_.size());
+}
+
+void ServiceRegistrar::OnMulti(int rc, const std::vector<ZkOpResult>& results)
+{
+	std::vector<Entry> batch;
+	batch.swap(in_flight_);
+	last_error_ = rc;
+
+	if (rc == kZkOk) {
+		for (size_t i = 0; i < results.size(); i++) {
+			created_paths_.push_back(results[i].created_path);
+		}
+		// 还有剩余的节点就继续下一批，不必等到下一次 Update()
+		FlushReady(false);
+		return;
+	}
+
+	// 批量操作整体失败，找到出错的那个操作再决定如何重试
+	size_t failed = batch.size();
+	for (size_t i = 0; i < results.size() && i < batch.size(); i++) {
+		if (results[i].rc != kZkOk && results[i].rc != kZkRuntimeInconsistency) {
+			failed = i;
+			break;
+		}
+	}
+	int op_rc = failed < batch.size() ? results[failed].rc : rc;
+	int64_t now = NowMs();
+	bool backoff_all = false;
+	if (failed < batch.size() && op_rc == kZkNoNode) {
+		// 服务目录还不存在（此服务第一次出现在集群中），ZooKeeper 只报告第一个失败的操作，
+		// 启动时往往整批都是新服务，所以这一批涉及的目录都在下一次 Flush() 中建立好后整批重试；
+		// 这里运行在后端的 Update() 中，不能执行同步的 Create
+		for (size_t i = failed; i < batch.size(); i++) {
+			batch[i].ensure_parent = true;
+		}
+	} else if (failed < batch.size() && op_rc == kZkNodeExists) {
+		// 节点已经存在，通常是上一个会话的临时节点还未过期，会话过期后节点消失就能建立成功；
+		// 只推迟这一个节点，其余的立即重试
+		Backoff(&batch[failed], now);
+	} else if (failed < batch.size() && IsPermanentError(op_rc)) {
+		failed_paths_.push_back(batch[failed].op.path);
+		batch.erase(batch.begin() + failed);
+	} else {
+		// 连接断开、会话关闭等，整批退避后重试
+		backoff_all = true;
+	}
+	if (backoff_all) {
+		for (size_t i = 0; i < batch.size(); i++) {
+			Backoff(&batch[i], now);
+		}
+	}
+	pending_.insert(pending_.begin(), batch.begin(), batch.end());
+}
+
+void ServiceRegistrar::Backoff(Entry* entry, int64_t now_ms)
+{
+	static const int kMinRetryDelayMs = 100;
+	static const int kMaxRetryDelayMs = 30000;
+	entry->retry_delay_ms = entry->retry_delay_ms > 0 ? entry->retry_delay_ms * 2 : kMinRetryDelayMs;
+	if (entry->retry_delay_ms > kMaxRetryDelayMs) {
+		entry->retry_delay_ms = kMaxRetryDelayMs;
+	}
+	entry->retry_at_ms = now_ms + entry->retry_delay_ms;
+}
+
+bool ServiceRegistrar::IsPermanentError(int rc)
+{
+	return rc == kZkBadArguments || rc == kZkNoChildrenForEphemerals;
+}
+
+int64_t ServiceRegistrar::NowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+int ServiceRegistrar::EnsurePath(const std::string& path)
+{
+	if (path.empty() || path == "/") {
+		return kZkOk;
+	}
+	int ret = backend_->Create(path, "", kZkPersistent, NULL);
+	if (ret == kZkNoNode) {
+		size_t pos = path.rfind('/');
+		ret = EnsurePath(pos == 0 ? "/" : path.substr(0, pos));
+		if (ret == kZkOk) {
+			ret = backend_->Create(path, "", kZkPersistent, NULL);
+		}
+	}
+	return ret == kZkNodeExists ? kZkOk : ret;
+}
@@ -0,0 +1,110 @@
+#ifndef _CENTER_SERVICE_REGISTRAR_H_
+#define _CENTER_SERVICE_REGISTRAR_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "ZooKeeperBackend.h"
+
+/**
+ * @brief 批量注册服务合同
+ * 进程启动时会注册大量服务，如果每个节点单独建立，每个服务都需要一次 ZooKeeper 往返。
+ * 这里先把要建立的节点攒起来，在 Flush() 时用一次 multi 请求原子地全部建立，
+ * 只在服务目录不存在等少数情况下才退回逐个建立目录再重试。
+ * 连接断开、节点已经存在等可以恢复的错误按节点退避重试，参数错误等永久错误放弃该节点，
+ * 记录在 failed_paths() 中。退避到期的节点需要下一次 Flush() 才会发起，使用者应在主循环中定期调用。
+ * 批量请求进行中时后端持有本对象作为回调，所以本对象必须在所有批量请求回调之后才能销毁：
+ * 销毁前先调用后端的 Close()（它会以 kZkClosing 回调所有未完成的请求），或者等到 in_flight() 为 false。
+ */
+class ServiceRegistrar : public ZkMultiCallback
+{
+public:
+	/**
+	 * @param backend ZooKeeper 后端
+	 * @param max_batch 每个 multi 请求最多包含的操作数，避免请求超过 ZooKeeper 的 jute.maxbuffer
+	 */
+	explicit ServiceRegistrar(ZooKeeperBackend* backend, int max_batch = 256);
+	/// @note 销毁时不能有进行中的批量请求，@see in_flight()
+	virtual ~ServiceRegistrar();
+
+	/**
+	 * @brief 加入一个待建立的节点
+	 * @param parent_path 父目录，批量建立因为目录不存在失败时会先建立它
+	 * @param node_path 节点的完整路径
+	 * @param value 节点数据，通常是合同内容
+	 * @param flags @see ZkCreateFlag，进程合同一般为 kZkEphemeral
+	 */
+	void Add(const std::string& parent_path, const std::string& node_path,
+	         const std::string& value, int flags);
+
+	/**
+	 * @brief 发起一次批量建立，上一批还未完成时不会发起，还在退避中的节点留到以后
+	 * @return 本次发起的节点数量，0 表示没有需要发起的，< 0 表示发起失败，下次会再次尝试
+	 */
+	int Flush();
+
+	virtual void OnMulti(int rc, const std::vector<ZkOpResult>& results);
+
+	/// @brief 还未注册成功的节点数量（包括正在进行中的）
+	inline size_t pending_num() const {
+		return pending_.size() + in_flight_.size();
+	}
+
+	/// @brief 是否有已经发起、还未回调的批量请求
+	inline bool in_flight() const {
+		return !in_flight_.empty();
+	}
+
+	/// @brief 最后一次批量建立的结果
+	inline int last_error() const {
+		return last_error_;
+	}
+
+	/// @brief 已经注册成功的节点实际路径（顺序节点会带上序号）
+	inline const std::vector<std::string>& created_paths() const {
+		return created_paths_;
+	}
+
+	/// @brief 因为永久错误（如 kZkBadArguments、kZkNoChildrenForEphemerals）放弃的节点路径
+	inline const std::vector<std::string>& failed_paths() const {
+		return failed_paths_;
+	}
+
+private:
+	struct Entry {
+		std::string parent_path;
+		ZkOp op;
+		int64_t retry_at_ms;    // 退避到期的时间，0 表示可以立即发起
+		int retry_delay_ms;     // 上一次退避的时长，每次失败加倍
+		bool ensure_parent;     // 因为目录不存在失败，下一次 Flush() 先建立父目录
+
+		Entry() : retry_at_ms(0), retry_delay_ms(0), ensure_parent(false) {}
+	};
+
+	// 发起一批请求，ensure_parents 为 false 时跳过需要先建立目录的节点，
+	// 用于回调中接着发起下一批，避免在后端的 Update() 中执行同步的 Create
+	int FlushReady(bool ensure_parents);
+
+	// 逐级建立持久目录，已经存在视为成功
+	int EnsurePath(const std::string& path);
+
+	// 推迟此节点的下一次发起
+	static void Backoff(Entry* entry, int64_t now_ms);
+
+	// 重试也不会成功的错误
+	static bool IsPermanentError(int rc);
+
+	static int64_t NowMs();
+
+	ZooKeeperBackend* backend_;
+	int max_batch_;
+	int last_error_;
+	std::vector<Entry> pending_;
+	std::vector<Entry> in_flight_;
+	std::vector<std::string> created_paths_;
+	std::vector<std::string> failed_paths_;
+};
+
+#endif  // _CENTER_SERVICE_REGISTRAR_H_
@@ -0,0 +1,344 @@
+#include <string.h>
+
+#include "zookeeper.h"
+#include "ZooKeeperBackend.h"
+
+namespace {
+
+// 顺序节点的序号最多 10 位，再加上结尾的 '\0'
+const int kPathBufferExtra = 16;
+
+void GlobalWatcher(zhandle_t* zh, int type, int state, const char* path, void* ctx)
+{
+	ZooKeeperClientBackend* backend = static_cast<ZooKeeperClientBackend*>(ctx);
+	backend->PushEvent(NULL, type, state, path ? path : "");
+}
+
+void NodeWatcher(zhandle_t* zh, int type, int state, const char* path, void* ctx)
+{
+	ZooKeeperClientBackend::WatchContext* wctx =
+		static_cast<ZooKeeperClientBackend::WatchContext*>(ctx);
+	// 会话事件会通知所有的监听，但监听并不会因此失效，只有节点事件才释放上下文
+	if (type == ZOO_SESSION_EVENT) {
+		return;
+	}
+	wctx->backend->PushEvent(wctx->watcher, type, state, path ? path : "");
+	wctx->backend->ReleaseContext(wctx);
+}
+
+}  // namespace
+
+struct ZooKeeperClientBackend::MultiContext {
+	ZooKeeperClientBackend* backend;
+	ZkMultiCallback* callback;
+	int rc;
+	std::vector<ZkOp> ops;                  // 持有 zoo_op_t 中指向的字符串
+	std::vector<zoo_op_t> zoo_ops;
+	std::vector<zoo_op_result_t> zoo_results;
+	std::vector<std::vector<char> > path_buffers;
+};
+
+namespace {
+
+void MultiCompletion(int rc, const void* data)
+{
+	ZooKeeperClientBackend::MultiContext* ctx =
+		static_cast<ZooKeeperClientBackend::MultiContext*>(const_cast<void*>(data));
+	ctx->backend->PushMultiDone(ctx, rc);
+}
+
+}  // namespace
+
+ZooKeeperClientBackend::ZooKeeperClientBackend()
+	: zh_(NULL), session_watcher_(NULL)
+{
+	pthread_mutex_init(&mutex_, NULL);
+}
+
+ZooKeeperClientBackend::~ZooKeeperClientBackend()
+{
+	Close();
+	pthread_mutex_destroy(&mutex_);
+}
+
+int ZooKeeperClientBackend::Connect(const std::string& hosts, int recv_timeout_ms,
+                                    ZooKeeperWatcher* session_watcher)
+{
+	if (zh_ != NULL) {
+		return kZkInvalidState;
+	}
+	session_watcher_ = session_watcher;
+	zh_ = zookeeper_init(hosts.c_str(), GlobalWatcher, recv_timeout_ms, NULL, this, 0);
+	return zh_ != NULL ? kZkOk : kZkSystemError;
+}
+
+void ZooKeeperClientBackend::Close()
+{
+	if (zh_ != NULL) {
+		// zookeeper_close 会等事件线程退出，之后再释放上下文是安全的
+		zookeeper_close(zh_);
+		zh_ = NULL;
+	}
+	pthread_mutex_lock(&mutex_);
+	for (std::set<WatchContext*>::iterator it = watch_contexts_.begin();
+	     it != watch_contexts_.end(); ++it) {
+		delete *it;
+	}
+	watch_contexts_.clear();
+	events_.clear();
+	// zookeeper_close 会以 ZCLOSING 完成所有未完成的请求，连同已经完成、还未回调的一起回调
+	std::vector<MultiContext*> multi_done;
+	multi_done.swap(multi_done_);
+	pthread_mutex_unlock(&mutex_);
+
+	for (size_t i = 0; i < multi_done.size(); i++) {
+		DeliverMulti(multi_done[i]);
+	}
+}
+
+int ZooKeeperClientBackend::Update()
+{
+	std::vector<Event> events;
+	std::vector<MultiContext*> multi_done;
+	pthread_mutex_lock(&mutex_);
+	events.swap(events_);
+	multi_done.swap(multi_done_);
+	pthread_mutex_unlock(&mutex_);
+
+	for (size_t i = 0; i < events.size(); i++) {
+		ZooKeeperWatcher* watcher = events[i].watcher ? events[i].watcher : session_watcher_;
+		if (watcher != NULL) {
+			watcher->OnWatch(events[i].type, events[i].state, events[i].path);
+		}
+	}
+
+	for (size_t i = 0; i < multi_done.size(); i++) {
+		DeliverMulti(multi_done[i]);
+	}
+	return static_cast<int>(events.size() + multi_done.size());
+}
+
+void ZooKeeperClientBackend::DeliverMulti(MultiContext* ctx)
+{
+	// 服务器执行失败时会填写每个操作的结果；请求没有到达服务器（连接断开、关闭）时结果都还是 0，
+	// 这时每个操作都使用整体的结果，避免使用者误以为操作已经生效
+	bool reached = false;
+	for (size_t j = 0; j < ctx->zoo_results.size(); j++) {
+		if (ctx->zoo_results[j].err != ZOK) {
+			reached = true;
+			break;
+		}
+	}
+	std::vector<ZkOpResult> results(ctx->ops.size());
+	for (size_t j = 0; j < ctx->ops.size(); j++) {
+		results[j].rc = ctx->rc != ZOK && !reached ? ctx->rc : ctx->zoo_results[j].err;
+		if (ctx->ops[j].type == kZkCreateOp && results[j].rc == ZOK) {
+			results[j].created_path.assign(&ctx->path_buffers[j][0]);
+		}
+	}
+	ctx->callback->OnMulti(ctx->rc, results);
+	delete ctx;
+}
+
+void ZooKeeperClientBackend::PushMultiDone(MultiContext* ctx, int rc)
+{
+	ctx->rc = rc;
+	pthread_mutex_lock(&mutex_);
+	multi_done_.push_back(ctx);
+	pthread_mutex_unlock(&mutex_);
+}
+
+int ZooKeeperClientBackend::AMulti(const std::vector<ZkOp>& ops, ZkMultiCallback* callback)
+{
+	if (zh_ == NULL) {
+		return kZkInvalidState;
+	}
+	if (ops.empty() || callback == NULL) {
+		return kZkBadArguments;
+	}
+
+	MultiContext* ctx = new MultiContext;
+	ctx->backend = this;
+	ctx->callback = callback;
+	ctx->rc = ZOK;
+	ctx->ops = ops;
+	ctx->zoo_ops.resize(ops.size());
+	ctx->zoo_results.resize(ops.size());
+	ctx->path_buffers.resize(ops.size());
+	for (size_t i = 0; i < ctx->ops.size(); i++) {
+		const ZkOp& op = ctx->ops[i];
+		zoo_op_t* zop = &ctx->zoo_ops[i];
+		switch (op.type) {
+			case kZkCreateOp:
+				ctx->path_buffers[i].resize(op.path.size() + kPathBufferExtra);
+				zoo_create_op_init(zop, op.path.c_str(), op.value.data(),
+				                   static_cast<int>(op.value.size()), &ZOO_OPEN_ACL_UNSAFE,
+				                   op.flags, &ctx->path_buffers[i][0],
+				                   static_cast<int>(ctx->path_buffers[i].size()));
+				break;
+			case kZkDeleteOp:
+				zoo_delete_op_init(zop, op.path.c_str(), op.version);
+				break;
+			case kZkSetOp:
+				zoo_set_op_init(zop, op.path.c_str(), op.value.data(),
+				                static_cast<int>(op.value.size()), op.version, NULL);
+				break;
+			case kZkCheckOp:
+				zoo_check_op_init(zop, op.path.c_str(), op.version);
+				break;
+			default:
+				delete ctx;
+				return kZkBadArguments;
+		}
+	}
+
+	int ret = zoo_amulti(zh_, static_cast<int>(ctx->zoo_ops.size()), &ctx->zoo_ops[0],
+	                     &ctx->zoo_results[0], MultiCompletion, ctx);
+	if (ret != ZOK) {
+		delete ctx;
+	}
+	return ret;
+}
+
+void ZooKeeperClientBackend::PushEvent(ZooKeeperWatcher* watcher, int type, int state,
+                                       const std::string& path)
+{
+	Event event;
+	event.watcher = watcher;
+	event.type = type;
+	event.state = state;
+	event.path = path;
+	pthread_mutex_lock(&mutex_);
+	events_.push_back(event);
+	pthread_mutex_unlock(&mutex_);
+}
+
+ZooKeeperClientBackend::WatchContext* ZooKeeperClientBackend::NewContext(ZooKeeperWatcher* watcher)
+{
+	if (watcher == NULL) {
+		return NULL;
+	}
+	WatchContext* ctx = new WatchContext;
+	ctx->backend = this;
+	ctx->watcher = watcher;
+	pthread_mutex_lock(&mutex_);
+	watch_contexts_.insert(ctx);
+	pthread_mutex_unlock(&mutex_);
+	return ctx;
+}
+
+void ZooKeeperClientBackend::ReleaseContext(WatchContext* ctx)
+{
+	pthread_mutex_lock(&mutex_);
+	if (watch_contexts_.erase(ctx) > 0) {
+		delete ctx;
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+int ZooKeeperClientBackend::Create(const std::string& path, const std::string& value, int flags,
+                                   std::string* created_path)
+{
+	if (zh_ == NULL) {
+		return kZkInvalidState;
+	}
+	std::vector<char> buffer(path.size() + kPathBufferExtra);
+	int ret = zoo_create(zh_, path.c_str(), value.data(), static_cast<int>(value.size()),
+	                     &ZOO_OPEN_ACL_UNSAFE, flags, &buffer[0], static_cast<int>(buffer.size()));
+	if (ret == ZOK && created_path != NULL) {
+		created_path->assign(&buffer[0]);
+	}
+	return ret;
+}
+
+int ZooKeeperClientBackend::Delete(const std::string& path, int version)
+{
+	if (zh_ == NULL) {
+		return kZkInvalidState;
+	}
+	return zoo_delete(zh_, path.c_str(), version);
+}
+
+int ZooKeeperClientBackend::Set(const std::string& path, const std::string& value, int version)
+{
+	if (zh_ == NULL) {
+		return kZkInvalidState;
+	}
+	return zoo_set(zh_, path.c_str(), value.data(), static_cast<int>(value.size()), version);
+}
+
+int ZooKeeperClientBackend::Get(const std::string& path, std::string* value,
+                                ZooKeeperWatcher* watcher)
+{
+	if (zh_ == NULL) {
+		return kZkInvalidState;
+	}
+	WatchContext* ctx = NewContext(watcher);
+	// 节点数据最大 1MB，先用小缓冲区尝试，不够时按节点的实际长度重新读取
+	std::vector<char> buffer(4096);
+	struct Stat stat;
+	int len = static_cast<int>(buffer.size());
+	int ret = zoo_wget(zh_, path.c_str(), ctx ? NodeWatcher : NULL, ctx, &buffer[0], &len, &stat);
+	if (ret == ZOK && stat.dataLength > len) {
+		buffer.resize(stat.dataLength);
+		len = stat.dataLength;
+		ret = zoo_get(zh_, path.c_str(), 0, &buffer[0], &len, &stat);
+	}
+	if (ret != ZOK) {
+		if (ctx != NULL) {
+			ReleaseContext(ctx);
+		}
+		return ret;
+	}
+	if (value != NULL) {
+		value->assign(&buffer[0], len > 0 ? len : 0);
+	}
+	return ZOK;
+}
+
+int ZooKeeperClientBackend::Exists(const std::string& path, ZooKeeperWatcher* watcher)
+{
+	if (zh_ == NULL) {
+		return kZkInvalidState;
+	}
+	WatchContext* ctx = NewContext(watcher);
+	struct Stat stat;
+	int ret = zoo_wexists(zh_, path.c_str(), ctx ? NodeWatcher : NULL, ctx, &stat);
+	// 节点不存在时监听依然会注册，等待节点建立
+	if (ret != ZOK && ret != ZNONODE && ctx != NULL) {
+		ReleaseContext(ctx);
+	}
+	return ret;
+}
+
+int ZooKeeperClientBackend::GetChildren(const std::string& path,
+                                        std::vector<std::string>* children,
+                                        ZooKeeperWatcher* watcher)
+{
+	if (zh_ == NULL) {
+		return kZkInvalidState;
+	}
+	WatchContext* ctx = NewContext(watcher);
+	struct String_vector strings;
+	memset(&strings, 0, sizeof(strings));
+	int ret = zoo_wget_children(zh_, path.c_str(), ctx ? NodeWatcher : NULL, ctx, &strings);
+	if (ret != ZOK) {
+		if (ctx != NULL) {
+			ReleaseContext(ctx);
+		}
+		return ret;
+	}
+	if (children != NULL) {
+		children->assign(strings.data, strings.data + strings.count);
+	}
+	deallocate_String_vector(&strings);
+	return ZOK;
+}
+
+int64_t ZooKeeperClientBackend::session_id() const
+{
+	if (zh_ == NULL) {
+		return 0;
+	}
+	return zoo_client_id(zh_)->client_id;
+}
@@ -0,0 +1,260 @@
+#ifndef _CENTER_ZOOKEEPER_BACKEND_H_
+#define _CENTER_ZOOKEEPER_BACKEND_H_
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * 与 ZooKeeper C 客户端取值一致的返回码和标记，后端实现和使用者都不需要直接依赖 zookeeper.h
+ */
+enum ZkResultCode
+{
+	kZkOk = 0,
+	kZkSystemError = -1,
+	kZkRuntimeInconsistency = -2,
+	kZkConnectionLoss = -4,
+	kZkBadArguments = -8,
+	kZkInvalidState = -9,
+	kZkNoNode = -101,
+	kZkBadVersion = -103,
+	kZkNoChildrenForEphemerals = -108,
+	kZkNodeExists = -110,
+	kZkNotEmpty = -111,
+	kZkSessionExpired = -112,
+	kZkClosing = -116
+};
+
+enum ZkCreateFlag
+{
+	kZkPersistent = 0,
+	kZkEphemeral = 1,
+	kZkSequence = 2
+};
+
+enum ZkEventType
+{
+	kZkCreatedEvent = 1,
+	kZkDeletedEvent = 2,
+	kZkChangedEvent = 3,
+	kZkChildEvent = 4,
+	kZkSessionEvent = -1
+};
+
+enum ZkSessionState
+{
+	kZkConnectingState = 1,
+	kZkConnectedState = 3,
+	kZkExpiredSessionState = -112
+};
+
+/// @brief 批量操作中单个操作的类型，取值与 ZooKeeper 的 OpCode 一致
+enum ZkOpType
+{
+	kZkCreateOp = 1,
+	kZkDeleteOp = 2,
+	kZkSetOp = 5,
+	kZkCheckOp = 13
+};
+
+/// @brief 批量操作中的一个操作
+struct ZkOp
+{
+	int type;               // @see ZkOpType
+	std::string path;
+	std::string value;      // kZkCreateOp、kZkSetOp 使用
+	int flags;              // kZkCreateOp 使用 @see ZkCreateFlag
+	int version;            // kZkDeleteOp、kZkSetOp、kZkCheckOp 使用，-1 表示不检查
+
+	ZkOp() : type(kZkCreateOp), flags(0), version(-1) {}
+};
+
+/// @brief 批量操作中单个操作的结果
+struct ZkOpResult
+{
+	int rc;
+	std::string created_path;   // kZkCreateOp 成功时的实际路径
+};
+
+/**
+ * @brief 批量操作完成的回调，在 ZooKeeperBackend::Update() 或 Close() 中发起
+ */
+class ZkMultiCallback
+{
+public:
+	virtual ~ZkMultiCallback() {}
+
+	/**
+	 * @param rc 整体结果，kZkOk 表示所有操作都已生效，否则所有操作都没有生效
+	 * @param results 与发起时的 ops 一一对应的结果，rc 不为 kZkOk 时可以从中找到出错的操作；
+	 *        请求没有到达服务器时（如 kZkConnectionLoss、kZkClosing）每个操作的结果都是 rc
+	 */
+	virtual void OnMulti(int rc, const std::vector<ZkOpResult>& results) = 0;
+};
+
+/**
+ * @brief ZooKeeper 的监听回调
+ * 和 ZooKeeper 一样，节点监听是一次性的，触发后需要重新注册。
+ * 所有回调都在调用 ZooKeeperBackend::Update() 的线程中发起。
+ */
+class ZooKeeperWatcher
+{
+public:
+	virtual ~ZooKeeperWatcher() {}
+
+	/**
+	 * @param type 事件类型 @see ZkEventType
+	 * @param state 会话状态 @see ZkSessionState
+	 * @param path 发生变化的节点路径，会话事件为 ""
+	 */
+	virtual void OnWatch(int type, int state, const std::string& path) = 0;
+};
+
+/**
+ * @brief ZooKeeper 访问后端接口
+ * Center 只通过此接口访问 ZooKeeper，默认使用真实的 ZooKeeper C 客户端（ZooKeeperClientBackend），
+ * 测试和压测时可以替换为进程内的 FakeZooKeeperBackend，不需要部署 ZooKeeper 集群。
+ */
+class ZooKeeperBackend
+{
+public:
+	virtual ~ZooKeeperBackend() {}
+
+	/**
+	 * @brief 建立会话
+	 * @param hosts ZooKeeper 地址列表，如 "127.0.0.1:2181,127.0.0.1:2182"
+	 * @param recv_timeout_ms 会话超时时间
+	 * @param session_watcher 接收会话状态变化的回调，可以为 NULL
+	 * @return kZkOk 表示已经发起连接
+	 */
+	virtual int Connect(const std::string& hosts, int recv_timeout_ms,
+	                    ZooKeeperWatcher* session_watcher) = 0;
+
+	/**
+	 * @brief 关闭会话，此会话建立的临时节点会被删除
+	 * 还没有回调的批量操作在返回前回调，未完成的结果为 kZkClosing，保证每个 AMulti 都回调一次。
+	 */
+	virtual void Close() = 0;
+
+	/**
+	 * @brief 驱动监听回调，需要在主循环中调用
+	 * @return 本次发起的回调数量
+	 */
+	virtual int Update() = 0;
+
+	/**
+	 * @brief 建立节点
+	 * @param flags @see ZkCreateFlag 的组合
+	 * @param created_path 输出参数，实际建立的路径（顺序节点会带上序号），可以为 NULL
+	 */
+	virtual int Create(const std::string& path, const std::string& value, int flags,
+	                   std::string* created_path) = 0;
+
+	virtual int Delete(const std::string& path, int version = -1) = 0;
+
+	virtual int Set(const std::string& path, const std::string& value, int version = -1) = 0;
+
+	/**
+	 * @brief 读取节点数据
+	 * @param watcher 不为 NULL 时在节点变化或删除时回调一次
+	 */
+	virtual int Get(const std::string& path, std::string* value,
+	                ZooKeeperWatcher* watcher = NULL) = 0;
+
+	/**
+	 * @brief 检查节点是否存在
+	 * @param watcher 不为 NULL 时在节点建立、变化或删除时回调一次
+	 * @return kZkOk 表示存在，kZkNoNode 表示不存在
+	 */
+	virtual int Exists(const std::string& path, ZooKeeperWatcher* watcher = NULL) = 0;
+
+	/**
+	 * @brief 读取子节点名字列表
+	 * @param watcher 不为 NULL 时在子节点增减或节点删除时回调一次
+	 */
+	virtual int GetChildren(const std::string& path, std::vector<std::string>* children,
+	                        ZooKeeperWatcher* watcher = NULL) = 0;
+
+	/**
+	 * @brief 异步发起一组原子执行的操作（ZooKeeper multi），只需要一次网络往返
+	 * @param ops 操作列表，调用返回后即可释放
+	 * @param callback 完成回调，不能为 NULL
+	 * @return kZkOk 表示已经发起，回调一定会被调用一次；其他值表示发起失败，不会回调
+	 */
+	virtual int AMulti(const std::vector<ZkOp>& ops, ZkMultiCallback* callback) = 0;
+
+	/// @brief 当前会话 ID，未连接时为 0
+	virtual int64_t session_id() const = 0;
+};
+
+struct _zhandle;
+
+/**
+ * @brief 基于 ZooKeeper C 客户端（多线程版本）的后端实现
+ * ZooKeeper 的监听回调发生在客户端自己的事件线程中，这里先放进队列，在 Update() 中再回调使用者。
+ */
+class ZooKeeperClientBackend : public ZooKeeperBackend
+{
+public:
+	ZooKeeperClientBackend();
+	virtual ~ZooKeeperClientBackend();
+
+	virtual int Connect(const std::string& hosts, int recv_timeout_ms,
+	                    ZooKeeperWatcher* session_watcher);
+	virtual void Close();
+	virtual int Update();
+
+	virtual int Create(const std::string& path, const std::string& value, int flags,
+	                   std::string* created_path);
+	virtual int Delete(const std::string& path, int version = -1);
+	virtual int Set(const std::string& path, const std::string& value, int version = -1);
+	virtual int Get(const std::string& path, std::string* value, ZooKeeperWatcher* watcher = NULL);
+	virtual int Exists(const std::string& path, ZooKeeperWatcher* watcher = NULL);
+	virtual int GetChildren(const std::string& path, std::vector<std::string>* children,
+	                        ZooKeeperWatcher* watcher = NULL);
+	virtual int AMulti(const std::vector<ZkOp>& ops, ZkMultiCallback* callback);
+	virtual int64_t session_id() const;
+
+	// ZooKeeper 事件线程调用，把事件放进队列
+	void PushEvent(ZooKeeperWatcher* watcher, int type, int state, const std::string& path);
+
+	// zoo_amulti 需要在完成前一直持有的数据
+	struct MultiContext;
+
+	// ZooKeeper 事件线程调用，把完成的批量操作放进队列
+	void PushMultiDone(MultiContext* ctx, int rc);
+
+	// 每次注册监听时分配的上下文，记录在 watch_contexts_ 中，回调或关闭时释放
+	struct WatchContext {
+		ZooKeeperClientBackend* backend;
+		ZooKeeperWatcher* watcher;
+	};
+
+	void ReleaseContext(WatchContext* ctx);
+
+private:
+	struct Event {
+		ZooKeeperWatcher* watcher;
+		int type;
+		int state;
+		std::string path;
+	};
+
+	WatchContext* NewContext(ZooKeeperWatcher* watcher);
+
+	// 回调一个完成的批量操作并释放上下文
+	void DeliverMulti(MultiContext* ctx);
+
+	struct _zhandle* zh_;
+	ZooKeeperWatcher* session_watcher_;
+	pthread_mutex_t mutex_;                 // 保护下面的成员，ZooKeeper 事件线程也会访问
+	std::vector<Event> events_;
+	std::set<WatchContext*> watch_contexts_;
+	std::vector<MultiContext*> multi_done_;
+};
+
+#endif  // _CENTER_ZOOKEEPER_BACKEND_H_
@@ -13,20 +13,30 @@
 
 
 #include <assert.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 #include <cstdio>
 #include <cstdlib>
+#include <cxxabi.h>
 #include <errno.h>
 #include <iostream>
-#include <set>
+#include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#include <typeinfo>
+#include <vector>
 #include "common/coroutine.h"
 #include "common/log.h"
 #include "common/timer.h"
@@ -37,6 +47,7 @@ struct stCoEpoll_t;
 struct stCoRoutineEnv_t {
     schedule* co_schedule;
     stCoEpoll_t *pEpoll;
+    unsigned long long ullNow;      // 本轮co_update开始时的时间，0表示还未更新
 };
 
 struct co_epoll_res {
@@ -49,6 +60,8 @@ struct co_epoll_res *co_epoll_res_alloc(int n) {
     struct co_epoll_res * ptr =
         (struct co_epoll_res *)malloc(sizeof(struct co_epoll_res));
 
+    if (!ptr) return NULL;
+
     ptr->size = n;
     ptr->events = (struct epoll_event*)calloc(1, n * sizeof(struct epoll_event));
 
@@ -65,7 +78,10 @@ struct stTimeoutItemLink_t;
 struct stTimeoutItem_t;
 struct stCoEpoll_t {
     int iEpollFd;
-    static const int _EPOLL_SIZE = 1024 * 10;
+    // 事件数组按负载伸缩：填满时加倍，连续多轮用不到1/4时减半
+    static const int _EPOLL_MIN_SIZE = 64;
+    static const int _EPOLL_MAX_SIZE = 1024 * 64;
+    static const int _EPOLL_SHRINK_ROUNDS = 64;
 
     struct stTimeout_t *pTimeout;
 
@@ -73,18 +89,21 @@ struct stCoEpoll_t {
 
     struct stTimeoutItemLink_t *pstActiveList;
 
+    struct stTimeoutItemLink_t *pstReadyList;   // 被co_notify唤醒、等待恢复的协程
+
     co_epoll_res *result;
+    int iIdleRounds;                    // 事件数组连续用不到1/4的轮数
+
+    int iBusyPollUs;                    // 有事件后继续忙轮询的时间，0表示不忙轮询
+    unsigned long long ullLastEventNs;  // 最后一次收到事件的时间
+
+    struct stCoInbox_t *pInbox;         // 其他线程投递的恢复请求，coroutine_open时创建
 };
 typedef void (*OnPreparePfn_t)(stTimeoutItem_t *, const struct epoll_event &ev,
         stTimeoutItemLink_t *active);
 
 typedef void (*OnProcessPfn_t)(stTimeoutItem_t * t);
 struct stTimeoutItem_t {
-
-    enum
-    {
-        eMaxTimeout = 20 * 1000 // 20s
-    };
     stTimeoutItem_t *pPrev;
     stTimeoutItem_t *pNext;
     stTimeoutItemLink_t *pLink;
@@ -101,41 +120,54 @@ struct stTimeoutItemLink_t {
     stTimeoutItem_t *head;
     stTimeoutItem_t *tail;
 };
+// 分层时间轮：第0层256个1ms的槽，之上4层各64个槽，每层槽的跨度是下一层的整圈，
+// 共覆盖2^32ms(约49天)，更远的超时先放在最高层，转到时再重新分配，所以超时时间不受限制。
+// 插入和删除都是O(1)，高层的槽在低层转完一圈时逐级下放(cascade)
+enum {
+    kWheelLevel0Bits = 8,
+    kWheelLevelNBits = 6,
+    kWheelLevel0Size = 1 << kWheelLevel0Bits,
+    kWheelLevelNSize = 1 << kWheelLevelNBits,
+    kWheelLevelNNum  = 4,
+};
+
 struct stTimeout_t {
-    stTimeoutItemLink_t *pItems;
-    int iItemSize;
+    stTimeoutItemLink_t tv1[kWheelLevel0Size];
+    stTimeoutItemLink_t tvn[kWheelLevelNNum][kWheelLevelNSize];
 
-    unsigned long long ullStart;
-    long long llStartIdx;
+    // 各个槽是否可能有元素，只在插入时置位、取走时清除，
+    // 元素被单独删除时不清除，所以只用来跳过空槽，不能用来计数
+    uint64_t tv1Bitmap[kWheelLevel0Size / 64];
+    uint64_t tvnBitmap[kWheelLevelNNum];
+
+    unsigned long long ullStart;    // 下一个要处理的毫秒，之前的超时都已经取走
 };
 
 static unsigned long long GetTickMS();
-stTimeout_t *AllocTimeout(int iSize) {
+static unsigned long long GetTickNS();
+stTimeout_t *AllocTimeout() {
     stTimeout_t *lp = reinterpret_cast<stTimeout_t*>(calloc(1, sizeof(stTimeout_t)));
-    lp->iItemSize = iSize;
-    lp->pItems = reinterpret_cast<stTimeoutItemLink_t*>
-        (calloc(1, sizeof(stTimeoutItemLink_t) * lp->iItemSize));
     lp->ullStart = GetTickMS();
-    lp->llStartIdx = 0;
 
     return lp;
 }
 
 void FreeTimeout(stTimeout_t *apTimeout) {
-    free(apTimeout->pItems);
     free(apTimeout);
 }
 
 stCoEpoll_t *AllocEpoll() {
     stCoEpoll_t *ctx = reinterpret_cast<stCoEpoll_t*>(calloc(1, sizeof(stCoEpoll_t)));
 
-    ctx->iEpollFd = epoll_create(stCoEpoll_t::_EPOLL_SIZE);
-    ctx->pTimeout = AllocTimeout(60 * 1000);
+    ctx->iEpollFd = epoll_create(stCoEpoll_t::_EPOLL_MAX_SIZE);
+    ctx->pTimeout = AllocTimeout();
 
     ctx->pstActiveList = reinterpret_cast<stTimeoutItemLink_t*>
         (calloc(1, sizeof(stTimeoutItemLink_t)));
     ctx->pstTimeoutList = reinterpret_cast<stTimeoutItemLink_t*>
         (calloc(1, sizeof(stTimeoutItemLink_t)));
+    ctx->pstReadyList = reinterpret_cast<stTimeoutItemLink_t*>
+        (calloc(1, sizeof(stTimeoutItemLink_t)));
 
     return ctx;
 }
@@ -144,10 +176,14 @@ void SetEpoll(stCoRoutineEnv_t *env, stCoEpoll_t *ev) {
     env->pEpoll = ev;
 }
 
+static stCoInbox_t *CoInboxAlloc(stCoEpoll_t *ctx);
+static void CoInboxClose(stCoInbox_t *inbox);
 void FreeEpoll(stCoEpoll_t *ctx) {
     if (ctx) {
+        CoInboxClose(ctx->pInbox);
         free(ctx->pstActiveList);
         free(ctx->pstTimeoutList);
+        free(ctx->pstReadyList);
         FreeTimeout(ctx->pTimeout);
         co_epoll_res_free(ctx->result);
     }
@@ -156,11 +192,9 @@ void FreeEpoll(stCoEpoll_t *ctx) {
 
 
 static stCoRoutineEnv_t** g_CoEnvArrayForThread = NULL;
+static pthread_once_t g_CoEnvOnce = PTHREAD_ONCE_INIT;
+// 多个工作线程会同时建立各自的协程环境，只能初始化一次
 static void InitCoEnv() {
-    if (g_CoEnvArrayForThread != NULL) {
-        return;
-    }
-
     int max_pid = 102400;
     char file[] = "/proc/sys/kernel/pid_max";
     FILE* pid_max = fopen(file, "r");
@@ -178,15 +212,11 @@ static void FiniCoEnv() {
     g_CoEnvArrayForThread = NULL;
 }
 static stCoRoutineEnv_t* GetCoEnv(int pid) {
-    if (g_CoEnvArrayForThread == NULL) {
-        InitCoEnv();
-    }
+    pthread_once(&g_CoEnvOnce, InitCoEnv);
     return g_CoEnvArrayForThread[pid];
 }
 static void SetCoEnv(int pid, stCoRoutineEnv_t* env) {
-    if (g_CoEnvArrayForThread == NULL) {
-        InitCoEnv();
-    }
+    pthread_once(&g_CoEnvOnce, InitCoEnv);
     g_CoEnvArrayForThread[pid] = env;
 }
 
@@ -201,29 +231,407 @@ static pid_t GetPid()
     return tid;
 }
 
-struct coroutine *
-_co_new(struct schedule *S, cxx::function<void()>& std_func) {
-    if (NULL == S) {
-        assert(0);
+static size_t GetPageSize() {
+    static size_t page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+// 协程栈使用mmap分配，最低地址处留一个PROT_NONE的保护页，栈溢出时直接SIGSEGV，
+// 不会悄悄改写相邻的内存。物理内存在第一次访问时才分配，没有用到的栈不占RSS
+// @note 每个栈占用两个VMA，独立栈模式下协程数量受vm.max_map_count限制，
+//   需要更多协程时请使用共享栈模式
+static char* _co_stack_alloc(uint32_t stack_size) {
+    size_t page_size = GetPageSize();
+    char* base = static_cast<char*>(mmap(NULL, stack_size + page_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0));
+    if (base == MAP_FAILED) {
+        PLOG_ERROR("mmap coroutine stack failed : %s", strerror(errno));
+        return NULL;
+    }
+    if (mprotect(base, page_size, PROT_NONE) != 0) {
+        PLOG_ERROR("mprotect coroutine stack guard page failed : %s", strerror(errno));
+    }
+    return base + page_size;
+}
+
+static void _co_stack_free(char* stack, uint32_t stack_size) {
+    if (stack != NULL) {
+        munmap(stack - GetPageSize(), stack_size + GetPageSize());
+    }
+}
+
+// 通过mincore统计栈从顶部往下实际被访问过的深度，以页为单位
+static uint32_t _co_stack_used(const char* stack, uint32_t stack_size) {
+    size_t page_size = GetPageSize();
+    size_t pages = stack_size / page_size;
+    std::vector<unsigned char> vec(pages);
+    if (mincore(const_cast<char*>(stack), stack_size, &vec[0]) != 0) {
+        return 0;
+    }
+    for (size_t i = 0; i < pages; i++) {
+        if (vec[i] & 1) {
+            return static_cast<uint32_t>((pages - i) * page_size);
+        }
+    }
+    return 0;
+}
+
+static void _co_update_high_water(struct schedule *S, const char* stack, uint32_t stack_size) {
+    uint32_t used = _co_stack_used(stack, stack_size);
+    if (used > S->stack_high_water) {
+        S->stack_high_water = used;
+    }
+}
+
+// 协程ID由槽的代数和下标组成，槽被复用时代数加一，旧ID自然失效
+static inline int64_t _co_id(const struct coroutine *co) {
+    return (static_cast<int64_t>(co->generation) << 32) | co->index;
+}
+
+static inline struct coroutine * _co_slot(struct schedule *S, uint32_t index) {
+    return &S->co_slabs[index / CO_SLAB_SIZE][index % CO_SLAB_SIZE];
+}
+
+// 根据ID找到还未结束的协程，O(1)，不需要哈希
+static struct coroutine * _co_find(struct schedule *S, int64_t id) {
+    if (id < 0) {
+        return NULL;
+    }
+    uint32_t index = static_cast<uint32_t>(id & 0xFFFFFFFF);
+    uint32_t generation = static_cast<uint32_t>(id >> 32);
+    if (index >= S->co_slot_num) {
+        return NULL;
+    }
+    struct coroutine * co = _co_slot(S, index);
+    if (co->generation != generation || co->status == COROUTINE_DEAD) {
         return NULL;
     }
+    return co;
+}
+
+static inline void _co_hist_add(co_histogram* hist, uint64_t value) {
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= CO_STATS_BUCKETS) {
+        bucket = CO_STATS_BUCKETS - 1;
+    }
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+// watchdog线程定期检查所有调度器：正在运行协程，并且resume_num在threshold_ms内没有变化，
+// 说明同一次resume一直没有让出。协程切换时只多一次计数，不需要读时钟
+struct stCoWatchdog_t {
+    pthread_mutex_t mutex;          // 保护schedules，watchdog检查期间调度器不会被释放
+    std::vector<struct schedule*> schedules;
+    pthread_t thread;
+    bool running;
+    bool stop;
+    uint32_t threshold_ms;
+    co_watchdog_cb cb;
+};
+
+static stCoWatchdog_t* g_co_watchdog = NULL;
+static pthread_once_t g_co_watchdog_once = PTHREAD_ONCE_INIT;
+
+static void _co_watchdog_init() {
+    g_co_watchdog = new stCoWatchdog_t;
+    pthread_mutex_init(&g_co_watchdog->mutex, NULL);
+    g_co_watchdog->running = false;
+    g_co_watchdog->stop = false;
+    g_co_watchdog->threshold_ms = 0;
+}
+
+// 整个状态(包括回调cb)在堆上创建、永不释放，没有静态析构：进程退出时watchdog线程可能还在调用cb，
+// 全局的CoroutineSchedule析构时也还要注销
+static stCoWatchdog_t* _co_watchdog() {
+    pthread_once(&g_co_watchdog_once, _co_watchdog_init);
+    return g_co_watchdog;
+}
+
+static void _co_watchdog_register(struct schedule *S) {
+    stCoWatchdog_t* wd = _co_watchdog();
+    pthread_mutex_lock(&wd->mutex);
+    wd->schedules.push_back(S);
+    pthread_mutex_unlock(&wd->mutex);
+}
+
+static void _co_watchdog_unregister(struct schedule *S) {
+    stCoWatchdog_t* wd = _co_watchdog();
+    pthread_mutex_lock(&wd->mutex);
+    std::vector<struct schedule*>& schedules = wd->schedules;
+    for (size_t i = 0; i < schedules.size(); i++) {
+        if (schedules[i] == S) {
+            schedules[i] = schedules.back();
+            schedules.pop_back();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wd->mutex);
+}
+
+static void _co_watchdog_check(stCoWatchdog_t* wd, struct schedule *S, unsigned long long now) {
+    int64_t running = __atomic_load_n(&S->running, __ATOMIC_RELAXED);
+    uint64_t resume_num = __atomic_load_n(&S->stats.resume_num, __ATOMIC_RELAXED);
+    if (running < 0 || resume_num != S->wd_resume_num) {
+        S->wd_resume_num = resume_num;
+        S->wd_since_ms = now;
+        S->wd_reported = false;
+        return;
+    }
+    if (S->wd_reported || now - S->wd_since_ms < wd->threshold_ms) {
+        return;
+    }
+    S->wd_reported = true;
+    __atomic_fetch_add(&S->stats.long_run_num, 1, __ATOMIC_RELAXED);
+
+    const char* name = __atomic_load_n(&S->running_name, __ATOMIC_RELAXED);
+    char* demangled = NULL;
+    if (name != NULL) {
+        int status = 0;
+        demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+    }
+    const char* print_name = demangled != NULL ? demangled : (name != NULL ? name : "");
+    uint32_t running_ms = static_cast<uint32_t>(now - S->wd_since_ms);
+    if (wd->cb) {
+        wd->cb(running, print_name, running_ms);
+    } else {
+        PLOG_ERROR("coroutine %ld (%s) has been running for %u ms without yielding",
+            running, print_name, running_ms);
+    }
+    free(demangled);
+}
+
+static void* _co_watchdog_main(void* arg) {
+    stCoWatchdog_t* wd = static_cast<stCoWatchdog_t*>(arg);
+    // 检查间隔取阈值的1/4，报告的运行时间最多比实际少一个间隔
+    uint32_t interval_ms = wd->threshold_ms / 4;
+    if (interval_ms == 0) {
+        interval_ms = 1;
+    }
+    while (!__atomic_load_n(&wd->stop, __ATOMIC_ACQUIRE)) {
+        usleep(interval_ms * 1000);
+        unsigned long long now = GetTickMS();
+        pthread_mutex_lock(&wd->mutex);
+        for (size_t i = 0; i < wd->schedules.size(); i++) {
+            _co_watchdog_check(wd, wd->schedules[i], now);
+        }
+        pthread_mutex_unlock(&wd->mutex);
+    }
+    return NULL;
+}
+
+int co_start_watchdog(uint32_t threshold_ms, const co_watchdog_cb& cb) {
+    stCoWatchdog_t* wd = _co_watchdog();
+    if (wd->running) {
+        return -1;
+    }
+    wd->threshold_ms = threshold_ms > 0 ? threshold_ms : 1;
+    wd->cb = cb;
+    wd->stop = false;
+    if (pthread_create(&wd->thread, NULL, _co_watchdog_main, wd) != 0) {
+        PLOG_ERROR("create coroutine watchdog thread failed : %s", strerror(errno));
+        return -1;
+    }
+    wd->running = true;
+    return 0;
+}
+
+void co_stop_watchdog() {
+    stCoWatchdog_t* wd = _co_watchdog();
+    if (!wd->running) {
+        return;
+    }
+    __atomic_store_n(&wd->stop, true, __ATOMIC_RELEASE);
+    pthread_join(wd->thread, NULL);
+    wd->running = false;
+}
+
+// 空闲协程的栈通过MADV_DONTNEED归还物理内存，只保留虚拟地址空间，再次使用时重新缺页
+static void _co_cool_stack(struct coroutine *co) {
+    if (co->stack != NULL && !co->stack_cold) {
+        madvise(co->stack, co->sch->stack_size, MADV_DONTNEED);
+        co->stack_cold = true;
+    }
+}
 
-    struct coroutine * co = NULL;
-    if (S->co_free_list.empty()) {
-        co = new coroutine;
-        co->stack = new char[S->stack_size];
+static void _co_release_stack(struct schedule *S, struct coroutine *co);
+
+static void _co_empty_push(struct schedule *S, struct coroutine *co) {
+    co->free_prev = NULL;
+    co->free_next = S->co_empty_head;
+    S->co_empty_head = co;
+}
+
+// 空闲链表后进先出：刚结束的协程的栈还在缓存和物理内存中，最先被复用。链表尾部是最久没有用过的栈，
+// 第hot_free_num个(co_free_edge)之后的栈归还物理内存，超过max_free_num的从尾部释放栈后移到co_empty_head。
+// 反复创建、结束协程时只有头部在变化，不会反复madvise和缺页
+static void _co_free_push(struct schedule *S, struct coroutine *co) {
+    co->free_prev = NULL;
+    co->free_next = S->co_free_head;
+    if (S->co_free_head != NULL) {
+        S->co_free_head->free_prev = co;
     } else {
-        co = S->co_free_list.front();
-        S->co_free_list.pop_front();
+        S->co_free_tail = co;
+    }
+    S->co_free_head = co;
+    S->co_free_num++;
+
+    // 头部加入一个，原来的边界协程被挤出边界
+    if (S->hot_free_num <= 0) {
+        _co_cool_stack(co);
+    } else if (S->co_free_num == S->hot_free_num) {
+        S->co_free_edge = S->co_free_tail;
+    } else if (S->co_free_num > S->hot_free_num) {
+        _co_cool_stack(S->co_free_edge);
+        S->co_free_edge = S->co_free_edge->free_prev;
+    }
 
+    if (S->co_free_num > S->max_free_num) {
+        struct coroutine * tail = S->co_free_tail;
+        if (tail == S->co_free_edge) {
+            S->co_free_edge = NULL;
+        }
+        S->co_free_tail = tail->free_prev;
+        if (S->co_free_tail != NULL) {
+            S->co_free_tail->free_next = NULL;
+        } else {
+            S->co_free_head = NULL;
+        }
         S->co_free_num--;
+        _co_release_stack(S, tail);
+        tail->stack_cold = false;
+        _co_empty_push(S, tail);
+    }
+}
+
+// 优先取持有栈的空闲协程，其次取栈已经释放的
+static struct coroutine * _co_free_pop(struct schedule *S) {
+    struct coroutine * co = S->co_free_head;
+    if (co == NULL) {
+        co = S->co_empty_head;
+        if (co != NULL) {
+            S->co_empty_head = co->free_next;
+            co->free_next = NULL;
+        }
+        return co;
+    }
+
+    // 头部取走一个，原来边界之后的第一个协程回到边界内
+    if (S->co_free_edge != NULL) {
+        S->co_free_edge = S->co_free_edge->free_next;
+    }
+    S->co_free_head = co->free_next;
+    if (S->co_free_head != NULL) {
+        S->co_free_head->free_prev = NULL;
+    } else {
+        S->co_free_tail = NULL;
+    }
+    co->free_next = NULL;
+    co->free_prev = NULL;
+    co->stack_cold = false;
+    S->co_free_num--;
+    return co;
+}
+
+// 释放协程槽占用的栈内存，槽本身保留在slab中
+static void _co_release_stack(struct schedule *S, struct coroutine *co) {
+    if (co->stack != NULL) {
+        _co_stack_free(co->stack, S->stack_size);
+        co->stack = NULL;
+    }
+    free(co->save_buffer);
+    co->save_buffer = NULL;
+    co->save_size = 0;
+    co->save_capacity = 0;
+}
+
+// 从slab中取一个新槽，共享栈模式下新槽轮流分配到各个共享栈上
+static struct coroutine * _co_new_slot(struct schedule *S) {
+    if (S->co_slot_num % CO_SLAB_SIZE == 0) {
+        S->co_slabs.push_back(new coroutine[CO_SLAB_SIZE]);
+    }
+    struct coroutine * co = _co_slot(S, S->co_slot_num);
+    co->index = S->co_slot_num++;
+    if (S->share_stack_num > 0) {
+        co->share_stack = S->share_stacks[S->share_stack_idx % S->share_stack_num];
+        S->share_stack_idx = (S->share_stack_idx + 1) % S->share_stack_num;
+    }
+    return co;
+}
+
+// 从栈顶往下逐页写一次，提前产生缺页，协程第一次运行时不再陷入内核
+static void _co_warm_stack(struct schedule *S, char* stack) {
+    size_t page_size = GetPageSize();
+    uint32_t depth = S->stack_high_water > CO_WARM_STACK_SIZE ?
+        S->stack_high_water : CO_WARM_STACK_SIZE;
+    if (depth > S->stack_size) {
+        depth = S->stack_size;
+    }
+    for (size_t off = page_size; off <= depth; off += page_size) {
+        *static_cast<volatile char*>(stack + S->stack_size - off) = 0;
+    }
+}
+
+// 优先复用空闲链表中的协程槽，没有时从slab中取一个新槽
+static struct coroutine * _co_alloc(struct schedule *S) {
+    struct coroutine * co = _co_free_pop(S);
+    if (co == NULL) {
+        co = _co_new_slot(S);
+    }
+
+    if (co->share_stack == NULL && co->stack == NULL) {
+        co->stack = _co_stack_alloc(S->stack_size);
+        if (co->stack == NULL) {
+            _co_empty_push(S, co);
+            return NULL;
+        }
+        // 预热过的池不够用了，按1、2、4...次打印，避免刷屏
+        S->co_cold_alloc_num++;
+        if (S->warm_num > 0 && (S->co_cold_alloc_num & (S->co_cold_alloc_num - 1)) == 0) {
+            PLOG_INFO("coroutine pool saturated, warm %d alive %u cold alloc %lu",
+                S->warm_num, S->co_alive_num, S->co_cold_alloc_num);
+        }
+    }
+
+    S->co_alive_num++;
+    S->stats.alive_num = S->co_alive_num;
+    if (S->co_alive_num > S->co_alive_peak) {
+        S->co_alive_peak = S->co_alive_num;
+    }
+
+    // 代数只用31位，保证ID为正数
+    co->generation = (co->generation + 1) & 0x7FFFFFFF;
+    if (co->generation == 0) {
+        co->generation = 1;
+    }
+    return co;
+}
+
+struct coroutine *
+_co_new(struct schedule *S, cxx::function<void()>& std_func) {
+    if (NULL == S) {
+        assert(0);
+        return NULL;
     }
 
+    struct coroutine * co = _co_alloc(S);
+    if (NULL == co) {
+        return NULL;
+    }
     co->std_func = std_func;
     co->func = NULL;
     co->ud = NULL;
     co->sch = S;
     co->status = COROUTINE_READY;
+    co->name = NULL;
+    co->yield_ns = 0;
+    co->deadline_ms = 0;
+    co->wait_item = NULL;
+    memset(co->local_slots, 0, sizeof(co->local_slots));
 
     return co;
 }
@@ -235,35 +643,175 @@ _co_new(struct schedule *S, coroutine_func func, void *ud) {
         return NULL;
     }
 
-    struct coroutine * co = NULL;
-
-    if (S->co_free_list.empty()) {
-        co = new coroutine;
-        co->stack = new char[S->stack_size];
-    } else {
-        co = S->co_free_list.front();
-        S->co_free_list.pop_front();
-
-        S->co_free_num--;
+    struct coroutine * co = _co_alloc(S);
+    if (NULL == co) {
+        return NULL;
     }
     co->func = func;
     co->ud = ud;
     co->sch = S;
     co->status = COROUTINE_READY;
+    co->name = NULL;
+    co->yield_ns = 0;
+    co->deadline_ms = 0;
+    co->wait_item = NULL;
+    memset(co->local_slots, 0, sizeof(co->local_slots));
 
     return co;
 }
 
-void _co_delete(struct coroutine *co) {
-    delete [] co->stack;
-    delete co;
+// 协程结束后放回空闲链表，运行在主上下文的栈上。空闲协程超过
+// hot_free_num(默认HOT_FREE_CO_NUM)的部分从最久没用的一端归还物理内存，
+// 超过 max_free_num(默认MAX_FREE_CO_NUM)的栈直接释放，@see _co_free_push
+static void _co_recycle(struct schedule *S, struct coroutine *co) {
+    _co_free_push(S, co);
+    S->co_alive_num--;
+    S->stats.alive_num = S->co_alive_num;
+}
+
+int32_t coroutine_prewarm(struct schedule *S, int32_t num) {
+    if (NULL == S || num <= 0) {
+        return 0;
+    }
+    S->warm_num = num;
+    if (S->hot_free_num < num) {
+        S->hot_free_num = num;
+    }
+    if (S->max_free_num < num) {
+        S->max_free_num = num;
+    }
+
+    // hot_free_num变大了，边界内已有的空闲协程的栈可能被madvise过，重新预热，并重新确定边界
+    int32_t i = 0;
+    S->co_free_edge = NULL;
+    for (struct coroutine * co = S->co_free_head; co != NULL && i < S->hot_free_num;
+        co = co->free_next, i++) {
+        if (co->stack != NULL) {
+            _co_warm_stack(S, co->stack);
+            co->stack_cold = false;
+        }
+        if (i == S->hot_free_num - 1) {
+            S->co_free_edge = co;
+        }
+    }
+
+    // 优先给栈已经释放的空闲协程重新分配栈
+    while (S->co_free_num < num) {
+        struct coroutine * co = S->co_empty_head;
+        if (co != NULL) {
+            S->co_empty_head = co->free_next;
+            co->free_next = NULL;
+        } else {
+            co = _co_new_slot(S);
+        }
+        if (co->share_stack == NULL) {
+            co->stack = _co_stack_alloc(S->stack_size);
+            if (co->stack == NULL) {
+                _co_empty_push(S, co);
+                break;
+            }
+            _co_warm_stack(S, co->stack);
+        }
+        _co_free_push(S, co);
+    }
+    return S->co_free_num;
+}
+
+void coroutine_get_pool_stats(struct schedule *S, co_pool_stats* stats) {
+    if (NULL == stats) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (NULL == S) {
+        return;
+    }
+    stats->alive_num = S->co_alive_num;
+    stats->alive_peak = S->co_alive_peak;
+    stats->free_num = S->co_free_num;
+    stats->warm_num = S->warm_num;
+    stats->cold_alloc_num = S->co_cold_alloc_num;
+}
+
+void coroutine_get_stats(struct schedule *S, co_stats* stats) {
+    if (NULL == stats) {
+        return;
+    }
+    if (NULL == S) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = S->stats;
+    stats->long_run_num = __atomic_load_n(&S->stats.long_run_num, __ATOMIC_RELAXED);
+}
+
+void coroutine_set_name(struct schedule *S, int64_t id, const char* name) {
+    if (NULL == S) {
+        return;
+    }
+    struct coroutine * co = _co_find(S, id);
+    if (co != NULL) {
+        co->name = name;
+    }
+}
+
+uint32_t coroutine_stack_high_water(struct schedule *S) {
+    if (NULL == S) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < S->co_slot_num; i++) {
+        struct coroutine * co = _co_slot(S, i);
+        if (co->stack != NULL) {
+            _co_update_high_water(S, co->stack, S->stack_size);
+        }
+    }
+    for (int32_t i = 0; i < S->share_stack_num; i++) {
+        _co_update_high_water(S, S->share_stacks[i]->stack_buffer, S->stack_size);
+    }
+    return S->stack_high_water;
+}
+
+// 把占用共享栈的协程已经使用的部分栈保存起来，缓冲区按实际使用量分配，
+// 使用量明显变小时缩小缓冲区，避免偶尔的深调用让协程一直占用大块内存
+static void _co_save_stack(struct coroutine *co) {
+    stack_mem* mem = co->share_stack;
+    char* top = mem->stack_buffer + mem->stack_size;
+    uint32_t used = static_cast<uint32_t>(top - static_cast<char*>(co->ctx.sp));
+    if (used > co->save_capacity || used < co->save_capacity / 4) {
+        free(co->save_buffer);
+        co->save_buffer = static_cast<char*>(malloc(used));
+        co->save_capacity = used;
+    }
+    memcpy(co->save_buffer, co->ctx.sp, used);
+    co->save_size = used;
+}
+
+// 切换到协程之前调用（此时运行在主上下文的栈上），让共享栈上保存的是此协程的内容
+static void _co_acquire_stack(struct coroutine *co) {
+    stack_mem* mem = co->share_stack;
+    if (mem == NULL || mem->occupy_co == co) {
+        return;
+    }
+    if (mem->occupy_co != NULL) {
+        _co_save_stack(mem->occupy_co);
+    }
+    mem->occupy_co = co;
+    if (co->status == COROUTINE_SUSPEND && co->save_size > 0) {
+        memcpy(static_cast<char*>(co->ctx.sp), co->save_buffer, co->save_size);
+    }
+}
+
+bool co_is_share_stack(struct coroutine *co) {
+    return co != NULL && co->share_stack != NULL;
 }
 
 struct schedule *
-coroutine_open(uint32_t stack_size) {
+coroutine_open(uint32_t stack_size, int32_t share_stack_num) {
     if (0 == stack_size) {
         stack_size = 256 * 1024;
     }
+    // 栈按页对齐，便于设置保护页和madvise
+    size_t page_size = GetPageSize();
+    stack_size = (stack_size + page_size - 1) / page_size * page_size;
     pid_t pid = GetPid();
     stCoRoutineEnv_t *env = GetCoEnv(pid);
     if (env) {
@@ -276,16 +824,56 @@ coroutine_open(uint32_t stack_size) {
     PLOG_INFO("init pid %ld env %p\n", (long)pid, env);
 
     struct schedule *S = new schedule;
-    S->nco = 0;
     S->running = -1;
+    S->running_co = NULL;
+    S->co_slot_num = 0;
+    S->co_free_head = NULL;
+    S->co_free_tail = NULL;
+    S->co_free_edge = NULL;
     S->co_free_num = 0;
+    S->co_empty_head = NULL;
     S->stack_size = stack_size;
+    S->share_stacks = NULL;
+    S->share_stack_num = 0;
+    S->share_stack_idx = 0;
+    S->stack_high_water = 0;
+    S->hot_free_num = HOT_FREE_CO_NUM;
+    S->max_free_num = MAX_FREE_CO_NUM;
+    S->warm_num = 0;
+    S->co_alive_num = 0;
+    S->co_alive_peak = 0;
+    S->co_cold_alloc_num = 0;
+    memset(&S->stats, 0, sizeof(S->stats));
+    S->running_name = NULL;
+    S->wd_resume_num = 0;
+    S->wd_since_ms = 0;
+    S->wd_reported = false;
+    if (share_stack_num > 0) {
+        S->share_stacks = new stack_mem*[share_stack_num];
+        for (int32_t i = 0; i < share_stack_num; i++) {
+            stack_mem* mem = new stack_mem;
+            mem->stack_buffer = _co_stack_alloc(stack_size);
+            mem->stack_size = stack_size;
+            mem->occupy_co = NULL;
+            S->share_stacks[i] = mem;
+        }
+        S->share_stack_num = share_stack_num;
+    }
 
     env->co_schedule = S;
 
     stCoEpoll_t *ev = AllocEpoll();
     SetEpoll(env, ev);
 
+    // 其他线程随时可能投递恢复请求，收件箱在这里创建好，之后不再变化
+    ev->pInbox = CoInboxAlloc(ev);
+    S->inbox = ev->pInbox;
+    if (!S->inbox) {
+        PLOG_ERROR("create coroutine inbox failed : %s", strerror(errno));
+    }
+
+    _co_watchdog_register(S);
+
     PLOG_INFO("coroutine_open is called.");
     return S;
 }
@@ -302,20 +890,34 @@ void coroutine_close(struct schedule *S) {
         return;
     }
 
-    FreeEpoll(env->pEpoll);
+    // 先从watchdog中移除，之后watchdog线程不会再访问S
+    _co_watchdog_unregister(S);
 
-    // 遍历所有的协程，逐个释放
-    cxx::unordered_map<int64_t, coroutine*>::iterator pos = S->co_hash_map.begin();
-    for (; pos != S->co_hash_map.end(); pos++) {
-        if (pos->second) {
-            _co_delete(pos->second);
+    // 令牌可能比调度器活得久，解除还未结束的协程与令牌的关联
+    for (uint32_t i = 0; i < S->co_slot_num; i++) {
+        struct coroutine * co = _co_slot(S, i);
+        if (co->cancel_token != NULL) {
+            coroutine_set_cancel_token(S, _co_id(co), NULL);
         }
     }
 
-    std::list<coroutine*>::iterator p = S->co_free_list.begin();
-    for (; p != S->co_free_list.end(); p++) {
-        _co_delete(*p);
+    S->inbox = NULL;
+    FreeEpoll(env->pEpoll);
+
+    // 遍历所有的协程槽，逐个释放
+    for (uint32_t i = 0; i < S->co_slot_num; i++) {
+        _co_release_stack(S, _co_slot(S, i));
+        free(_co_slot(S, i)->park_item);
+    }
+    for (size_t i = 0; i < S->co_slabs.size(); i++) {
+        delete [] S->co_slabs[i];
+    }
+
+    for (int32_t i = 0; i < S->share_stack_num; i++) {
+        _co_stack_free(S->share_stacks[i]->stack_buffer, S->stack_size);
+        delete S->share_stacks[i];
     }
+    delete [] S->share_stacks;
 
     // 释放掉整个调度器
     delete S;
@@ -331,9 +933,10 @@ int64_t coroutine_new(struct schedule *S, cxx::function<void()>& std_func) {
         return -1;
     }
     struct coroutine *co = _co_new(S, std_func);
-    int64_t id = S->nco;
-    S->co_hash_map[id] = co;
-    S->nco++;
+    if (NULL == co) {
+        return -1;
+    }
+    int64_t id = _co_id(co);
 
     PLOG_TRACE("coroutine %ld is created.", id);
     return id;
@@ -344,38 +947,162 @@ int64_t coroutine_new(struct schedule *S, coroutine_func func, void *ud) {
         return -1;
     }
     struct coroutine *co = _co_new(S, func, ud);
-    int64_t id = S->nco;
-    S->co_hash_map[id] = co;
-    S->nco++;
+    if (NULL == co) {
+        return -1;
+    }
+    int64_t id = _co_id(co);
 
     PLOG_TRACE("coroutine %ld is created.", id);
     return id;
 }
 
-static void mainfunc(uint32_t low32, uint32_t hi32) {
-    uintptr_t ptr = (uintptr_t) low32 | ((uintptr_t) hi32 << 32);
-    struct schedule *S = (struct schedule *) ptr;
+// 上下文切换只保存ABI约定的callee-saved寄存器，caller-saved寄存器在调用coctx_swap之前
+// 已经由编译器处理，不需要像swapcontext那样保存全部寄存器和信号掩码
+#if defined(__x86_64__)
+// 栈上(从低到高): mxcsr/x87控制字, r15, r14, r13, r12, rbx, rbp, 返回地址
+__asm__(
+    ".text\n"
+    ".globl coctx_swap\n"
+    ".type coctx_swap, @function\n"
+    "coctx_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coctx_swap, .-coctx_swap\n"
+    // 新上下文第一次被切换时从这里开始，r12为入口函数，r13为参数
+    ".globl coctx_entry\n"
+    ".type coctx_entry, @function\n"
+    "coctx_entry:\n"
+    "    movq %r13, %rdi\n"
+    "    callq *%r12\n"
+    "    ud2\n"
+    ".size coctx_entry, .-coctx_entry\n"
+);
+
+enum {
+    kCtxFpuSlot = 0, kCtxR15, kCtxR14, kCtxR13, kCtxR12, kCtxRbx, kCtxRbp, kCtxRet,
+    kCtxSlotNum
+};
+#elif defined(__aarch64__)
+// 栈上(从低到高): x19-x28, x29(fp), x30(lr), d8-d15
+__asm__(
+    ".text\n"
+    ".globl coctx_swap\n"
+    ".type coctx_swap, %function\n"
+    "coctx_swap:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    ldr x9, [x1]\n"
+    "    mov sp, x9\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size coctx_swap, .-coctx_swap\n"
+    // 新上下文第一次被切换时从这里开始，x19为入口函数，x20为参数
+    ".globl coctx_entry\n"
+    ".type coctx_entry, %function\n"
+    "coctx_entry:\n"
+    "    mov x0, x20\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    ".size coctx_entry, .-coctx_entry\n"
+);
+
+enum {
+    kCtxX19 = 0, kCtxX20, kCtxX29 = 10, kCtxX30,
+    kCtxSlotNum = 20
+};
+#else
+#error "coctx_swap only supports x86-64 and aarch64"
+#endif
+
+extern "C" void coctx_entry();
+
+void coctx_make(coctx_t* ctx, char* stack, size_t stack_size, coctx_pfn_t fn, void* arg) {
+    // 栈顶按16字节对齐，保证入口函数被调用时满足ABI的栈对齐要求
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + stack_size) & ~static_cast<uintptr_t>(15);
+    void** sp = reinterpret_cast<void**>(top) - kCtxSlotNum - 2;
+    memset(sp, 0, sizeof(void*) * kCtxSlotNum);
+#if defined(__x86_64__)
+    // mxcsr和x87控制字使用默认值
+    uint32_t* fpu = reinterpret_cast<uint32_t*>(&sp[kCtxFpuSlot]);
+    fpu[0] = 0x1F80;
+    fpu[1] = 0x037F;
+    sp[kCtxR12] = reinterpret_cast<void*>(fn);
+    sp[kCtxR13] = arg;
+    sp[kCtxRet] = reinterpret_cast<void*>(coctx_entry);
+#else
+    sp[kCtxX19] = reinterpret_cast<void*>(fn);
+    sp[kCtxX20] = arg;
+    sp[kCtxX30] = reinterpret_cast<void*>(coctx_entry);
+#endif
+    ctx->sp = sp;
+}
+
+static void mainfunc(void* arg) {
+    struct schedule *S = static_cast<struct schedule *>(arg);
     int64_t id = S->running;
-    struct coroutine *C = S->co_hash_map[id];
+    struct coroutine *C = S->running_co;
     if (C->func != NULL) {
         C->func(S, C->ud);
     } else {
         C->std_func();
     }
-    S->co_free_list.push_back(C);
-    S->co_free_num++;
+    if (C->cancel_token != NULL) {
+        coroutine_set_cancel_token(S, id, NULL);
+    }
+    C->status = COROUTINE_DEAD;
 
-    if (S->co_free_num > MAX_FREE_CO_NUM) {
-        coroutine* co = S->co_free_list.front();
-        _co_delete(co);
+    __atomic_store_n(&S->running, -1, __ATOMIC_RELAXED);
+    S->running_co = NULL;
+    PLOG_TRACE("coroutine %ld is deleted.", id);
 
-        S->co_free_list.pop_front();
-        S->co_free_num--;
+    // 协程已经结束，共享栈上的内容不需要再保存
+    if (C->share_stack != NULL) {
+        C->share_stack->occupy_co = NULL;
+        C->save_size = 0;
     }
 
-    S->co_hash_map.erase(id);
-    S->running = -1;
-    PLOG_TRACE("coroutine %ld is deleted.", id);
+    // 由coroutine_resume在主上下文中把协程放回空闲列表，此时还不能释放自己正在使用的栈
+    coctx_swap(&C->ctx, &S->main);
 }
 
 int32_t coroutine_resume(struct schedule * S, int64_t id, int32_t result) {
@@ -385,56 +1112,66 @@ int32_t coroutine_resume(struct schedule * S, int64_t id, int32_t result) {
     if (S->running != -1) {
         return kCO_CANNOT_RESUME_IN_COROUTINE;
     }
-    cxx::unordered_map<int64_t, coroutine*>::iterator pos = S->co_hash_map.find(id);
-
-    // 如果在协程哈希表中没有找到，或者找到的协程内容为空
-    if (pos == S->co_hash_map.end()) {
-        PLOG_ERROR("coroutine %ld can't find in co_map", id);
-        return kCO_COROUTINE_UNEXIST;
-    }
-
-    struct coroutine *C = pos->second;
+    // 协程槽不存在，或者槽已经被复用、协程已经结束
+    struct coroutine *C = _co_find(S, id);
     if (NULL == C) {
-        PLOG_ERROR("coroutine %ld instance is NULL", id);
+        PLOG_ERROR("coroutine %ld can't find in co_slabs", id);
         return kCO_COROUTINE_UNEXIST;
     }
 
     C->result = result;
     int status = C->status;
-    switch (status) {
-        case COROUTINE_READY: {
-            PLOG_TRACE("coroutine %ld status is COROUTINE_READY, begin to execute...", id);
-
-            getcontext(&C->ctx);
-            C->ctx.uc_stack.ss_sp = C->stack;
-            C->ctx.uc_stack.ss_size = S->stack_size;
-            C->ctx.uc_stack.ss_flags = 0;
-            C->ctx.uc_link = &S->main;
-            S->running = id;
-            C->status = COROUTINE_RUNNING;
-            uintptr_t ptr = (uintptr_t) S;
-            makecontext(&C->ctx, (void (*)(void)) mainfunc, 2,
-            (uint32_t)ptr,  // NOLINT
-            (uint32_t)(ptr>>32));  // NOLINT
-
-            swapcontext(&S->main, &C->ctx);
-
-            break;
+    if (status != COROUTINE_READY && status != COROUTINE_SUSPEND) {
+        PLOG_DEBUG("coroutine %ld status is failed, can not to be resume...", id);
+        return kCO_COROUTINE_STATUS_ERROR;
+    }
+
+    // 计数每次都更新，耗时按CO_STATS_SAMPLE_MASK采样，避免每次切换都读两次时钟
+    co_stats& stats = S->stats;
+    __atomic_store_n(&stats.resume_num, stats.resume_num + 1, __ATOMIC_RELAXED);
+    unsigned long long start_ns = 0;
+    if ((stats.resume_num & CO_STATS_SAMPLE_MASK) == 0 || C->yield_ns != 0) {
+        start_ns = GetTickNS();
+        if (C->yield_ns != 0) {
+            _co_hist_add(&stats.wakeup_ns, start_ns - C->yield_ns);
+            C->yield_ns = 0;
         }
-        case COROUTINE_SUSPEND: {
-            PLOG_TRACE("coroutine %ld status is COROUTINE_SUSPEND,"
-                    "begin to resume...", id);
+    }
 
-            S->running = id;
-            C->status = COROUTINE_RUNNING;
-            swapcontext(&S->main, &C->ctx);
+    if (status == COROUTINE_READY) {
+        PLOG_TRACE("coroutine %ld status is COROUTINE_READY, begin to execute...", id);
 
-            break;
+        _co_acquire_stack(C);
+        if (C->share_stack != NULL) {
+            coctx_make(&C->ctx, C->share_stack->stack_buffer, C->share_stack->stack_size,
+                mainfunc, S);
+        } else {
+            coctx_make(&C->ctx, C->stack, S->stack_size, mainfunc, S);
         }
+    } else {
+        PLOG_TRACE("coroutine %ld status is COROUTINE_SUSPEND,"
+                "begin to resume...", id);
+
+        _co_acquire_stack(C);
+    }
+    __atomic_store_n(&S->running_name, C->name, __ATOMIC_RELAXED);
+    __atomic_store_n(&S->running, id, __ATOMIC_RELAXED);
+    S->running_co = C;
+    C->status = COROUTINE_RUNNING;
+    g_co_current = C;
+
+    coctx_swap(&S->main, &C->ctx);
+
+    // 协程让出或结束后回到主上下文
+    g_co_current = NULL;
+
+    if (start_ns != 0) {
+        unsigned long long end_ns = GetTickNS();
+        _co_hist_add(&stats.resume_ns, end_ns > start_ns ? end_ns - start_ns : 0);
+    }
 
-        default:
-            PLOG_DEBUG("coroutine %ld status is failed, can not to be resume...", id);
-            return kCO_COROUTINE_STATUS_ERROR;
+    if (C->status == COROUTINE_DEAD) {
+        _co_recycle(S, C);
     }
 
     return 0;
@@ -452,7 +1189,7 @@ int32_t coroutine_yield(struct schedule * S) {
     }
 
     assert(id >= 0);
-    struct coroutine * C = S->co_hash_map[id];
+    struct coroutine * C = S->running_co;
 
     if (C->status != COROUTINE_RUNNING) {
         PLOG_ERROR("coroutine %ld status is SUSPEND, can't yield again.", id);
@@ -460,34 +1197,32 @@ int32_t coroutine_yield(struct schedule * S) {
     }
 
     C->status = COROUTINE_SUSPEND;
-    S->running = -1;
+    __atomic_store_n(&S->running, -1, __ATOMIC_RELAXED);
+    S->running_co = NULL;
+
+    S->stats.yield_num++;
+    if ((S->stats.yield_num & CO_STATS_SAMPLE_MASK) == 0) {
+        C->yield_ns = GetTickNS();
+    }
 
     PLOG_TRACE("coroutine %ld will be yield, swith to main loop...", id);
-    swapcontext(&C->ctx, &S->main);
+    coctx_swap(&C->ctx, &S->main);
 
     return C->result;
 }
 
 int coroutine_status(struct schedule * S, int64_t id) {
-    // assert(id >= 0 && id <= S->nco);
     if (NULL == S) {
         return COROUTINE_DEAD;
     }
 
-    if (id < 0 || id > S->nco) {
+    struct coroutine *C = _co_find(S, id);
+    if (NULL == C) {
         PLOG_DEBUG("coroutine %ld not exist", id);
         return COROUTINE_DEAD;
     }
 
-    cxx::unordered_map<int64_t, coroutine*>::iterator pos = S->co_hash_map.find(id);
-
-    // 如果在协程哈希表中没有找到，或者找到的协程内容为空
-    if (pos == S->co_hash_map.end()) {
-        PLOG_DEBUG("cann't find coroutine %ld", id);
-        return COROUTINE_DEAD;
-    }
-
-    return (pos->second)->status;
+    return C->status;
 }
 
 int64_t coroutine_running(struct schedule * S) {
@@ -503,15 +1238,12 @@ coroutine* get_curr_coroutine(struct schedule * S) {
         return NULL;
     }
 
-    cxx::unordered_map<int64_t, coroutine*>::iterator pos = S->co_hash_map.find(S->running);
-
-    // 如果在协程哈希表中没有找到，或者找到的协程内容为空
-    if (pos == S->co_hash_map.end()) {
-        PLOG_FATAL("coroutine %ld can't find in co_map", S->running);
+    if (NULL == S->running_co) {
+        PLOG_FATAL("coroutine %ld can't find in co_slabs", S->running);
         return NULL;
     }
 
-    return pos->second;
+    return S->running_co;
 }
 
 
@@ -519,12 +1251,17 @@ void DoTask(struct schedule*, void *ud) {
     CoroutineTask* task = static_cast<CoroutineTask*>(ud);
     assert(task != NULL);
     task->Run();
-    delete task;
+    task->schedule_obj()->FinishTask(task);
 }
 
 CoroutineTask::CoroutineTask()
         : id_(-1),
-          schedule_obj_(NULL) {
+          schedule_obj_(NULL),
+          pool_index_(-1),
+          prev_(NULL),
+          next_(NULL),
+          deadline_ms_(0),
+          cancel_token_(NULL) {
     // DO NOTHING
 }
 
@@ -532,14 +1269,9 @@ CoroutineTask::~CoroutineTask() {
     if (schedule_obj_ == NULL)
         return;
 
-    // 如果schedule_obj_没进入Close()流程
+    // 如果schedule_obj_没进入Close()流程，防止schedule_在清理时重复delete自己
     if (schedule_obj_->schedule_ != NULL) {
-        if (id_ == -1) {
-            schedule_obj_->pre_start_task_.erase(this);
-        } else {
-            // 防止schedule_在清理时重复delete自己
-            schedule_obj_->task_map_.erase(id_);
-        }
+        schedule_obj_->RemoveTask(this);
     }
 }
 
@@ -551,9 +1283,15 @@ int64_t CoroutineTask::Start(bool is_immediately) {
     id_ = coroutine_new(schedule_obj_->schedule_, DoTask, this);
     if (id_ < 0)
         id_ = -1;
+    // 类型名是静态存储的字符串，watchdog报告时再demangle
+    coroutine_set_name(schedule_obj_->schedule_, id_, typeid(*this).name());
+    if (deadline_ms_ != 0) {
+        coroutine_set_deadline(schedule_obj_->schedule_, id_, deadline_ms_);
+    }
+    if (cancel_token_ != NULL) {
+        coroutine_set_cancel_token(schedule_obj_->schedule_, id_, cancel_token_);
+    }
     int64_t id = id_;
-    schedule_obj_->task_map_[id_] = this;
-    schedule_obj_->pre_start_task_.erase(this);
     if (is_immediately) {
         int32_t ret = coroutine_resume(schedule_obj_->schedule_, id_);
         if (ret != 0) {
@@ -566,8 +1304,9 @@ int64_t CoroutineTask::Start(bool is_immediately) {
 CoroutineSchedule::CoroutineSchedule()
         : schedule_(NULL),
           timer_(NULL),
-          task_map_(),
-          pre_start_task_() {
+          task_head_(NULL),
+          task_num_(0),
+          task_pools_() {
     // DO NOTHING
 }
 
@@ -576,9 +1315,9 @@ CoroutineSchedule::~CoroutineSchedule() {
         Close();
 }
 
-int CoroutineSchedule::Init(Timer* timer, uint32_t stack_size) {
+int CoroutineSchedule::Init(Timer* timer, uint32_t stack_size, int32_t share_stack_num) {
     timer_ = timer;
-    schedule_ = coroutine_open(stack_size);
+    schedule_ = coroutine_open(stack_size, share_stack_num);
     if (schedule_ == NULL)
         return -1;
     return 0;
@@ -593,30 +1332,29 @@ int CoroutineSchedule::Close() {
 
     timer_ = NULL;
 
-    ret += pre_start_task_.size();
-    std::set<CoroutineTask*>::iterator pre_it;
-    for (pre_it = pre_start_task_.begin(); pre_it != pre_start_task_.end();
-            ++pre_it) {
-        delete *pre_it;
+    // schedule_已经置空，任务的析构函数不会再修改链表
+    ret = task_num_;
+    while (task_head_ != NULL) {
+        CoroutineTask* task = task_head_;
+        task_head_ = task->next_;
+        delete task;
     }
+    task_num_ = 0;
 
-    ret += task_map_.size();
-    cxx::unordered_map<int64_t, CoroutineTask*>::iterator it;
-    for (it = task_map_.begin(); it != task_map_.end();) {
-        delete it->second;
-
-        // 为了安全的删除迭代器指向的对象，所以先++后调用
-        task_map_.erase(it++);
+    for (size_t i = 0; i < task_pools_.size(); i++) {
+        while (task_pools_[i].free_head != NULL) {
+            CoroutineTask* task = task_pools_[i].free_head;
+            task_pools_[i].free_head = task->next_;
+            delete task;
+        }
     }
+    task_pools_.clear();
 
     return ret;
 }
 
 int CoroutineSchedule::Size() const {
-    int ret = 0;
-    ret += task_map_.size();
-    ret += pre_start_task_.size();
-    return ret;
+    return task_num_;
 }
 
 CoroutineTask* CoroutineSchedule::CurrentTask() const {
@@ -624,12 +1362,16 @@ CoroutineTask* CoroutineSchedule::CurrentTask() const {
     return Find(id);
 }
 
+// 任务对象就是协程的参数，直接通过协程ID找到，不需要另外维护ID到任务的映射
 CoroutineTask* CoroutineSchedule::Find(int64_t id) const {
-    CoroutineTask* ret = NULL;
-    cxx::unordered_map<int64_t, CoroutineTask*>::const_iterator it = task_map_.find(id);
-    if (it != task_map_.end())
-        ret = it->second;
-    return ret;
+    if (schedule_ == NULL) {
+        return NULL;
+    }
+    struct coroutine * co = _co_find(schedule_, id);
+    if (co == NULL || co->func != DoTask) {
+        return NULL;
+    }
+    return static_cast<CoroutineTask*>(co->ud);
 }
 
 int64_t CoroutineSchedule::CurrentTaskId() const {
@@ -638,11 +1380,117 @@ int64_t CoroutineSchedule::CurrentTaskId() const {
 
 int CoroutineSchedule::AddTaskToSchedule(CoroutineTask* task) {
     task->schedule_obj_ = this;
-    pre_start_task_.insert(task);
+    task->prev_ = NULL;
+    task->next_ = task_head_;
+    if (task_head_ != NULL) {
+        task_head_->prev_ = task;
+    }
+    task_head_ = task;
+    task_num_++;
     return 0;
 }
 
+void CoroutineSchedule::RemoveTask(CoroutineTask* task) {
+    if (task->prev_ != NULL) {
+        task->prev_->next_ = task->next_;
+    } else if (task_head_ == task) {
+        task_head_ = task->next_;
+    } else {
+        // 不在链表中(已经放回对象池)
+        return;
+    }
+    if (task->next_ != NULL) {
+        task->next_->prev_ = task->prev_;
+    }
+    task->prev_ = NULL;
+    task->next_ = NULL;
+    task_num_--;
+}
+
+int32_t CoroutineSchedule::NextTaskTypeIndex() {
+    static int32_t next_index = 0;
+    return __atomic_fetch_add(&next_index, 1, __ATOMIC_RELAXED);
+}
+
+CoroutineTask* CoroutineSchedule::PopPooledTask(int32_t pool_index) {
+    if (static_cast<size_t>(pool_index) >= task_pools_.size()) {
+        task_pools_.resize(pool_index + 1);
+    }
+    TaskPool& pool = task_pools_[pool_index];
+    CoroutineTask* task = pool.free_head;
+    if (task == NULL) {
+        pool.new_num++;
+        return NULL;
+    }
+    pool.free_head = task->next_;
+    pool.free_num--;
+    pool.reuse_num++;
+    task->next_ = NULL;
+    return task;
+}
+
+// 在协程中、Run返回之后调用，此时协程还没有结束，只处理任务对象，协程槽由coroutine_resume回收
+void CoroutineSchedule::FinishTask(CoroutineTask* task) {
+    if (task->pool_index_ < 0 || schedule_ == NULL) {
+        delete task;
+        return;
+    }
+    RemoveTask(task);
+    task->Reset();
+    task->id_ = -1;
+    task->deadline_ms_ = 0;
+    task->cancel_token_ = NULL;
+
+    TaskPool& pool = task_pools_[task->pool_index_];
+    if (pool.free_num >= MAX_FREE_CO_NUM) {
+        task->schedule_obj_ = NULL;
+        delete task;
+        return;
+    }
+    task->next_ = pool.free_head;
+    pool.free_head = task;
+    pool.free_num++;
+}
+
+void CoroutineSchedule::ReleaseTask(CoroutineTask* task) {
+    if (task == NULL || task->schedule_obj_ != this) {
+        return;
+    }
+    FinishTask(task);
+}
+
+int32_t CoroutineSchedule::Prewarm(int32_t num) {
+    return coroutine_prewarm(schedule_, num);
+}
+
+void CoroutineSchedule::GetStats(co_stats* stats) const {
+    coroutine_get_stats(schedule_, stats);
+}
+
+void CoroutineSchedule::GetPoolStats(CoroutinePoolStats* stats) const {
+    if (stats == NULL) {
+        return;
+    }
+    coroutine_get_pool_stats(schedule_, &stats->co);
+    stats->task_cached_num = 0;
+    stats->task_new_num = 0;
+    stats->task_reuse_num = 0;
+    for (size_t i = 0; i < task_pools_.size(); i++) {
+        stats->task_cached_num += task_pools_[i].free_num;
+        stats->task_new_num += task_pools_[i].new_num;
+        stats->task_reuse_num += task_pools_[i].reuse_num;
+    }
+}
+
+static int _co_clamp_timeout(struct coroutine *co, int timeout_ms);
+static int32_t _co_yield_until_deadline(struct schedule *S);
+
 int32_t CoroutineSchedule::Yield(int32_t timeout_ms) {
+    struct coroutine * co = schedule_ != NULL ? schedule_->running_co : NULL;
+    if (co != NULL && _co_clamp_timeout(co, -1) == 0) {
+        return kCO_TIMEOUT;
+    }
+
     int64_t timerid = -1;
     int64_t co_id   = INVALID_CO_ID;
     if (timer_ && timeout_ms > 0) {
@@ -657,7 +1505,7 @@ int32_t CoroutineSchedule::Yield(int32_t timeout_ms) {
         }
     }
 
-    int32_t ret = coroutine_yield(this->schedule_);
+    int32_t ret = _co_yield_until_deadline(this->schedule_);
 
     if (timerid >= 0) {
         timer_->StopTimer(timerid);
@@ -670,11 +1518,24 @@ int32_t CoroutineSchedule::Resume(int64_t id, int32_t result) {
     return coroutine_resume(this->schedule_, id, result);
 }
 
+int32_t CoroutineSchedule::PostResume(int64_t id, int32_t result) {
+    return coroutine_post_resume(this->schedule_, id, result);
+}
+
+int32_t CoroutineSchedule::Wakeup() {
+    return coroutine_wakeup(this->schedule_);
+}
+
+uint32_t CoroutineSchedule::StackHighWater() const {
+    return coroutine_stack_high_water(schedule_);
+}
+
 int CoroutineSchedule::Status(int64_t id) {
     return coroutine_status(this->schedule_, id);
 }
 
 int32_t CoroutineSchedule::OnTimeout(int64_t id) {
+    schedule_->stats.timeout_num++;
     Resume(id, kCO_TIMEOUT);
     return kTIMER_BE_REMOVED;
 }
@@ -687,47 +1548,143 @@ CoroutineSchedule* CoroutineTask::schedule_obj() {
     return schedule_obj_;
 }
 
+void CoroutineTask::SetDeadline(uint32_t timeout_ms) {
+    deadline_ms_ = co_clock_ms() + timeout_ms;
+    if (id_ >= 0 && schedule_obj_ != NULL) {
+        coroutine_set_deadline(schedule_obj_->schedule_, id_, deadline_ms_);
+    }
+}
+
+void CoroutineTask::SetCancelToken(CoCancelToken* token) {
+    cancel_token_ = token;
+    if (id_ >= 0 && schedule_obj_ != NULL) {
+        coroutine_set_cancel_token(schedule_obj_->schedule_, id_, cancel_token_);
+    }
+}
+
 
 void co_log_err(const char *fmt, ...)
 {
 }
 
-static unsigned long long counter(void);
-static unsigned long long getCpuKhz() {
-    FILE *fp = fopen("/proc/cpuinfo", "r");
-    if (!fp) return 1;
-    char buf[4096] = {0};
-    fread(buf, 1, sizeof(buf), fp);
-    fclose(fp);
+// 协程运行时的时钟，毫秒精度，单调递增，起点与CLOCK_MONOTONIC相同。
+// CPU支持invariant TSC(频率不随降频和睡眠变化)且内核也以TSC作为时钟源时直接读TSC，
+// 启动时对照CLOCK_MONOTONIC校准频率；否则(多数虚拟机、老CPU)使用CLOCK_MONOTONIC_COARSE，
+// 它只读vDSO中的变量，同样不需要系统调用
+struct stCoClock_t {
+    bool bUseTsc;
+    double dMsPerTick;
+    double dNsPerTick;
+    unsigned long long ullTscBase;
+    unsigned long long ullMsBase;
+    unsigned long long ullNsBase;
+};
+static stCoClock_t g_CoClock;
+static pthread_once_t g_CoClockOnce = PTHREAD_ONCE_INIT;
+
+static unsigned long long MonotonicNs(clockid_t clock_id) {
+    struct timespec ts;
+    clock_gettime(clock_id, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+static inline unsigned long long ReadTsc() {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<unsigned long long>(hi) << 32) | lo;
+}
 
-    char *lp = strstr(buf, "cpu MHz");
-    if (!lp) return 1;
-    lp += strlen("cpu MHz");
-    while (*lp == ' ' || *lp == '\t' || *lp == ':') {
-        ++lp;
+static bool HasInvariantTsc() {
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007) {
+        return false;
     }
-
-    double mhz = atof(lp);
-    unsigned long long u = (unsigned long long)(mhz * 1000);
-    return u;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    if ((edx & (1 << 8)) == 0) {
+        return false;
+    }
+    // 内核认为TSC不可靠(例如多路CPU之间不同步)时会换用其他时钟源，这时也不使用TSC
+    char clocksource[32] = {0};
+    FILE* fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+    if (fp != NULL) {
+        if (fgets(clocksource, sizeof(clocksource), fp) == NULL) {
+            clocksource[0] = 0;
+        }
+        fclose(fp);
+        return strncmp(clocksource, "tsc", 3) == 0;
+    }
+    return true;
+}
+#endif
+
+static void InitCoClock() {
+    g_CoClock.bUseTsc = false;
+#if defined(__x86_64__)
+    if (HasInvariantTsc()) {
+        // 忙等10ms校准，时钟读数的抖动在几十纳秒，误差在10ppm以内
+        unsigned long long ns0 = MonotonicNs(CLOCK_MONOTONIC);
+        unsigned long long tsc0 = ReadTsc();
+        unsigned long long ns1 = ns0;
+        while (ns1 - ns0 < 10000000ULL) {
+            ns1 = MonotonicNs(CLOCK_MONOTONIC);
+        }
+        unsigned long long tsc1 = ReadTsc();
+        if (tsc1 > tsc0) {
+            g_CoClock.bUseTsc = true;
+            g_CoClock.dMsPerTick = static_cast<double>(ns1 - ns0) / 1000000.0 / (tsc1 - tsc0);
+            g_CoClock.dNsPerTick = static_cast<double>(ns1 - ns0) / (tsc1 - tsc0);
+            g_CoClock.ullTscBase = tsc1;
+            g_CoClock.ullMsBase = ns1 / 1000000ULL;
+            g_CoClock.ullNsBase = ns1;
+        }
+    }
+#endif
+    PLOG_INFO("coroutine clock source : %s", g_CoClock.bUseTsc ? "tsc" : "monotonic_coarse");
 }
 
 static unsigned long long GetTickMS() {
-    static uint32_t khz = getCpuKhz();
-    return counter() / khz;
+    pthread_once(&g_CoClockOnce, InitCoClock);
+#if defined(__x86_64__)
+    if (g_CoClock.bUseTsc) {
+        // 不同核心的TSC可能有几个周期的差异，不能让时间倒退到起点之前
+        long long ticks = static_cast<long long>(ReadTsc() - g_CoClock.ullTscBase);
+        if (ticks < 0) {
+            ticks = 0;
+        }
+        return g_CoClock.ullMsBase + static_cast<unsigned long long>(ticks * g_CoClock.dMsPerTick);
+    }
+#endif
+    return MonotonicNs(CLOCK_MONOTONIC_COARSE) / 1000000ULL;
 }
 
-static unsigned long long counter(void)
-{
-    register uint32_t lo, hi;
-    register unsigned long long o;
-    __asm__ __volatile__ (
-        "rdtsc" : "=a"(lo), "=d"(hi)
-       );
-    o = hi;
-    o <<= 32;
-    return (o | lo);
+// 纳秒精度的时钟，用于统计耗时。没有TSC时使用CLOCK_MONOTONIC，COARSE的精度只有几毫秒
+static unsigned long long GetTickNS() {
+    pthread_once(&g_CoClockOnce, InitCoClock);
+#if defined(__x86_64__)
+    if (g_CoClock.bUseTsc) {
+        long long ticks = static_cast<long long>(ReadTsc() - g_CoClock.ullTscBase);
+        if (ticks < 0) {
+            ticks = 0;
+        }
+        return g_CoClock.ullNsBase + static_cast<unsigned long long>(ticks * g_CoClock.dNsPerTick);
+    }
+#endif
+    return MonotonicNs(CLOCK_MONOTONIC);
+}
+
+unsigned long long co_clock_ms() {
+    return GetTickMS();
+}
+
+unsigned long long co_now_ms() {
+    stCoRoutineEnv_t *env = GetCoEnv(GetPid());
+    if (env == NULL || env->ullNow == 0) {
+        return GetTickMS();
+    }
+    return env->ullNow;
 }
+
 /*
 static pid_t GetPid()
 {
@@ -829,18 +1786,102 @@ void inline Join(TLink*apLink, TLink *apOther)
 }
 
 
-int AddTimeout(stTimeout_t *apTimeout, stTimeoutItem_t *apItem, unsigned long long allNow)
+// 根据超时时间放入对应层的槽，已经过期的放入下一个要处理的槽
+static void AddToWheel(stTimeout_t *apTimeout, stTimeoutItem_t *apItem)
 {
-    if (apTimeout->ullStart == 0) {
-        apTimeout->ullStart = allNow;
-        apTimeout->llStartIdx = 0;
+    unsigned long long expire = apItem->ullExpireTime;
+    if (expire < apTimeout->ullStart) {
+        expire = apTimeout->ullStart;
     }
-    if (allNow < apTimeout->ullStart) {
-        co_log_err("CO_ERR: AddTimeout line %d allNow %llu apTimeout->ullStart %llu",
-                    __LINE__, allNow, apTimeout->ullStart);
+    unsigned long long diff = expire - apTimeout->ullStart;
 
-        return __LINE__;
+    if (diff < kWheelLevel0Size) {
+        int idx = expire & (kWheelLevel0Size - 1);
+        AddTail(apTimeout->tv1 + idx, apItem);
+        apTimeout->tv1Bitmap[idx / 64] |= 1ULL << (idx % 64);
+        return;
+    }
+
+    int level = 0;
+    for (; level < kWheelLevelNNum - 1; level++) {
+        if (diff < 1ULL << (kWheelLevel0Bits + (level + 1) * kWheelLevelNBits)) {
+            break;
+        }
+    }
+    // 超出时间轮范围的先放在最高层最远的槽，转到时再重新分配
+    unsigned long long max_diff = (1ULL << (kWheelLevel0Bits + kWheelLevelNNum * kWheelLevelNBits)) - 1;
+    if (diff > max_diff) {
+        expire = apTimeout->ullStart + max_diff;
     }
+    int idx = (expire >> (kWheelLevel0Bits + level * kWheelLevelNBits)) & (kWheelLevelNSize - 1);
+    AddTail(apTimeout->tvn[level] + idx, apItem);
+    apTimeout->tvnBitmap[level] |= 1ULL << idx;
+}
+
+// 把高层的一个槽下放到低层，返回槽的下标，为0时说明更高一层也转到了新的槽
+static int CascadeTimeout(stTimeout_t *apTimeout, int level)
+{
+    int idx = (apTimeout->ullStart >> (kWheelLevel0Bits + level * kWheelLevelNBits))
+        & (kWheelLevelNSize - 1);
+    stTimeoutItemLink_t *slot = apTimeout->tvn[level] + idx;
+    apTimeout->tvnBitmap[level] &= ~(1ULL << idx);
+    while (slot->head) {
+        stTimeoutItem_t *lp = slot->head;
+        PopHead<stTimeoutItem_t, stTimeoutItemLink_t>(slot);
+        AddToWheel(apTimeout, lp);
+    }
+    return idx;
+}
+
+// 第0层下标在[from, to)之间第一个可能有元素的槽，按64位一组跳过空槽，没有时返回to
+static inline int FindLevel0Slot(const stTimeout_t *apTimeout, int from, int to)
+{
+    while (from < to) {
+        uint64_t bits = apTimeout->tv1Bitmap[from / 64] >> (from % 64);
+        if (bits != 0) {
+            int idx = from + __builtin_ctzll(bits);
+            return idx < to ? idx : to;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return to;
+}
+
+// 返回距离最近一个超时的毫秒数，没有超时返回-1。
+// 槽的位图在元素被单独删除时不会清除，所以结果可能偏早，只会多唤醒一次，不会错过超时；
+// 第0层为空时返回下一次高层下放的时刻，远期超时最多每256ms唤醒一次
+static int NextTimeoutMS(const stTimeout_t *apTimeout, unsigned long long allNow)
+{
+    unsigned long long next = 0;
+    // 第0层从ullStart所在的槽往后找，找不到再从头找到ullStart之前，后者属于下一圈
+    int start = apTimeout->ullStart & (kWheelLevel0Size - 1);
+    int idx = FindLevel0Slot(apTimeout, start, kWheelLevel0Size);
+    if (idx < kWheelLevel0Size) {
+        next = apTimeout->ullStart + (idx - start);
+    } else if ((idx = FindLevel0Slot(apTimeout, 0, start)) < start) {
+        next = apTimeout->ullStart + (kWheelLevel0Size - start) + idx;
+    } else {
+        bool empty = true;
+        for (int level = 0; level < kWheelLevelNNum; level++) {
+            if (apTimeout->tvnBitmap[level] != 0) {
+                empty = false;
+                break;
+            }
+        }
+        if (empty) {
+            return -1;
+        }
+        next = (apTimeout->ullStart | (kWheelLevel0Size - 1)) + 1;
+    }
+    if (next <= allNow) {
+        return 0;
+    }
+    unsigned long long diff = next - allNow;
+    return diff > INT_MAX ? INT_MAX : static_cast<int>(diff);
+}
+
+int AddTimeout(stTimeout_t *apTimeout, stTimeoutItem_t *apItem, unsigned long long allNow)
+{
     if (apItem->ullExpireTime < allNow) {
         co_log_err("CO_ERR: AddTimeout line %d apItem->ullExpireTime %llu "
                 "allNow %llu apTimeout->ullStart %llu",
@@ -848,45 +1889,145 @@ int AddTimeout(stTimeout_t *apTimeout, stTimeoutItem_t *apItem, unsigned long lo
 
         return __LINE__;
     }
-    int diff = apItem->ullExpireTime - apTimeout->ullStart;
-
-    if (diff >= apTimeout->iItemSize) {
-        co_log_err("CO_ERR: AddTimeout line %d diff %d",
-                    __LINE__, diff);
-
-        return __LINE__;
-    }
-    AddTail(apTimeout->pItems + (apTimeout->llStartIdx + diff) % apTimeout->iItemSize , apItem);
+    AddToWheel(apTimeout, apItem);
 
     return 0;
 }
+
 inline void TakeAllTimeout(stTimeout_t *apTimeout,
         unsigned long long allNow,
         stTimeoutItemLink_t *apResult) {
-    if (apTimeout->ullStart == 0) {
-        apTimeout->ullStart = allNow;
-        apTimeout->llStartIdx = 0;
+    while (apTimeout->ullStart <= allNow) {
+        int idx = apTimeout->ullStart & (kWheelLevel0Size - 1);
+        if (idx == 0) {
+            for (int level = 0; level < kWheelLevelNNum; level++) {
+                if (CascadeTimeout(apTimeout, level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        // 直接跳到第0层下一个有元素的槽，不越过now和下一次需要下放的时刻，
+        // 长时间空闲或者一次追赶多毫秒时不必逐个检查空槽
+        unsigned long long limit = (apTimeout->ullStart | (kWheelLevel0Size - 1)) + 1;
+        if (limit > allNow + 1) {
+            limit = allNow + 1;
+        }
+        int found = FindLevel0Slot(apTimeout, idx, idx + static_cast<int>(limit - apTimeout->ullStart));
+        apTimeout->ullStart += found - idx;
+        if (apTimeout->ullStart == limit) {
+            continue;
+        }
+
+        Join<stTimeoutItem_t, stTimeoutItemLink_t>(apResult, apTimeout->tv1 + found);
+        apTimeout->tv1Bitmap[found / 64] &= ~(1ULL << (found % 64));
+        apTimeout->ullStart++;
     }
+}
 
-    if (allNow < apTimeout->ullStart) {
-        return;
+
+struct stTimerItem_t : public stTimeoutItem_t {
+    int64_t timer_id;
+    uint32_t timeout_ms;
+    TimeoutCallback cb;
+};
+
+CoroutineTimer::CoroutineTimer()
+        : wheel_(AllocTimeout()),
+          running_(NULL),
+          running_stopped_(false),
+          next_timer_id_(0) {
+    last_error_[0] = 0;
+}
+
+CoroutineTimer::~CoroutineTimer() {
+    cxx::unordered_map<int64_t, stTimerItem_t*>::iterator it = timers_.begin();
+    for (; it != timers_.end(); ++it) {
+        delete it->second;
     }
+    timers_.clear();
+    FreeTimeout(wheel_);
+}
 
-    int cnt = allNow - apTimeout->ullStart + 1;
-    if (cnt > apTimeout->iItemSize) {
-        cnt = apTimeout->iItemSize;
+int64_t CoroutineTimer::StartTimer(uint32_t timeout_ms, const TimeoutCallback& cb) {
+    if (!cb) {
+        snprintf(last_error_, sizeof(last_error_), "timeout callback is empty");
+        return -1;
     }
 
-    if (cnt < 0) {
-        return;
+    stTimerItem_t* item = new stTimerItem_t;
+    item->pPrev = NULL;
+    item->pNext = NULL;
+    item->pLink = NULL;
+    item->pfnPrepare = NULL;
+    item->pfnProcess = NULL;
+    item->co_id = INVALID_CO_ID;
+    item->bTimeout = false;
+    item->timer_id = next_timer_id_++;
+    item->timeout_ms = timeout_ms;
+    item->cb = cb;
+    item->ullExpireTime = GetTickMS() + timeout_ms;
+
+    AddToWheel(wheel_, item);
+    timers_[item->timer_id] = item;
+    return item->timer_id;
+}
+
+int32_t CoroutineTimer::StopTimer(int64_t timer_id) {
+    cxx::unordered_map<int64_t, stTimerItem_t*>::iterator it = timers_.find(timer_id);
+    if (it == timers_.end()) {
+        snprintf(last_error_, sizeof(last_error_), "timer %ld not exist", (long)timer_id);
+        return -1;
     }
 
-    for (int i = 0; i < cnt; i++) {
-        int idx = (apTimeout->llStartIdx + i) % apTimeout->iItemSize;
-        Join<stTimeoutItem_t, stTimeoutItemLink_t>(apResult, apTimeout->pItems + idx);
+    // 正在执行回调的定时器由Update在回调返回后删除
+    if (it->second == running_) {
+        running_stopped_ = true;
+        return 0;
     }
-    apTimeout->ullStart = allNow;
-    apTimeout->llStartIdx += cnt - 1;
+    RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(it->second);
+    delete it->second;
+    timers_.erase(it);
+    return 0;
+}
+
+int32_t CoroutineTimer::Update() {
+    unsigned long long now = GetTickMS();
+    stTimeoutItemLink_t expired = { NULL, NULL };
+    TakeAllTimeout(wheel_, now, &expired);
+
+    int32_t num = 0;
+    // 每次都从头部取，回调中停止同一批的其他定时器时会把它们从expired中摘掉
+    while (expired.head) {
+        stTimerItem_t* item = static_cast<stTimerItem_t*>(expired.head);
+        PopHead<stTimeoutItem_t, stTimeoutItemLink_t>(&expired);
+
+        running_ = item;
+        running_stopped_ = false;
+        int32_t ret = item->cb();
+        running_ = NULL;
+        num++;
+
+        if (running_stopped_ || ret < 0) {
+            timers_.erase(item->timer_id);
+            delete item;
+            continue;
+        }
+        if (ret > 0) {
+            item->timeout_ms = ret;
+        }
+        item->ullExpireTime = now + item->timeout_ms;
+        AddToWheel(wheel_, item);
+    }
+    return num;
+}
+
+const char* CoroutineTimer::GetLastError() const {
+    return last_error_;
+}
+
+int64_t CoroutineTimer::GetTimerNum() {
+    return timers_.size();
 }
 
 
@@ -962,24 +2103,85 @@ void OnPollPreparePfn(stTimeoutItem_t * ap,
     }
 }
 
-void co_update()
+// 根据最近的超时、调用者允许的最长等待和忙轮询设置计算epoll_wait的等待时间
+static int CalcEpollWaitMS(stCoEpoll_t *ctx, int max_wait_ms)
+{
+    if (max_wait_ms == 0 || ctx->pstReadyList->head) {
+        return 0;
+    }
+    if (ctx->iBusyPollUs > 0 && ctx->ullLastEventNs != 0) {
+        unsigned long long elapsed_ns = MonotonicNs(CLOCK_MONOTONIC) - ctx->ullLastEventNs;
+        if (elapsed_ns < static_cast<unsigned long long>(ctx->iBusyPollUs) * 1000ULL) {
+            return 0;
+        }
+    }
+
+    int wait_ms = NextTimeoutMS(ctx->pTimeout, GetTickMS());
+    if (wait_ms < 0 || (max_wait_ms > 0 && wait_ms > max_wait_ms)) {
+        wait_ms = max_wait_ms;
+    }
+    return wait_ms;
+}
+
+// 事件数组填满说明还有事件没取完，加倍；长时间用不到1/4时减半，归还内存
+static void AdjustEpollResult(stCoEpoll_t *ctx, int ret)
+{
+    co_epoll_res *result = ctx->result;
+    int size = result->size;
+    if (ret >= size && size < stCoEpoll_t::_EPOLL_MAX_SIZE) {
+        size *= 2;
+    } else if (ret <= size / 4 && size > stCoEpoll_t::_EPOLL_MIN_SIZE) {
+        if (++ctx->iIdleRounds < stCoEpoll_t::_EPOLL_SHRINK_ROUNDS) {
+            return;
+        }
+        size /= 2;
+    } else {
+        ctx->iIdleRounds = 0;
+        return;
+    }
+
+    ctx->iIdleRounds = 0;
+    co_epoll_res *resized = co_epoll_res_alloc(size);
+    if (resized == NULL || resized->events == NULL) {
+        co_epoll_res_free(resized);
+        return;
+    }
+    co_epoll_res_free(result);
+    ctx->result = resized;
+}
+
+void co_set_busy_poll(int busy_poll_us)
+{
+    stCoEpoll_t* ctx = co_get_epoll_ct();
+    if (!ctx) {
+        return;
+    }
+    ctx->iBusyPollUs = busy_poll_us > 0 ? busy_poll_us : 0;
+    ctx->ullLastEventNs = 0;
+}
+
+void co_update(int max_wait_ms)
 {
     stCoEpoll_t* ctx = co_get_epoll_ct();
     if (!ctx) {
         return;
     }
     if (!ctx->result) {
-        ctx->result = co_epoll_res_alloc(stCoEpoll_t::_EPOLL_SIZE);
+        ctx->result = co_epoll_res_alloc(stCoEpoll_t::_EPOLL_MIN_SIZE);
     }
     co_epoll_res *result = ctx->result;
-    int ret = epoll_wait(ctx->iEpollFd, result->events, stCoEpoll_t::_EPOLL_SIZE, 1);
+    int ret = epoll_wait(ctx->iEpollFd, result->events, result->size,
+        CalcEpollWaitMS(ctx, max_wait_ms));
+    if (ret > 0 && ctx->iBusyPollUs > 0) {
+        ctx->ullLastEventNs = MonotonicNs(CLOCK_MONOTONIC);
+    }
 
+    // active和timeout在每轮结束时都已经取空，不需要再清零
     stTimeoutItemLink_t *active = (ctx->pstActiveList);
     stTimeoutItemLink_t *timeout = (ctx->pstTimeoutList);
 
-    memset(active, 0, sizeof(stTimeoutItemLink_t));
-    memset(timeout, 0, sizeof(stTimeoutItemLink_t));
-
+    // 先收集再统一恢复，不在遍历事件时直接恢复协程：协程可能关闭fd、释放等待项，
+    // 使本轮后面事件的data.ptr失效；先收集也让同一个stPoll_t的多个fd只恢复一次
     for (int i = 0; i < ret; i++)
     {
         stTimeoutItem_t *item = reinterpret_cast<stTimeoutItem_t*>(result->events[i].data.ptr);
@@ -990,27 +2192,42 @@ void co_update()
         }
     }
 
-    unsigned long long now = GetTickMS();
-    TakeAllTimeout(ctx->pTimeout, now, timeout);
+    // 只处理本轮之前被唤醒的协程，本轮中再被唤醒的留到下一轮，互相唤醒的协程不会让epoll饿死
+    Join<stTimeoutItem_t, stTimeoutItemLink_t>(active, ctx->pstReadyList);
 
-    stTimeoutItem_t *lp = timeout->head;
-    while (lp) {
-        lp->bTimeout = true;
-        lp = lp->pNext;
+    // 本轮处理的所有事件共用一个时间，协程中co_poll计算超时也使用它
+    stCoRoutineEnv_t *env = co_get_curr_thread_env();
+    unsigned long long now = GetTickMS();
+    env->ullNow = now;
+
+    // 同一毫秒内的多轮co_update没有新的超时，不进入时间轮
+    co_stats& stats = env->co_schedule->stats;
+    if (ctx->pTimeout->ullStart <= now) {
+        TakeAllTimeout(ctx->pTimeout, now, timeout);
+        for (stTimeoutItem_t *lp = timeout->head; lp; lp = lp->pNext) {
+            lp->bTimeout = true;
+            stats.timeout_num++;
+        }
+        Join<stTimeoutItem_t, stTimeoutItemLink_t>(active, timeout);
     }
 
-    Join<stTimeoutItem_t, stTimeoutItemLink_t>(active, timeout);
-
-    lp = active->head;
+    uint64_t run_num = 0;
+    stTimeoutItem_t *lp = active->head;
     while (lp) {
 
         PopHead<stTimeoutItem_t, stTimeoutItemLink_t>(active);
         if (lp->pfnProcess) {
             lp->pfnProcess(lp);
         }
+        run_num++;
 
         lp = active->head;
     }
+    stats.update_num++;
+    _co_hist_add(&stats.run_queue, run_num);
+
+    // 事件已经处理完，可以安全替换事件数组
+    AdjustEpollResult(ctx, ret);
 }
 void OnCoroutineEvent(stTimeoutItem_t * ap) {
     coroutine_resume(co_get_curr_thread_env()->co_schedule, ap->co_id);
@@ -1026,21 +2243,36 @@ int64_t get_curr_co_id()
 
 int co_poll(stCoEpoll_t *ctx, struct pollfd fds[], nfds_t nfds, int timeout)
 {
-    if (timeout > stTimeoutItem_t::eMaxTimeout) {
-        timeout = stTimeoutItem_t::eMaxTimeout;
+    // 协程已经到期或被取消时不再等待，按超时返回
+    timeout = _co_clamp_timeout(co_self(), timeout);
+    if (timeout == 0 && nfds == 0) {
+        return 0;
     }
+
     int epfd = ctx->iEpollFd;
 
+    // 共享栈模式下协程挂起后栈会被换出，而epoll事件和超时链表在主循环中还会访问
+    // 这些结构，并回写revents，所以都要放在堆上
+    bool share_stack = co_is_share_stack(co_self());
+
     // 1.struct change
-    stPoll_t arg;
+    stPoll_t arg_on_stack;
+    stPoll_t& arg = share_stack ?
+        *reinterpret_cast<stPoll_t*>(malloc(sizeof(stPoll_t))) : arg_on_stack;
     memset(&arg, 0, sizeof(arg));
 
+    struct pollfd* poll_fds = fds;
+    if (share_stack) {
+        poll_fds = reinterpret_cast<struct pollfd*>(malloc(nfds * sizeof(struct pollfd)));
+        memcpy(poll_fds, fds, nfds * sizeof(struct pollfd));
+    }
+
     arg.iEpollFd = epfd;
-    arg.fds = fds;
+    arg.fds = poll_fds;
     arg.nfds = nfds;
 
     stPollItem_t arr[2];
-    if (nfds < sizeof(arr) / sizeof(arr[0])) {
+    if (nfds < sizeof(arr) / sizeof(arr[0]) && !share_stack) {
         arg.pPollItems = arr;
     } else {
         arg.pPollItems = reinterpret_cast<stPollItem_t*>(malloc(nfds * sizeof(stPollItem_t)));
@@ -1050,19 +2282,26 @@ int co_poll(stCoEpoll_t *ctx, struct pollfd fds[], nfds_t nfds, int timeout)
     arg.pfnProcess = OnPollProcessEvent;
     arg.co_id = get_curr_co_id();
 
-    // 2.add timeout
-    unsigned long long now = GetTickMS();
+    // 2.add timeout，与poll一致，timeout<0时一直等待
+    unsigned long long now = co_now_ms();
     arg.ullExpireTime = now + timeout;
-    int ret = AddTimeout(ctx->pTimeout, &arg, now);
+    int ret = timeout < 0 ? 0 : AddTimeout(ctx->pTimeout, &arg, now);
     if (ret != 0) {
         co_log_err("CO_ERR: AddTimeout ret %d now %lld timeout %d arg.ullExpireTime %lld",
                     ret, now, timeout, arg.ullExpireTime);
+        if (arg.pPollItems != arr) {
+            free(arg.pPollItems);
+        }
+        if (share_stack) {
+            free(poll_fds);
+            free(&arg);
+        }
         errno = EINVAL;
         return -__LINE__;
     }
 
     for (nfds_t i = 0; i < nfds; i++) {
-        arg.pPollItems[i].pSelf = fds + i;
+        arg.pPollItems[i].pSelf = poll_fds + i;
         arg.pPollItems[i].pPoll = &arg;
 
         arg.pPollItems[i].pfnPrepare = OnPollPreparePfn;
@@ -1076,7 +2315,14 @@ int co_poll(stCoEpoll_t *ctx, struct pollfd fds[], nfds_t nfds, int timeout)
         }
     }
 
+    coroutine *self = co_self();
+    if (self) {
+        self->wait_item = &arg;
+    }
     coroutine_yield(co_get_curr_thread_env()->co_schedule);
+    if (self) {
+        self->wait_item = NULL;
+    }
 
     RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(&arg);
     for (nfds_t i = 0; i < nfds; i++) {
@@ -1090,7 +2336,829 @@ int co_poll(stCoEpoll_t *ctx, struct pollfd fds[], nfds_t nfds, int timeout)
         free(arg.pPollItems);
         arg.pPollItems = NULL;
     }
-    return arg.iRaiseCnt;
+
+    int raise_cnt = arg.iRaiseCnt;
+    if (share_stack) {
+        for (nfds_t i = 0; i < nfds; i++) {
+            fds[i].revents = poll_fds[i].revents;
+        }
+        free(poll_fds);
+        free(&arg);
+    }
+    return raise_cnt;
+}
+
+
+// 持久注册到epoll的fd，epoll事件的data指向它，事件到来时唤醒等待相应方向的协程
+struct stFdWaiter_t;
+struct stCoFdEvent_t : public stTimeoutItem_t {
+    int iFd;
+    int iEpollFd;
+    bool bReleased;             // 已经被释放，最后一个等待者醒来后回收内存
+    stFdWaiter_t *pWaiters;
+};
+// 等待者同时挂在超时链表和fd的等待链表上，分别用pLink和pWaitPrev/pWaitNext
+struct stFdWaiter_t : public stTimeoutItem_t {
+    stCoFdEvent_t *pEvent;
+    stFdWaiter_t *pWaitPrev;
+    stFdWaiter_t *pWaitNext;
+    short events;
+    bool bKicked;               // fd的注册被释放，需要重试
+};
+
+void OnFdEventPrepare(stTimeoutItem_t * ap,
+                const struct epoll_event &e,
+                stTimeoutItemLink_t *active)
+{
+    stCoFdEvent_t *ev = static_cast<stCoFdEvent_t*>(ap);
+    // 等待者总是关注POLLERR|POLLHUP，只有epoll真的报告了才加上，否则每个边缘都会唤醒所有等待者
+    short revents = EpollEvent2Poll(e.events);
+    if (e.events & EPOLLRDHUP) {
+        revents |= POLLIN;
+    }
+    for (stFdWaiter_t *w = ev->pWaiters; w; w = w->pWaitNext) {
+        if ((w->events & revents) && w->pLink != active) {
+            RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(w);
+            AddTail(active, static_cast<stTimeoutItem_t*>(w));
+        }
+    }
+}
+
+stCoFdEvent_t *co_fd_event_alloc(int fd)
+{
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!ctx || fd < 0) {
+        return NULL;
+    }
+    stCoFdEvent_t *ev = reinterpret_cast<stCoFdEvent_t*>(calloc(1, sizeof(stCoFdEvent_t)));
+    if (!ev) {
+        return NULL;
+    }
+    ev->iFd = fd;
+    ev->iEpollFd = ctx->iEpollFd;
+    ev->pfnPrepare = OnFdEventPrepare;
+
+    // 边缘触发，只在状态变化时通知一次，fd一直留在epoll中，等待时不需要再调用epoll_ctl
+    struct epoll_event e;
+    e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    e.data.ptr = ev;
+    if (epoll_ctl(ev->iEpollFd, EPOLL_CTL_ADD, fd, &e) != 0) {
+        free(ev);
+        return NULL;
+    }
+    return ev;
+}
+
+void co_fd_event_free(stCoFdEvent_t *ev)
+{
+    if (!ev) {
+        return;
+    }
+    epoll_ctl(ev->iEpollFd, EPOLL_CTL_DEL, ev->iFd, NULL);
+    if (!ev->pWaiters) {
+        free(ev);
+        return;
+    }
+
+    // 还有协程在等待，让它们在下一轮co_update醒来重试，由最后一个醒来的协程回收
+    ev->bReleased = true;
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!ctx || ctx->iEpollFd != ev->iEpollFd) {
+        return;
+    }
+    unsigned long long now = co_now_ms();
+    for (stFdWaiter_t *w = ev->pWaiters; w; w = w->pWaitNext) {
+        RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(w);
+        w->bKicked = true;
+        w->ullExpireTime = now;
+        AddTimeout(ctx->pTimeout, w, now);
+    }
+}
+
+int co_fd_wait(stCoFdEvent_t *ev, short events, int timeout_ms)
+{
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!ctx || ev->bReleased) {
+        errno = EINVAL;
+        return -1;
+    }
+    coroutine *self = co_self();
+    timeout_ms = _co_clamp_timeout(self, timeout_ms);
+    if (timeout_ms == 0) {
+        return 0;
+    }
+    if (ctx->iEpollFd != ev->iEpollFd) {
+        // fd注册在其他线程的epoll中，只能临时加入本线程的epoll
+        struct pollfd pf;
+        pf.fd = ev->iFd;
+        pf.events = events;
+        pf.revents = 0;
+        return co_poll(ctx, &pf, 1, timeout_ms);
+    }
+
+    // 与co_poll相同，共享栈模式下等待者要放在堆上
+    bool share_stack = co_is_share_stack(co_self());
+    stFdWaiter_t waiter_on_stack;
+    stFdWaiter_t& w = share_stack ?
+        *reinterpret_cast<stFdWaiter_t*>(malloc(sizeof(stFdWaiter_t))) : waiter_on_stack;
+    memset(&w, 0, sizeof(w));
+    w.pfnProcess = OnCoroutineEvent;
+    w.co_id = get_curr_co_id();
+    w.pEvent = ev;
+    w.events = events | POLLERR | POLLHUP;
+
+    if (timeout_ms >= 0) {
+        unsigned long long now = co_now_ms();
+        w.ullExpireTime = now + timeout_ms;
+        AddTimeout(ctx->pTimeout, &w, now);
+    }
+    w.pWaitNext = ev->pWaiters;
+    if (ev->pWaiters) {
+        ev->pWaiters->pWaitPrev = &w;
+    }
+    ev->pWaiters = &w;
+
+    if (self) {
+        self->wait_item = &w;
+    }
+    coroutine_yield(co_get_curr_thread_env()->co_schedule);
+    if (self) {
+        self->wait_item = NULL;
+    }
+
+    RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(&w);
+    if (w.pWaitPrev) {
+        w.pWaitPrev->pWaitNext = w.pWaitNext;
+    } else {
+        ev->pWaiters = w.pWaitNext;
+    }
+    if (w.pWaitNext) {
+        w.pWaitNext->pWaitPrev = w.pWaitPrev;
+    }
+
+    int ret = (w.bTimeout && !w.bKicked) ? 0 : 1;
+    if (ev->bReleased && !ev->pWaiters) {
+        free(ev);
+    }
+    if (share_stack) {
+        free(&w);
+    }
+    return ret;
+}
+
+
+static stTimeoutItem_t *_co_park_item(coroutine *co)
+{
+    if (!co->park_item) {
+        co->park_item = reinterpret_cast<stTimeoutItem_t*>(calloc(1, sizeof(stTimeoutItem_t)));
+    }
+    return co->park_item;
+}
+
+// 按协程的截止时间和取消状态收紧等待时间，返回-1表示一直等待，0表示不能再等待
+static int _co_clamp_timeout(coroutine *co, int timeout_ms)
+{
+    if (!co) {
+        return timeout_ms;
+    }
+    if (co->cancel_token && co->cancel_token->canceled()) {
+        return 0;
+    }
+    if (co->deadline_ms == 0) {
+        return timeout_ms;
+    }
+    unsigned long long now = GetTickMS();
+    unsigned long long remain = co->deadline_ms > now ? co->deadline_ms - now : 0;
+    if (remain > INT_MAX) {
+        remain = INT_MAX;
+    }
+    if (timeout_ms < 0 || static_cast<unsigned long long>(timeout_ms) > remain) {
+        return static_cast<int>(remain);
+    }
+    return timeout_ms;
+}
+
+void OnCoroutineTimeout(stTimeoutItem_t * ap) {
+    coroutine_resume(co_get_curr_thread_env()->co_schedule, ap->co_id, kCO_TIMEOUT);
+}
+
+// CoroutineSchedule::Yield的挂起：协程可能被任意的Resume恢复，只有设置了截止时间或取消令牌时
+// 才挂一个超时项，到期或被取消时以kCO_TIMEOUT恢复
+static int32_t _co_yield_until_deadline(struct schedule *S)
+{
+    coroutine *co = S != NULL ? S->running_co : NULL;
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!co || !ctx || (co->deadline_ms == 0 && !co->cancel_token)) {
+        return coroutine_yield(S);
+    }
+    stTimeoutItem_t *item = _co_park_item(co);
+    if (!item) {
+        return coroutine_yield(S);
+    }
+    item->pfnProcess = OnCoroutineTimeout;
+    item->co_id = S->running;
+    item->bTimeout = false;
+    if (co->deadline_ms != 0) {
+        unsigned long long now = co_now_ms();
+        item->ullExpireTime = co->deadline_ms > now ? co->deadline_ms : now;
+        AddTimeout(ctx->pTimeout, item, now);
+    }
+
+    co->wait_item = item;
+    int32_t ret = coroutine_yield(S);
+    co->wait_item = NULL;
+    RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(item);
+    return ret;
+}
+
+void coroutine_set_deadline(struct schedule *S, int64_t id, unsigned long long deadline_ms)
+{
+    coroutine *co = S != NULL ? _co_find(S, id) : NULL;
+    if (co) {
+        co->deadline_ms = deadline_ms;
+    }
+}
+
+int32_t coroutine_set_cancel_token(struct schedule *S, int64_t id, CoCancelToken* token)
+{
+    coroutine *co = S != NULL ? _co_find(S, id) : NULL;
+    if (!co) {
+        return kCO_COROUTINE_UNEXIST;
+    }
+    CoCancelToken *old = co->cancel_token;
+    if (old) {
+        if (co->cancel_prev) {
+            co->cancel_prev->cancel_next = co->cancel_next;
+        } else {
+            old->head_ = co->cancel_next;
+        }
+        if (co->cancel_next) {
+            co->cancel_next->cancel_prev = co->cancel_prev;
+        }
+        co->cancel_prev = co->cancel_next = NULL;
+        co->cancel_token = NULL;
+    }
+    if (token) {
+        co->cancel_next = token->head_;
+        if (token->head_) {
+            token->head_->cancel_prev = co;
+        }
+        token->head_ = co;
+        co->cancel_token = token;
+    }
+    return 0;
+}
+
+int co_remaining_ms()
+{
+    coroutine *co = co_self();
+    if (!co) {
+        return -1;
+    }
+    return _co_clamp_timeout(co, -1);
+}
+
+CoCancelToken::CoCancelToken() : canceled_(false), head_(NULL)
+{
+}
+
+CoCancelToken::~CoCancelToken()
+{
+    while (head_) {
+        coroutine *co = head_;
+        head_ = co->cancel_next;
+        co->cancel_prev = co->cancel_next = NULL;
+        co->cancel_token = NULL;
+    }
+}
+
+void CoCancelToken::Cancel()
+{
+    if (canceled_) {
+        return;
+    }
+    canceled_ = true;
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!ctx) {
+        return;
+    }
+    // 与co_notify_one相同，把正在等待的超时项移到就绪队列，由各个等待函数按超时处理
+    for (coroutine *co = head_; co; co = co->cancel_next) {
+        stTimeoutItem_t *item = co->wait_item;
+        if (!item) {
+            continue;
+        }
+        RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(item);
+        item->bTimeout = true;
+        AddTail(ctx->pstReadyList, item);
+    }
+}
+
+static void _co_wait_unlink(coroutine *co)
+{
+    co_wait_queue *queue = co->wait_queue;
+    if (co->wait_prev) {
+        co->wait_prev->wait_next = co->wait_next;
+    } else {
+        queue->head = co->wait_next;
+    }
+    if (co->wait_next) {
+        co->wait_next->wait_prev = co->wait_prev;
+    } else {
+        queue->tail = co->wait_prev;
+    }
+    co->wait_queue = NULL;
+    co->wait_prev = co->wait_next = NULL;
+}
+
+// interruptible为false时不受截止时间和取消令牌影响，只会被唤醒或被其他方式恢复
+static int32_t _co_wait(co_wait_queue* queue, int timeout_ms, bool interruptible)
+{
+    stCoRoutineEnv_t *env = co_get_curr_thread_env();
+    if (!env || !env->co_schedule->running_co) {
+        return kCO_NOT_IN_COROUTINE;
+    }
+    schedule *S = env->co_schedule;
+    coroutine *co = S->running_co;
+    if (interruptible) {
+        timeout_ms = _co_clamp_timeout(co, timeout_ms);
+        if (timeout_ms == 0) {
+            return kCO_TIMEOUT;
+        }
+    }
+    stTimeoutItem_t *item = _co_park_item(co);
+    if (!item) {
+        return kCO_INVALID_PARAM;
+    }
+    item->pfnProcess = OnCoroutineEvent;
+    item->co_id = S->running;
+    item->bTimeout = false;
+    if (timeout_ms >= 0) {
+        unsigned long long now = co_now_ms();
+        item->ullExpireTime = now + timeout_ms;
+        AddTimeout(env->pEpoll->pTimeout, item, now);
+    }
+
+    co->wait_queue = queue;
+    co->wait_prev = queue->tail;
+    co->wait_next = NULL;
+    if (queue->tail) {
+        queue->tail->wait_next = co;
+    } else {
+        queue->head = co;
+    }
+    queue->tail = co;
+
+    // 取消令牌通过wait_item唤醒等待者，不可中断的等待不登记
+    co->wait_item = interruptible ? item : NULL;
+    coroutine_yield(S);
+    co->wait_item = NULL;
+
+    RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(item);
+    if (co->wait_queue) {
+        // 没有被唤醒：超时或者被其他方式恢复
+        _co_wait_unlink(co);
+        return kCO_TIMEOUT;
+    }
+    return 0;
+}
+
+int32_t co_wait(co_wait_queue* queue, int timeout_ms)
+{
+    return _co_wait(queue, timeout_ms, true);
+}
+
+int32_t co_wait_uninterruptible(co_wait_queue* queue)
+{
+    return _co_wait(queue, -1, false);
+}
+
+int64_t co_notify_one(co_wait_queue* queue)
+{
+    coroutine *co = queue->head;
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!co || !ctx) {
+        return INVALID_CO_ID;
+    }
+    _co_wait_unlink(co);
+
+    // 可能已经超时被取到本轮的活跃链表中，唤醒优先
+    stTimeoutItem_t *item = co->park_item;
+    RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(item);
+    item->bTimeout = false;
+    AddTail(ctx->pstReadyList, item);
+    return item->co_id;
+}
+
+int32_t co_notify_all(co_wait_queue* queue)
+{
+    int32_t num = 0;
+    while (co_notify_one(queue) != INVALID_CO_ID) {
+        num++;
+    }
+    return num;
+}
+
+// 无栈协程的等待项：与co_poll使用同样的epoll和时间轮，只是醒来时调用回调而不是resume协程
+struct stCoWaiter_t : public stTimeoutItem_t {
+    co_waiter_fn pfnCallback;
+    void *pArg;
+    int iResult;
+    int iFd;                    // 正在等待的fd，-1表示没有
+    int iEpollFd;
+    struct epoll_event stEvent;
+};
+
+static void _co_waiter_reset(stCoWaiter_t *w)
+{
+    RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(w);
+    if (w->iFd >= 0) {
+        epoll_ctl(w->iEpollFd, EPOLL_CTL_DEL, w->iFd, &w->stEvent);
+        w->iFd = -1;
+    }
+    w->bTimeout = false;
+}
+
+static void OnWaiterPrepare(stTimeoutItem_t *ap, const struct epoll_event &e,
+        stTimeoutItemLink_t *active)
+{
+    stCoWaiter_t *w = static_cast<stCoWaiter_t*>(ap);
+    w->iResult = EpollEvent2Poll(e.events);
+    RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(w);
+    AddTail(active, ap);
+}
+
+static void OnWaiterProcess(stTimeoutItem_t *ap)
+{
+    stCoWaiter_t *w = static_cast<stCoWaiter_t*>(ap);
+    int result = w->bTimeout ? static_cast<int>(kCO_TIMEOUT) : w->iResult;
+    // 先清理再回调，回调中可以马上发起下一次等待或者释放等待项
+    _co_waiter_reset(w);
+    w->pfnCallback(w->pArg, result);
+}
+
+stCoWaiter_t *co_waiter_alloc(co_waiter_fn fn, void *arg)
+{
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!ctx || !fn) {
+        return NULL;
+    }
+    stCoWaiter_t *w = reinterpret_cast<stCoWaiter_t*>(calloc(1, sizeof(stCoWaiter_t)));
+    if (!w) {
+        return NULL;
+    }
+    w->pfnProcess = OnWaiterProcess;
+    w->co_id = INVALID_CO_ID;
+    w->pfnCallback = fn;
+    w->pArg = arg;
+    w->iFd = -1;
+    w->iEpollFd = ctx->iEpollFd;
+    return w;
+}
+
+void co_waiter_free(stCoWaiter_t *waiter)
+{
+    if (!waiter) {
+        return;
+    }
+    _co_waiter_reset(waiter);
+    free(waiter);
+}
+
+int co_waiter_sleep(stCoWaiter_t *waiter, int timeout_ms)
+{
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!ctx) {
+        return -1;
+    }
+    _co_waiter_reset(waiter);
+    unsigned long long now = co_now_ms();
+    waiter->ullExpireTime = now + (timeout_ms > 0 ? timeout_ms : 0);
+    return AddTimeout(ctx->pTimeout, waiter, now);
+}
+
+int co_waiter_fd(stCoWaiter_t *waiter, int fd, short events, int timeout_ms)
+{
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!ctx) {
+        return -1;
+    }
+    _co_waiter_reset(waiter);
+    waiter->pfnPrepare = OnWaiterPrepare;
+    waiter->stEvent.events = PollEvent2Epoll(events);
+    waiter->stEvent.data.ptr = waiter;
+    if (epoll_ctl(waiter->iEpollFd, EPOLL_CTL_ADD, fd, &waiter->stEvent) != 0) {
+        return -1;
+    }
+    waiter->iFd = fd;
+    if (timeout_ms >= 0) {
+        unsigned long long now = co_now_ms();
+        waiter->ullExpireTime = now + timeout_ms;
+        AddTimeout(ctx->pTimeout, waiter, now);
+    }
+    return 0;
+}
+
+void co_waiter_notify(stCoWaiter_t *waiter, int result)
+{
+    stCoEpoll_t *ctx = co_get_epoll_ct();
+    if (!ctx) {
+        return;
+    }
+    _co_waiter_reset(waiter);
+    waiter->iResult = result;
+    AddTail(ctx->pstReadyList, static_cast<stTimeoutItem_t*>(waiter));
+}
+
+// 收件箱：其他线程投递的恢复请求放在无锁的后进先出栈上，收件箱由空变为非空时写eventfd
+// 唤醒所属线程的epoll，由co_update一次全部取走、恢复成投递的顺序后逐个恢复协程
+struct stCoInboxMsg_t {
+    int64_t co_id;
+    int32_t result;
+    stCoInboxMsg_t *pNext;
+    void (*pfnFree)(stCoInboxMsg_t *msg);
+    // 取走时调用，为NULL时在恢复协程之前直接pfnFree；不为NULL时由它决定何时释放
+    void (*pfnDeliver)(stCoInboxMsg_t *msg, struct schedule *S);
+};
+
+// 后台线程池：阻塞的调用放到这里执行，完成后作为恢复请求投递到发起线程的收件箱
+struct stCoOffloadJob_t : public stCoInboxMsg_t {
+    cxx::function<void()> fn;
+    struct stCoInbox_t *pInbox;
+    bool bDone;                     // 所属线程取走后设置，co_offload只在它为true后返回
+};
+
+struct stCoInbox_t : public stTimeoutItem_t {
+    int iEventFd;
+    stCoInboxMsg_t *pHead;          // 多个线程写入，只由所属线程整体取走，没有ABA问题
+    int iRefs;                      // 所属线程持有1个，每个还在执行的后台任务持有1个
+    stCoEpoll_t *pEpoll;
+};
+
+struct stCoOffloadPool_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    stCoOffloadJob_t *pHead;
+    stCoOffloadJob_t *pTail;
+    int iThreadNum;
+    int iStartedNum;
+};
+static stCoOffloadPool_t g_CoOffloadPool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 4, 0
+};
+static pthread_once_t g_CoOffloadOnce = PTHREAD_ONCE_INIT;
+
+static void CoInboxMsgFree(stCoInboxMsg_t *msg)
+{
+    free(msg);
+}
+
+static void CoOffloadJobFree(stCoInboxMsg_t *msg)
+{
+    delete static_cast<stCoOffloadJob_t*>(msg);
+}
+
+// 等待的协程还在时只标记完成，由它在co_offload中释放；协程已经不存在时直接释放
+static void CoOffloadJobDeliver(stCoInboxMsg_t *msg, struct schedule *S)
+{
+    stCoOffloadJob_t *job = static_cast<stCoOffloadJob_t*>(msg);
+    job->bDone = true;
+    if (coroutine_status(S, job->co_id) == COROUTINE_DEAD) {
+        delete job;
+    }
+}
+
+static void CoInboxRelease(stCoInbox_t *inbox)
+{
+    if (__atomic_sub_fetch(&inbox->iRefs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    // 调度器已经关闭，协程也已经不存在，丢弃还没有取走的请求
+    stCoInboxMsg_t *msg = inbox->pHead;
+    while (msg) {
+        stCoInboxMsg_t *next = msg->pNext;
+        msg->pfnFree(msg);
+        msg = next;
+    }
+    close(inbox->iEventFd);
+    free(inbox);
+}
+
+static void CoInboxPush(stCoInbox_t *inbox, stCoInboxMsg_t *msg)
+{
+    stCoInboxMsg_t *head = __atomic_load_n(&inbox->pHead, __ATOMIC_RELAXED);
+    do {
+        msg->pNext = head;
+    } while (!__atomic_compare_exchange_n(&inbox->pHead, &head, msg, true,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // 不为空时所属线程已经被唤醒、还没有取走，这次投递会一起取走，不需要再写eventfd
+    if (head == NULL) {
+        uint64_t one = 1;
+        ssize_t ret = write(inbox->iEventFd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+void OnInboxPrepare(stTimeoutItem_t * ap,
+                const struct epoll_event & /*e*/,
+                stTimeoutItemLink_t *active)
+{
+    AddTail(active, ap);
+}
+
+void OnInboxProcess(stTimeoutItem_t * ap)
+{
+    stCoInbox_t *inbox = static_cast<stCoInbox_t*>(ap);
+    // 先清eventfd再取走请求，之后的投递一定会重新唤醒
+    uint64_t count = 0;
+    ssize_t ret = read(inbox->iEventFd, &count, sizeof(count));
+    (void)ret;
+
+    stCoInboxMsg_t *msg = __atomic_exchange_n(&inbox->pHead,
+        static_cast<stCoInboxMsg_t*>(NULL), __ATOMIC_ACQUIRE);
+    stCoInboxMsg_t *ordered = NULL;
+    while (msg) {
+        stCoInboxMsg_t *next = msg->pNext;
+        msg->pNext = ordered;
+        ordered = msg;
+        msg = next;
+    }
+
+    schedule *S = co_get_curr_thread_env()->co_schedule;
+    while (ordered) {
+        stCoInboxMsg_t *next = ordered->pNext;
+        int64_t co_id = ordered->co_id;
+        int32_t result = ordered->result;
+        if (ordered->pfnDeliver) {
+            ordered->pfnDeliver(ordered, S);
+        } else {
+            ordered->pfnFree(ordered);
+        }
+        coroutine_resume(S, co_id, result);
+        ordered = next;
+    }
+}
+
+static stCoInbox_t *CoInboxAlloc(stCoEpoll_t *ctx)
+{
+    stCoInbox_t *inbox = reinterpret_cast<stCoInbox_t*>(calloc(1, sizeof(stCoInbox_t)));
+    if (!inbox) {
+        return NULL;
+    }
+    inbox->iEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inbox->iEventFd < 0) {
+        free(inbox);
+        return NULL;
+    }
+    inbox->iRefs = 1;
+    inbox->pEpoll = ctx;
+    inbox->pfnPrepare = OnInboxPrepare;
+    inbox->pfnProcess = OnInboxProcess;
+
+    struct epoll_event e;
+    e.events = EPOLLIN;
+    e.data.ptr = inbox;
+    if (epoll_ctl(ctx->iEpollFd, EPOLL_CTL_ADD, inbox->iEventFd, &e) != 0) {
+        close(inbox->iEventFd);
+        free(inbox);
+        return NULL;
+    }
+    return inbox;
+}
+
+static void CoInboxClose(stCoInbox_t *inbox)
+{
+    if (!inbox) {
+        return;
+    }
+    epoll_ctl(inbox->pEpoll->iEpollFd, EPOLL_CTL_DEL, inbox->iEventFd, NULL);
+    RemoveFromLink<stTimeoutItem_t, stTimeoutItemLink_t>(inbox);
+    CoInboxRelease(inbox);
+}
+
+int32_t coroutine_post_resume(struct schedule *S, int64_t id, int32_t result)
+{
+    if (S == NULL || S->inbox == NULL || id < 0) {
+        return kCO_INVALID_PARAM;
+    }
+    stCoInboxMsg_t *msg = reinterpret_cast<stCoInboxMsg_t*>(malloc(sizeof(stCoInboxMsg_t)));
+    if (!msg) {
+        return kCO_INVALID_PARAM;
+    }
+    msg->co_id = id;
+    msg->result = result;
+    msg->pfnFree = CoInboxMsgFree;
+    msg->pfnDeliver = NULL;
+    CoInboxPush(S->inbox, msg);
+    return 0;
+}
+
+int32_t coroutine_wakeup(struct schedule *S)
+{
+    if (S == NULL || S->inbox == NULL) {
+        return kCO_INVALID_PARAM;
+    }
+    // 收件箱取走时先清eventfd，空的收件箱被取走也没有副作用
+    uint64_t one = 1;
+    ssize_t ret = write(S->inbox->iEventFd, &one, sizeof(one));
+    (void)ret;
+    return 0;
+}
+
+static void* CoOffloadMain(void* /*arg*/)
+{
+    stCoOffloadPool_t *pool = &g_CoOffloadPool;
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->pHead) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        stCoOffloadJob_t *job = pool->pHead;
+        pool->pHead = static_cast<stCoOffloadJob_t*>(job->pNext);
+        if (!pool->pHead) {
+            pool->pTail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        job->fn();
+        stCoInbox_t *inbox = job->pInbox;
+        CoInboxPush(inbox, job);
+        CoInboxRelease(inbox);
+    }
+    return NULL;
+}
+
+static void InitCoOffload()
+{
+    stCoOffloadPool_t *pool = &g_CoOffloadPool;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < pool->iThreadNum; i++) {
+        pthread_t thread;
+        int ret = pthread_create(&thread, &attr, CoOffloadMain, NULL);
+        if (ret != 0) {
+            PLOG_ERROR("create coroutine offload thread failed : %s", strerror(ret));
+            break;
+        }
+        pool->iStartedNum++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void co_set_offload_thread_num(int thread_num)
+{
+    if (thread_num > 0) {
+        g_CoOffloadPool.iThreadNum = thread_num;
+    }
+}
+
+int co_offload(const cxx::function<void()>& fn)
+{
+    stCoRoutineEnv_t *env = co_get_curr_thread_env();
+    int64_t co_id = env ? coroutine_running(env->co_schedule) : -1;
+    if (co_id < 0) {
+        fn();
+        return 0;
+    }
+
+    pthread_once(&g_CoOffloadOnce, InitCoOffload);
+    stCoEpoll_t *ctx = env->pEpoll;
+    if (!ctx->pInbox || g_CoOffloadPool.iStartedNum == 0) {
+        fn();
+        return 0;
+    }
+
+    stCoOffloadJob_t *job = new stCoOffloadJob_t;
+    job->fn = fn;
+    job->pInbox = ctx->pInbox;
+    job->co_id = co_id;
+    job->result = 0;
+    job->pNext = NULL;
+    job->pfnFree = CoOffloadJobFree;
+    job->pfnDeliver = CoOffloadJobDeliver;
+    job->bDone = false;
+    __atomic_add_fetch(&ctx->pInbox->iRefs, 1, __ATOMIC_RELAXED);
+
+    stCoOffloadPool_t *pool = &g_CoOffloadPool;
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->pTail) {
+        pool->pTail->pNext = job;
+    } else {
+        pool->pHead = job;
+    }
+    pool->pTail = job;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    // 提前的resume、coroutine_post_resume等都不能让协程在fn执行完之前返回，fn可能还在读写调用者的数据
+    int32_t ret = 0;
+    while (!job->bDone) {
+        ret = coroutine_yield(env->co_schedule);
+    }
+    delete job;
+    return ret;
 }
 
 
@@ -1129,6 +3197,19 @@ bool co_is_enable_sys_hook() {
     return (co && co->enable_hook);
 }
 
+__thread coroutine* g_co_current = NULL;
+
+static int32_t g_co_local_slot_num = 0;
+
+int32_t co_local_alloc_slot() {
+    int32_t slot = __atomic_fetch_add(&g_co_local_slot_num, 1, __ATOMIC_RELAXED);
+    if (slot >= CO_LOCAL_SLOT_NUM) {
+        PLOG_ERROR("coroutine local slots exhausted, CO_LOCAL_SLOT_NUM = %d", CO_LOCAL_SLOT_NUM);
+        return -1;
+    }
+    return slot;
+}
+
 coroutine *co_self() {
     if (!co_get_curr_thread_env()) {
         return NULL;
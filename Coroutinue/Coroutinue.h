@@ -15,14 +15,13 @@
 #ifndef _PEBBLE_COMMON_COROUTINE_H_
 #define _PEBBLE_COMMON_COROUTINE_H_
 
-#include <list>
-#include <set>
 #include <string.h>
 #include <sys/poll.h>
-#include <ucontext.h>
+#include <vector>
 
 #include "common/error.h"
 #include "common/platform.h"
+#include "common/timer.h"
 
 
 namespace pebble {
@@ -38,6 +37,7 @@ typedef enum {
     kCO_CANNOT_RESUME_IN_COROUTINE = kCO_ERROR_BASE - 6, // 不支持在协程中resume其他协程
     kCO_COROUTINE_UNEXIST          = kCO_ERROR_BASE - 7, // 协程不存在
     kCO_COROUTINE_STATUS_ERROR     = kCO_ERROR_BASE - 8, // 协程状态错误
+    kCO_CHANNEL_CLOSED             = kCO_ERROR_BASE - 9, // channel已关闭
 } CoroutineErrorCode;
 
 class CoroutineErrorStringRegister {
@@ -51,6 +51,7 @@ public:
         SetErrorString(kCO_CANNOT_RESUME_IN_COROUTINE, "cannot resume in coroutine");
         SetErrorString(kCO_COROUTINE_UNEXIST, "coroutine unexist");
         SetErrorString(kCO_COROUTINE_STATUS_ERROR, "coroute status error");
+        SetErrorString(kCO_CHANNEL_CLOSED, "channel closed");
     }
 };
 
@@ -60,22 +61,95 @@ public:
 #define COROUTINE_RUNNING 2
 #define COROUTINE_SUSPEND 3
 
-#define MAX_FREE_CO_NUM     1024
+#define MAX_FREE_CO_NUM     1024    // 空闲协程超过此数量时，释放其栈
+#define HOT_FREE_CO_NUM     64      // 空闲协程超过此数量时，其栈的物理内存归还给系统
+#define CO_SLAB_SIZE        256     // 协程槽按块分配，每块的协程数量
+#define CO_WARM_STACK_SIZE  (16 * 1024) // 预热时每个协程栈预先访问的深度(字节)
+#define CO_STATS_BUCKETS    32      // 统计直方图的桶数
+#define CO_STATS_SAMPLE_MASK 63     // 每64次resume/yield采样一次耗时
+#define CO_LOCAL_SLOT_NUM   8       // 协程局部存储的槽数量，@see CoroutineLocal
 #define INVALID_CO_ID       -1
 
 typedef void (*coroutine_func)(struct schedule *, void *ud);
 
+/// @brief 协程上下文，只保存栈指针，寄存器都压在各自的栈上
+/// @note 不使用ucontext，swapcontext每次切换都要调用sigprocmask保存和恢复信号掩码，
+///   协程之间共享线程的信号掩码，只需保存ABI约定的callee-saved寄存器即可
+struct coctx_t {
+    void* sp;
+};
+
+/// @brief 协程入口函数，不允许返回，结束时必须切换到其他上下文
+typedef void (*coctx_pfn_t)(void* arg);
+
+/// @brief 初始化一个上下文，第一次切换到它时在指定的栈上执行fn(arg)
+/// @param ctx 上下文
+/// @param stack 栈的起始地址(低地址)
+/// @param stack_size 栈大小
+/// @param fn 入口函数
+/// @param arg 入口函数的参数
+void coctx_make(coctx_t* ctx, char* stack, size_t stack_size, coctx_pfn_t fn, void* arg);
+
+/// @brief 保存当前上下文到from，切换到to，只支持x86-64和aarch64
+extern "C" void coctx_swap(coctx_t* from, coctx_t* to);
+
+struct coroutine;
+struct stTimeoutItem_t;
+class CoCancelToken;
+
+/// @brief 协程等待队列，侵入式链表，节点就是协程本身，挂起和唤醒都不需要分配内存
+struct co_wait_queue {
+    coroutine* head;
+    coroutine* tail;
+
+    co_wait_queue() : head(NULL), tail(NULL) {}
+};
+
+/// @brief 共享栈，多个协程轮流在同一块栈上运行
+struct stack_mem {
+    char* stack_buffer;
+    uint32_t stack_size;
+    coroutine* occupy_co;       // 当前栈上保存着哪个协程的内容
+};
+
 struct coroutine {
     coroutine_func func;
     cxx::function<void()> std_func;
     void *ud;
-    ucontext_t ctx;
+    coctx_t ctx;
     struct schedule * sch;
     int status;
     bool enable_hook;
-    char* stack;                // 协程栈的内容
+    char* stack;                // 协程栈的内容，共享栈模式下为NULL
     int32_t result;             // 携带resume结果
 
+    stack_mem* share_stack;     // 共享栈模式下运行所用的栈
+    char* save_buffer;          // 被其他协程换出时，保存已使用部分的栈
+    uint32_t save_size;
+    uint32_t save_capacity;
+
+    uint32_t index;             // 在调度器slab中的下标
+    uint32_t generation;        // 槽被复用的代数，与index一起组成协程ID
+    coroutine* free_next;       // 空闲链表
+    coroutine* free_prev;
+    bool stack_cold;            // 空闲期间栈的物理内存已经通过MADV_DONTNEED归还
+
+    co_wait_queue* wait_queue;  // 正在等待的队列
+    coroutine* wait_prev;
+    coroutine* wait_next;
+    stTimeoutItem_t* park_item; // 等待超时和唤醒时使用，第一次co_wait时分配
+
+    const char* name;           // 任务类型名，watchdog报告时使用，必须是静态存储的字符串
+    uint64_t yield_ns;          // 被采样的挂起时间，0表示本次挂起未被采样
+
+    unsigned long long deadline_ms; // 截止时间(co_clock_ms)，0表示没有
+    CoCancelToken* cancel_token;
+    coroutine* cancel_prev;     // 关联同一个令牌的协程链表
+    coroutine* cancel_next;
+    stTimeoutItem_t* wait_item; // 挂起期间等待的超时项，取消时把它放入就绪队列
+
+    void* local_slots[CO_LOCAL_SLOT_NUM]; // 协程局部存储，协程创建时清零
+
     coroutine() {
         func = NULL;
         ud = NULL;
@@ -84,27 +158,134 @@ struct coroutine {
         enable_hook = false;
         stack = NULL;
         result = 0;
-        memset(&ctx, 0, sizeof(ucontext_t));
+        ctx.sp = NULL;
+        share_stack = NULL;
+        save_buffer = NULL;
+        save_size = 0;
+        save_capacity = 0;
+        index = 0;
+        generation = 0;
+        free_next = NULL;
+        free_prev = NULL;
+        stack_cold = false;
+        wait_queue = NULL;
+        wait_prev = NULL;
+        wait_next = NULL;
+        park_item = NULL;
+        name = NULL;
+        yield_ns = 0;
+        deadline_ms = 0;
+        cancel_token = NULL;
+        cancel_prev = NULL;
+        cancel_next = NULL;
+        wait_item = NULL;
+        memset(local_slots, 0, sizeof(local_slots));
     }
 };
 
+/// @brief 类:CoCancelToken 协程取消令牌
+///
+/// 一个令牌可以关联多个协程，例如同一个客户端连接上所有正在处理的请求，连接断开时调用Cancel，
+/// 关联的协程在co_poll、co_fd_wait、co_wait、hook的网络IO和CoroutineSchedule::Yield中等待时
+/// 立即以超时返回，之后的等待也都立即超时，请求就不会继续占用后端资源。
+/// @note 只能在同一个线程中使用；co_offload提交到后台线程的调用不能中断，会等它执行完再返回
+class CoCancelToken {
+public:
+    CoCancelToken();
+
+    /// @brief 析构时解除与所有协程的关联
+    ~CoCancelToken();
+
+    /// @brief 取消，可以在协程或主循环中调用，被唤醒的协程在下一次co_update中恢复
+    void Cancel();
+
+    inline bool canceled() const {
+        return canceled_;
+    }
+
+private:
+    friend int32_t coroutine_set_cancel_token(struct schedule *, int64_t id, CoCancelToken* token);
+
+    bool canceled_;
+    coroutine* head_;
+};
+
+/// @brief 以2为底的对数直方图，第0个桶统计0，第i个桶统计[2^(i-1), 2^i)，最后一个桶包含所有更大的值
+struct co_histogram {
+    uint64_t buckets[CO_STATS_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/// @brief 协程调度器的运行统计，每个线程一份，只由调度器所在的线程更新，不需要加锁
+/// @note 计数都是累计值，每秒resume次数等速率由调用者对两次采集的差值计算
+struct co_stats {
+    uint32_t alive_num;         // 未结束的协程数量
+    uint64_t resume_num;        // resume次数
+    uint64_t yield_num;         // yield次数
+    uint64_t timeout_num;       // 因超时被恢复的次数
+    uint64_t update_num;        // co_update的轮数
+    uint64_t long_run_num;      // 被watchdog报告长时间不让出的次数
+    co_histogram run_queue;     // 每轮co_update恢复的协程数量
+    co_histogram resume_ns;     // 每次resume到协程让出或结束的时间(ns)，采样
+    co_histogram wakeup_ns;     // 协程从挂起到被恢复的时间(ns)，采样
+};
+
+struct stCoInbox_t;
+
 /// @brief struct schedule 协程调度器的数据结构
 struct schedule {
-    ucontext_t main;
-    int64_t nco;                // 下一个要创建的协程ID
+    coctx_t main;
     int64_t running;            // 当前正在运行的协程ID
-    cxx::unordered_map<int64_t, coroutine*> co_hash_map;
-    std::list<coroutine*> co_free_list;
+    coroutine* running_co;      // 当前正在运行的协程
+    std::vector<coroutine*> co_slabs;   // 协程槽，每块CO_SLAB_SIZE个，地址不会变化
+    uint32_t co_slot_num;       // 已经使用过的槽数量
+    coroutine* co_free_head;    // 侵入式空闲链表，不需要为每次回收分配节点，只包含还持有栈的协程
+    coroutine* co_free_tail;
+    coroutine* co_free_edge;    // 空闲链表中第hot_free_num个协程，它之后的栈都已经归还物理内存
     int32_t co_free_num;
+    coroutine* co_empty_head;   // 栈已经释放的空闲协程，单向链表
     uint32_t stack_size;
+    stack_mem** share_stacks;   // 共享栈，为NULL时每个协程使用独立的栈
+    int32_t share_stack_num;
+    int32_t share_stack_idx;    // 新协程轮流分配共享栈
+    uint32_t stack_high_water;  // 观察到的协程栈最大使用量(字节)，以页为精度
+    int32_t hot_free_num;       // 保留物理内存的空闲协程数量，预热后不小于预热数量
+    int32_t max_free_num;       // 保留栈的空闲协程数量
+    int32_t warm_num;           // coroutine_prewarm要求的空闲协程数量
+    uint32_t co_alive_num;      // 未结束的协程数量
+    uint32_t co_alive_peak;
+    uint64_t co_cold_alloc_num; // 创建协程时没有现成的栈、需要新分配的次数
+
+    co_stats stats;
+    const char* running_name;   // 正在运行的协程的名字，与running一起供watchdog线程读取
+    uint64_t wd_resume_num;     // 以下由watchdog线程使用：上次看到的resume_num
+    uint64_t wd_since_ms;       // 第一次看到这次resume的时间
+    bool wd_reported;
+
+    stCoInbox_t* inbox;         // 其他线程投递的恢复请求，@see coroutine_post_resume
+};
+
+/// @brief 协程池的统计信息，用于判断预热的协程数量是否足够
+struct co_pool_stats {
+    uint32_t alive_num;         // 正在运行或挂起的协程数量
+    uint32_t alive_peak;        // alive_num的历史最大值
+    int32_t free_num;           // 空闲链表中的协程数量，不包括栈已经释放的
+    int32_t warm_num;           // 预热的协程数量
+    uint64_t cold_alloc_num;    // 需要新分配栈的次数，预热之后仍在增长说明池已饱和
 };
 
 
 /// @brief 协程库初始化函数
-/// @param stack_size 协程的栈大小，默认是256k
+/// @param stack_size 协程的栈大小，默认是256k，共享栈模式下为每个共享栈的大小
+/// @param share_stack_num 共享栈的数量，默认0表示每个协程使用独立的栈
 /// @return 返回struct schedule* 类型的指针
 /// @note 只能够在主线程调用
-struct schedule * coroutine_open(uint32_t stack_size = 256 * 1024);
+/// @note 共享栈模式下，协程被换出时只把已使用的部分栈拷贝到按需分配的缓冲区，
+///   每个协程只占用几KB内存，适合同时存在几十万个协程的场景。代价是切换时的内存拷贝，
+///   以及协程挂起后，其栈上变量的地址对其他协程和主循环不再有效
+struct schedule * coroutine_open(uint32_t stack_size = 256 * 1024, int32_t share_stack_num = 0);
 
 /// @brief 协程库关闭
 /// @param 协程调度器结构体指针
@@ -134,6 +315,20 @@ int64_t coroutine_new(struct schedule *, coroutine_func, void *ud);
 /// @note 只能够在主线程调用
 int32_t coroutine_resume(struct schedule *, int64_t id, int32_t result = 0);
 
+/// @brief 从其他线程恢复协程，协程在所属线程的下一次co_update中以result恢复
+/// @param[in] 协程调度器结构体指针
+/// @param[in] 协程ID
+/// @param[in] 恢复时传递的结果
+/// @return 0 成功，kCO_INVALID_PARAM 参数错误
+/// @note 可以在任何线程调用，不加锁、不阻塞，供后台线程(如线程池中的DB客户端)完成工作后唤醒协程。\n
+///   调用期间调度器不能被coroutine_close；恢复时协程已经结束的请求被忽略，与coroutine_resume相同
+int32_t coroutine_post_resume(struct schedule *, int64_t id, int32_t result = 0);
+
+/// @brief 从其他线程唤醒阻塞在co_update中的所属线程，不恢复任何协程
+/// @return 0 成功，kCO_INVALID_PARAM 参数错误
+/// @note 可以在任何线程调用，供线程间队列提交任务后通知消费线程；调用期间调度器不能被coroutine_close
+int32_t coroutine_wakeup(struct schedule *);
+
 /// @brief 获取协程当前状态
 /// @param 协程调度器结构体指针
 /// @param 协程ID
@@ -145,6 +340,63 @@ int coroutine_status(struct schedule *, int64_t id);
 /// @return 返回正在运行的协程ID
 int64_t coroutine_running(struct schedule *);
 
+/// @brief 获取协程栈的最大使用量，用来评估stack_size是否合适
+/// @param 协程调度器结构体指针
+/// @return 所有协程曾经使用过的最大栈深度(字节)，以页为精度
+/// @note 需要对每个栈调用mincore，只适合在统计上报时调用；协程回收时不统计，
+///   coroutine_prewarm预热的深度也来自这里，需要预热到实际深度时先调用一次
+uint32_t coroutine_stack_high_water(struct schedule *);
+
+/// @brief 预先创建协程并分配栈，使之后创建协程时只需要从空闲链表中取出
+/// @param 协程调度器结构体指针
+/// @param num 空闲协程的目标数量
+/// @return 预热后空闲协程的数量
+/// @note 独立栈模式下会访问每个栈顶部的CO_WARM_STACK_SIZE字节(或观察到的栈最大使用量)，
+///   提前产生缺页；预热数量以内的空闲协程不再通过madvise归还物理内存
+int32_t coroutine_prewarm(struct schedule *, int32_t num);
+
+/// @brief 获取协程池的统计信息
+void coroutine_get_pool_stats(struct schedule *, co_pool_stats* stats);
+
+/// @brief 获取调度器的运行统计
+/// @note 只能在调度器所在的线程调用
+void coroutine_get_stats(struct schedule *, co_stats* stats);
+
+/// @brief 设置协程的名字，watchdog报告时使用
+/// @param name 必须是静态存储的字符串，例如typeid(...).name()，CoroutineTask会自动设置为其类型名
+void coroutine_set_name(struct schedule *, int64_t id, const char* name);
+
+/// @brief 设置协程的截止时间，之后协程中的等待都不会超过它，到期后立即以超时返回
+/// @param deadline_ms co_clock_ms()时钟上的绝对时间，0表示取消截止时间
+void coroutine_set_deadline(struct schedule *, int64_t id, unsigned long long deadline_ms);
+
+/// @brief 把协程关联到取消令牌，一个协程只能关联一个令牌，协程结束时自动解除关联
+/// @param token 为NULL时解除关联
+/// @return 0 成功，kCO_COROUTINE_UNEXIST 协程不存在
+/// @note 关联一个已经取消的令牌时，协程之后的等待都立即超时
+int32_t coroutine_set_cancel_token(struct schedule *, int64_t id, CoCancelToken* token);
+
+/// @brief 当前协程距离截止时间还剩多少毫秒，发起RPC时可以把它作为对端的超时，使截止时间跨服务传递
+/// @return -1 没有截止时间(或不在协程中)，0 已经到期或被取消
+int co_remaining_ms();
+
+/// @brief watchdog报告回调，在watchdog线程中调用
+/// @param co_id 协程ID
+/// @param name 协程的名字(已经demangle)，没有设置时为空字符串
+/// @param running_ms 已经连续运行的时间，至少为threshold_ms
+typedef cxx::function<void(int64_t co_id, const char* name, uint32_t running_ms)> co_watchdog_cb;
+
+/// @brief 启动watchdog线程，检查所有线程的调度器，报告连续运行超过threshold_ms而没有让出的协程
+/// @param threshold_ms 阈值，毫秒
+/// @param cb 报告回调，为空时打印错误日志
+/// @return 0 成功，已经启动时返回-1
+/// @note watchdog只读取各个调度器的resume计数，不增加协程切换的开销；
+///   每次长时间运行只报告一次，报告的时间精度为threshold_ms/4
+int co_start_watchdog(uint32_t threshold_ms, const co_watchdog_cb& cb = co_watchdog_cb());
+
+/// @brief 停止watchdog线程
+void co_stop_watchdog();
+
 /// @brief 暂停一个协程的运行
 /// @param[in] 协程调度器结构体指针
 /// @return 处理结果，@see CoroutineErrorCode
@@ -155,14 +407,174 @@ coroutine* get_curr_coroutine(struct schedule *);
 struct stCoEpoll_t;
 
 coroutine* co_self();
+/// @brief 协程是否运行在共享栈上，此时不能把栈上变量的地址留给主循环在协程挂起期间使用
+bool co_is_share_stack(coroutine* co);
+
+/// @brief 本线程正在运行的协程，不在协程中时为NULL，由coroutine_resume维护
+/// @note 只读，访问它只需要一次线程局部变量的读取，不需要像co_self那样查找调度器
+extern __thread coroutine* g_co_current;
+
+/// @brief 分配一个协程局部存储的槽，所有线程的所有协程共用同一组下标
+/// @return 槽的下标，<0 已经分配了CO_LOCAL_SLOT_NUM个槽
+/// @note 一般通过定义静态的CoroutineLocal对象在程序启动时分配，槽不会释放
+int32_t co_local_alloc_slot();
+
+/// @brief 类:CoroutineLocal 协程局部存储
+///
+/// 值直接存放在当前协程的coroutine结构中，读写只是一次线程局部变量读取和一次数组访问，
+/// 不经过哈希表，也不依赖系统调用的hook。适合保存请求上下文，例如跟踪ID、玩家ID：
+/// @code
+/// static CoroutineLocal<uint64_t> g_trace_id;
+/// g_trace_id.Set(request.trace_id);   // 处理请求的协程开始时设置
+/// LOG("trace %lu", g_trace_id.Get());  // 同一个协程中任何地方都可以读取
+/// @endcode
+/// 协程创建时所有槽被清零，值不会泄漏给复用同一个协程槽的下一个协程。
+/// @note T必须可以按字节拷贝并且不大于指针；更大的上下文请保存指针，由调用者管理其生命期
+template<typename T>
+class CoroutineLocal {
+public:
+    CoroutineLocal() : slot_(co_local_alloc_slot()) {
+        typedef char check_size[sizeof(T) <= sizeof(void*) ? 1 : -1];
+        (void)sizeof(check_size);
+    }
+
+    /// @brief 读取当前协程的值，不在协程中、没有设置过或槽分配失败时返回T()
+    T Get() const {
+        coroutine* co = g_co_current;
+        T value = T();
+        if (co != NULL && slot_ >= 0) {
+            memcpy(&value, &co->local_slots[slot_], sizeof(T));
+        }
+        return value;
+    }
+
+    /// @brief 设置当前协程的值
+    /// @return false 不在协程中或槽分配失败
+    bool Set(const T& value) {
+        coroutine* co = g_co_current;
+        if (co == NULL || slot_ < 0) {
+            return false;
+        }
+        co->local_slots[slot_] = NULL;
+        memcpy(&co->local_slots[slot_], &value, sizeof(T));
+        return true;
+    }
+
+    inline int32_t slot() const {
+        return slot_;
+    }
+
+private:
+    int32_t slot_;
+};
 int co_poll(stCoEpoll_t *ctx, struct pollfd fds[], nfds_t nfds, int timeout_ms);
-void co_update();
+
+/// @brief fd在epoll中的持久注册，hook的读写只在第一次需要等待时注册一次，之后等待不再调用epoll_ctl
+struct stCoFdEvent_t;
+
+/// @brief 把fd以边缘触发的方式注册到本线程的epoll中
+/// @return 注册失败(没有协程环境、fd不支持epoll)返回NULL，此时只能使用co_poll
+stCoFdEvent_t* co_fd_event_alloc(int fd);
+
+/// @brief 取消注册，必须在close(fd)之前、在注册的线程中调用；正在等待的协程会醒来重试
+void co_fd_event_free(stCoFdEvent_t* ev);
+
+/// @brief 在协程中等待fd就绪
+/// @param events POLLIN/POLLOUT
+/// @return 1 需要重试读写，0 超时，<0 出错
+/// @note 边缘触发只通知状态变化，只能在读写返回EAGAIN(或写了一部分)之后调用；
+///   醒来时的事件可能产生于上一次读写之前，重试仍然可能EAGAIN，调用者需要循环等待
+int co_fd_wait(stCoFdEvent_t* ev, short events, int timeout_ms);
+
+/// @brief 处理本线程协程的网络事件和超时
+/// @param max_wait_ms 没有事件时最长的阻塞时间，实际等待不会超过最近一个协程超时的时间；
+///   0表示不阻塞，<0表示一直等到有事件或协程超时。默认1ms，兼容还要处理其他事件源的主循环
+void co_update(int max_wait_ms = 1);
+
+/// @brief 设置本线程co_update的忙轮询时间
+/// @param busy_poll_us 收到事件后的这段时间内co_update不阻塞，以降低延迟敏感服务的唤醒开销，
+///   代价是占用CPU，0表示关闭(默认)
+void co_set_busy_poll(int busy_poll_us);
 stCoEpoll_t* co_get_epoll_ct();
+
+/// @brief 把当前协程挂到等待队列尾部并挂起，直到被co_notify_one/co_notify_all唤醒
+/// @param timeout_ms 超时时间，<0表示一直等待
+/// @return 0 被唤醒，kCO_TIMEOUT 超时(或被Resume等其他方式恢复)，kCO_NOT_IN_COROUTINE 不在协程中
+/// @note 队列只能在同一个线程的协程之间使用
+int32_t co_wait(co_wait_queue* queue, int timeout_ms = -1);
+
+/// @brief 与co_wait相同，但不受协程截止时间和取消令牌影响，用于必须完成的等待(如条件变量醒来后重新加锁)
+/// @return 0 被唤醒，kCO_TIMEOUT 被Resume等其他方式恢复，kCO_NOT_IN_COROUTINE 不在协程中
+int32_t co_wait_uninterruptible(co_wait_queue* queue);
+
+/// @brief 唤醒队列头部的协程
+/// @return 被唤醒的协程ID，队列为空返回INVALID_CO_ID
+/// @note 可以在协程或主循环中调用，被唤醒的协程不会立即运行，而是放入就绪队列，
+///   在下一次co_update中恢复，所以调用者需要周期性调用co_update
+int64_t co_notify_one(co_wait_queue* queue);
+
+/// @brief 唤醒队列中的所有协程
+/// @return 被唤醒的协程数量
+int32_t co_notify_all(co_wait_queue* queue);
+
+/// @brief 挂在本线程co_update上的回调等待项，不占用协程栈，供无栈协程(CoroutinueAwait.h)使用
+struct stCoWaiter_t;
+
+/// @brief 等待项的回调，在co_update中调用
+/// @param result 等待fd时为就绪的事件(POLLIN等)，co_waiter_notify时为其参数，超时为kCO_TIMEOUT
+typedef void (*co_waiter_fn)(void* arg, int result);
+
+/// @brief 分配一个等待项，只能在调用过coroutine_open的线程中使用
+/// @return 没有协程环境时返回NULL
+stCoWaiter_t* co_waiter_alloc(co_waiter_fn fn, void* arg);
+
+/// @brief 释放等待项，还在等待时直接取消，不再回调
+void co_waiter_free(stCoWaiter_t* waiter);
+
+/// @brief timeout_ms后回调，结果为kCO_TIMEOUT
+/// @note 每个等待项同时只能有一次等待，回调之前不能再次发起
+int co_waiter_sleep(stCoWaiter_t* waiter, int timeout_ms);
+
+/// @brief fd就绪或超时后回调
+/// @param events POLLIN/POLLOUT
+/// @param timeout_ms <0表示一直等待
+/// @return 0 成功，-1 fd不能加入epoll
+int co_waiter_fd(stCoWaiter_t* waiter, int fd, short events, int timeout_ms);
+
+/// @brief 在下一次co_update中以result回调，可以在回调中或主循环中调用，正在等待的超时和fd被取消
+void co_waiter_notify(stCoWaiter_t* waiter, int result);
+
+/// @brief 在后台线程池中执行一个阻塞的调用，当前协程挂起直到执行完成
+/// @param fn 在后台线程中执行，不能使用协程相关的接口
+/// @return 0 成功，其他值失败，@see CoroutineErrorCode
+/// @note 不在协程中时直接在当前线程执行。\n
+///   共享栈模式下协程挂起后栈会被换出，fn只能读写堆上的数据；
+///   协程在等待期间被强制结束时，fn仍会执行完，它使用的数据要能够在协程结束后继续存在；
+///   等待期间其他地方提前恢复协程时会继续挂起，只有fn执行完才返回
+int co_offload(const cxx::function<void()>& fn);
+
+/// @brief 设置后台线程池的线程数，默认4个，只在第一次co_offload之前设置有效
+void co_set_offload_thread_num(int thread_num);
+
+/// @brief 是否把hook的普通文件读写放到后台线程池中执行，默认关闭
+/// @note 读page cache中的小文件比线程切换更快，只适合文件较大或磁盘较慢的场景；
+///   共享栈模式下读写缓冲区可能在栈上，此时仍然在当前线程执行
+void co_set_file_io_offload(bool enable);
+
 void co_enable_hook_sys();
 void co_disable_hook_sys();
 bool co_is_enable_sys_hook();
 void co_log_err(const char *fmt, ...);
 
+/// @brief 读取协程运行时使用的单调时钟，毫秒
+/// @note 支持invariant TSC时直接读TSC，否则使用CLOCK_MONOTONIC_COARSE，都不需要系统调用
+unsigned long long co_clock_ms();
+
+/// @brief 获取本线程本轮co_update开始时缓存的时间，毫秒
+/// @note co_poll的超时从这个时间开始计算，协程在一轮中运行很久后再co_poll，超时会相应提前，
+///   对精度敏感的场合请使用co_clock_ms
+unsigned long long co_now_ms();
+
 class CoroutineSchedule;
 class Timer;
 
@@ -204,9 +616,27 @@ public:
     /// @return 协程调度器对象
     CoroutineSchedule* schedule_obj();
 
+    /// @brief 设置任务的整体截止时间，跨越多次RPC和存储调用，@see coroutine_set_deadline
+    /// @param timeout_ms 从现在开始的毫秒数
+    /// @note 可以在Start之前或在协程中调用
+    void SetDeadline(uint32_t timeout_ms);
+
+    /// @brief 关联取消令牌，@see coroutine_set_cancel_token
+    /// @note 可以在Start之前或在协程中调用
+    void SetCancelToken(CoCancelToken* token);
+
+protected:
+    /// @brief 通过NewPooledTask创建的任务结束后放回对象池之前调用，在此释放本次请求持有的资源
+    virtual void Reset() {}
+
 private:
     int64_t id_;
     CoroutineSchedule* schedule_obj_;
+    int32_t pool_index_;        // 所属的对象池，-1表示不使用对象池，结束后delete
+    CoroutineTask* prev_;       // 调度器中未结束任务的侵入式链表，对象池中复用next_作为空闲链表
+    CoroutineTask* next_;
+    unsigned long long deadline_ms_;    // Start之前设置的截止时间和取消令牌，Start时应用到协程
+    CoCancelToken* cancel_token_;
 };
 
 /// @brief 基于function的通用的协程任务实现
@@ -222,10 +652,23 @@ public:
         m_run();
     }
 
+protected:
+    virtual void Reset() {
+        m_run = NULL;
+    }
+
 private:
     cxx::function<void(void)> m_run;
 };
 
+/// @brief 协程任务池的统计信息
+struct CoroutinePoolStats {
+    co_pool_stats co;           // 协程及其栈
+    int32_t task_cached_num;    // 对象池中缓存的任务对象数量
+    uint64_t task_new_num;      // NewPooledTask新建任务对象的次数
+    uint64_t task_reuse_num;    // NewPooledTask复用任务对象的次数
+};
+
 /// @brief 类:CoroutineSchedule 协程调度类
 ///
 /// 与协程任务类CoroutineTask是友员\n
@@ -243,9 +686,10 @@ public:
     /// @brief 初始化工作, new了一个新的schedule
     /// @param timer 定时器实例，使协程支持yield超时
     /// @param stack_size 协程的栈大小，默认是256k
+    /// @param share_stack_num 共享栈的数量，>0时启用共享栈模式，@see coroutine_open
     /// @return = 0 成功
     /// @return = -1 失败
-    int Init(Timer* timer = NULL, uint32_t stack_size = 256 * 1024);
+    int Init(Timer* timer = NULL, uint32_t stack_size = 256 * 1024, int32_t share_stack_num = 0);
 
     /// @brief 关闭协程系统, 释放所有资源
     /// @return 还未结束的协程数
@@ -268,15 +712,36 @@ public:
     /// @brief 挂起当前协程
     /// @param timeout_ms 超时时间，单位为毫秒，默认-1，<=0时表示不进行超时处理
     /// @return 处理结果，@see CoroutineErrorCode
-    /// @note 此函数必须在协程中调用
+    /// @note 此函数必须在协程中调用；协程的截止时间到达或被取消时返回kCO_TIMEOUT，
+    ///   不需要设置timer
     int32_t Yield(int32_t timeout_ms = -1);
 
+    /// @brief 返回协程栈的最大使用量(字节)，@see coroutine_stack_high_water
+    uint32_t StackHighWater() const;
+
+    /// @brief 启动时预先创建协程并预热栈，@see coroutine_prewarm
+    /// @param num 预热的协程数量，一般取预期的最大并发请求数
+    /// @return 预热后空闲协程的数量
+    int32_t Prewarm(int32_t num);
+
+    /// @brief 获取协程池和任务对象池的统计信息
+    void GetPoolStats(CoroutinePoolStats* stats) const;
+
+    /// @brief 获取调度器的运行统计，@see coroutine_get_stats
+    void GetStats(co_stats* stats) const;
+
     /// @brief 激活指定ID的协程
     /// @param id 协程ID
     /// @param result resume时可传递结果，默认为0
     /// @return 处理结果，@see CoroutineErrorCode
     int32_t Resume(int64_t id, int32_t result = 0);
 
+    /// @brief 从其他线程激活指定ID的协程，@see coroutine_post_resume
+    int32_t PostResume(int64_t id, int32_t result = 0);
+
+    /// @brief 从其他线程唤醒阻塞在co_update中的所属线程，@see coroutine_wakeup
+    int32_t Wakeup();
+
     /// @brief 返回指定id协程的状态
     /// @param id 协程ID
     /// @return 协程状态
@@ -297,15 +762,107 @@ public:
         return task;
     }
 
+    /// @brief 模版方法, 从按类型区分的对象池中取一个协程任务
+    /// @note 协程结束后任务对象调用Reset后放回对象池，而不是delete，
+    ///   适合每个请求启动一个协程的场景，配合Prewarm创建协程时没有内存分配
+    template<typename TASK>
+    TASK* NewPooledTask() {
+        if (CurrentTaskId() != INVALID_CO_ID) {
+            return NULL;
+        }
+        int32_t pool_index = TaskTypeIndex<TASK>();
+        TASK* task = static_cast<TASK*>(PopPooledTask(pool_index));
+        if (task == NULL) {
+            task = new TASK();
+            task->pool_index_ = pool_index;
+        }
+        if (AddTaskToSchedule(task)) {
+            delete task;
+            task = NULL;
+        }
+        return task;
+    }
+
+    /// @brief 释放一个Start失败、协程没有运行的任务，对象池中的任务放回对象池，其他的delete
+    /// @note 只能在Start(true)返回<0之后调用，已经开始运行的任务结束时会自动释放
+    void ReleaseTask(CoroutineTask* task);
+
 private:
+    struct TaskPool {
+        CoroutineTask* free_head;
+        int32_t free_num;
+        uint64_t new_num;
+        uint64_t reuse_num;
+
+        TaskPool() : free_head(NULL), free_num(0), new_num(0), reuse_num(0) {}
+    };
+
+    // 每个任务类型在进程内分配一个固定的下标，对象池按下标存放，查找不需要哈希
+    template<typename TASK>
+    static int32_t TaskTypeIndex() {
+        static const int32_t index = NextTaskTypeIndex();
+        return index;
+    }
+    static int32_t NextTaskTypeIndex();
+
     int AddTaskToSchedule(CoroutineTask* task);
+    void RemoveTask(CoroutineTask* task);
+    CoroutineTask* PopPooledTask(int32_t pool_index);
+    void FinishTask(CoroutineTask* task);
     CoroutineTask* Find(int64_t id) const;
     int32_t OnTimeout(int64_t id);
 
+    friend void DoTask(struct schedule*, void *ud);
+
     struct schedule* schedule_;
     Timer* timer_;
-    cxx::unordered_map<int64_t, CoroutineTask*> task_map_;
-    std::set<CoroutineTask*> pre_start_task_;
+    CoroutineTask* task_head_;          // 未结束(包括还未Start)的任务
+    int task_num_;
+    std::vector<TaskPool> task_pools_;
+};
+
+struct stTimeout_t;
+struct stTimerItem_t;
+
+/// @brief 类:CoroutineTimer 基于分层时间轮的定时器
+///
+/// 与co_poll的超时使用同样的时间轮，启动和停止都是O(1)，超时时间没有上限，
+/// 适合buff过期、会话超时这类数量多、时间长的定时任务。\n
+/// 可以作为CoroutineSchedule::Init的timer参数，为Yield提供超时。
+/// @note 非线程安全，需要在同一个线程中周期性调用Update
+class CoroutineTimer : public Timer {
+public:
+    CoroutineTimer();
+
+    virtual ~CoroutineTimer();
+
+    /// @brief 启动定时器
+    /// @param timeout_ms 超时时间，单位为毫秒
+    /// @param cb 超时回调，返回kTIMER_BE_REMOVED删除定时器，返回0按原超时时间重新计时，
+    ///   返回>0时以返回值作为新的超时时间重新计时
+    /// @return >=0 定时器ID，<0 失败
+    virtual int64_t StartTimer(uint32_t timeout_ms, const TimeoutCallback& cb);
+
+    /// @brief 停止定时器，可以在超时回调中调用
+    /// @param timer_id 定时器ID
+    /// @return 0 成功，其他值表示定时器不存在
+    virtual int32_t StopTimer(int64_t timer_id);
+
+    /// @brief 处理所有已经超时的定时器
+    /// @return 本次触发的定时器数量
+    virtual int32_t Update();
+
+    virtual const char* GetLastError() const;
+
+    virtual int64_t GetTimerNum();
+
+private:
+    stTimeout_t* wheel_;
+    stTimerItem_t* running_;                // 正在执行回调的定时器
+    bool running_stopped_;                  // 正在执行回调的定时器被要求停止
+    int64_t next_timer_id_;
+    cxx::unordered_map<int64_t, stTimerItem_t*> timers_;
+    char last_error_[256];
 };
 
 } // namespace pebble
@@ -0,0 +1,270 @@
+/*
+ * Tencent is pleased to support the open source community by making Pebble available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License
+ * is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express
+ * or implied. See the License for the specific language governing permissions and limitations under
+ * the License.
+ *
+ */
+
+
+#ifndef _PEBBLE_COMMON_COROUTINE_AWAIT_H_
+#define _PEBBLE_COMMON_COROUTINE_AWAIT_H_
+
+#include "common/coroutine.h"
+
+// 只在编译器支持C++20协程时提供，其他情况下这个头文件为空
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <utility>
+
+
+namespace pebble {
+
+// 无栈协程(C++20 co_await)
+//
+// 协程帧只保存跨越co_await的局部变量，一般只有几百字节，适合为几百万个实体各挂起一个等待。
+// 与有栈协程共用本线程的co_update、epoll和时间轮，等待的事件到来时在co_update中直接恢复，
+// 运行在主循环的栈上。
+// @note 无栈协程不是CoroutineTask，不能调用Yield、co_poll以及hook的阻塞接口，
+//   这些调用会阻塞整个线程；只能co_await本文件中的等待对象
+
+/// @brief 类:CoAwaitTask 无栈协程的返回类型
+///
+/// 调用后立即执行到第一个挂起的co_await，结束时自动释放协程帧。调用者不能等待它结束，
+/// 需要结果时通过CoAwaitPromise传回。
+/// @code
+/// CoAwaitTask Handle(Entity* entity) {
+///     co_await CoSleep(1000);
+///     entity->Tick();
+/// }
+/// @endcode
+class CoAwaitTask {
+public:
+    struct promise_type {
+        CoAwaitTask get_return_object() {
+            return CoAwaitTask();
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return std::suspend_never();
+        }
+        std::suspend_never final_suspend() noexcept {
+            return std::suspend_never();
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+/// @brief 等待对象的公共部分：挂起时分配一个co_waiter，co_update回调时恢复协程
+/// @note 等待对象是co_await表达式中的临时对象，生命期覆盖整个挂起过程，回调中可以直接访问
+class CoAwaiterBase {
+public:
+    CoAwaiterBase() : waiter_(NULL), result_(0) {}
+
+    ~CoAwaiterBase() {
+        co_waiter_free(waiter_);
+    }
+
+    CoAwaiterBase(const CoAwaiterBase&) = delete;
+    CoAwaiterBase& operator=(const CoAwaiterBase&) = delete;
+
+protected:
+    bool Prepare(std::coroutine_handle<> handle) {
+        handle_ = handle;
+        waiter_ = co_waiter_alloc(OnWake, this);
+        if (waiter_ == NULL) {
+            result_ = kCO_INVALID_PARAM;
+            return false;
+        }
+        return true;
+    }
+
+    static void OnWake(void* arg, int result) {
+        CoAwaiterBase* self = static_cast<CoAwaiterBase*>(arg);
+        self->result_ = result;
+        self->handle_.resume();
+    }
+
+    stCoWaiter_t* waiter_;
+    std::coroutine_handle<> handle_;
+    int result_;
+};
+
+/// @brief co_await CoSleep(ms) 挂起指定的毫秒数
+/// @return 0 成功，kCO_INVALID_PARAM 本线程没有调用coroutine_open
+class CoSleep : public CoAwaiterBase {
+public:
+    explicit CoSleep(int timeout_ms) : timeout_ms_(timeout_ms) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        return Prepare(handle) && co_waiter_sleep(waiter_, timeout_ms_) == 0;
+    }
+
+    int await_resume() noexcept {
+        return result_ == kCO_TIMEOUT ? 0 : result_;
+    }
+
+private:
+    int timeout_ms_;
+};
+
+/// @brief co_await CoWaitFd(fd, POLLIN, ms) 等待fd就绪
+/// @return 就绪的事件(POLLIN等)，0 超时，<0 fd不能加入epoll
+/// @note fd以水平触发的方式临时加入epoll，醒来时移除；不能用于已经被hook注册到epoll的fd
+class CoWaitFd : public CoAwaiterBase {
+public:
+    CoWaitFd(int fd, short events, int timeout_ms = -1)
+        : fd_(fd), events_(events), timeout_ms_(timeout_ms) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        if (!Prepare(handle)) {
+            return false;
+        }
+        if (co_waiter_fd(waiter_, fd_, events_, timeout_ms_) != 0) {
+            result_ = -1;
+            return false;
+        }
+        return true;
+    }
+
+    int await_resume() noexcept {
+        return result_ == kCO_TIMEOUT ? 0 : result_;
+    }
+
+private:
+    int fd_;
+    short events_;
+    int timeout_ms_;
+};
+
+/// @brief 类:CoAwaitPromise 把回调风格的异步接口(RPC、DataStore等)转换为co_await
+///
+/// 发起调用时把promise的副本交给回调，回调中调用Set，协程co_await Wait()得到结果：
+/// @code
+/// CoAwaitTask Load(PlayerClient* client, LoadRequest req) {
+///     CoAwaitPromise<Player> promise;
+///     client->Load(req, [promise](int32_t ret, const Player& p) mutable { promise.Set(ret, p); });
+///     if (co_await promise.Wait(3000) == 0) {
+///         Use(promise.value());
+///     }
+/// }
+/// @endcode
+/// 所有副本共享同一个状态，协程超时结束后回调仍然可以安全地调用Set。
+/// @note 只能在同一个线程中使用，协程在Set之后的下一次co_update中恢复，不会在回调中重入
+template<typename T>
+class CoAwaitPromise {
+public:
+    CoAwaitPromise() : state_(std::make_shared<State>()) {}
+
+    /// @brief 设置结果，唤醒等待的协程，只有第一次调用有效
+    /// @param ret 结果码，作为co_await Wait()的返回值
+    void Set(int32_t ret, const T& value) {
+        if (state_->done) {
+            return;
+        }
+        state_->done = true;
+        state_->ret = ret;
+        state_->value = value;
+        if (state_->waiter != NULL) {
+            co_waiter_notify(state_->waiter, 0);
+        }
+    }
+
+    inline bool done() const {
+        return state_->done;
+    }
+
+    inline const T& value() const {
+        return state_->value;
+    }
+
+    inline T& value() {
+        return state_->value;
+    }
+
+    class Awaiter;
+
+    /// @brief 等待结果
+    /// @param timeout_ms 超时时间，<0表示一直等待
+    /// @return Set传入的结果码，kCO_TIMEOUT 超时
+    Awaiter Wait(int timeout_ms = -1) {
+        return Awaiter(state_, timeout_ms);
+    }
+
+private:
+    struct State {
+        bool done;
+        int32_t ret;
+        T value;
+        stCoWaiter_t* waiter;   // 正在等待的协程
+
+        State() : done(false), ret(0), value(), waiter(NULL) {}
+    };
+
+public:
+    class Awaiter : public CoAwaiterBase {
+    public:
+        Awaiter(const std::shared_ptr<State>& state, int timeout_ms)
+            : state_(state), timeout_ms_(timeout_ms) {}
+
+        ~Awaiter() {
+            if (state_->waiter == waiter_) {
+                state_->waiter = NULL;
+            }
+        }
+
+        bool await_ready() const noexcept {
+            return state_->done;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            if (!Prepare(handle)) {
+                return false;
+            }
+            if (timeout_ms_ >= 0) {
+                co_waiter_sleep(waiter_, timeout_ms_);
+            }
+            state_->waiter = waiter_;
+            return true;
+        }
+
+        int32_t await_resume() noexcept {
+            state_->waiter = NULL;
+            if (state_->done) {
+                return state_->ret;
+            }
+            return result_ == 0 ? kCO_TIMEOUT : result_;
+        }
+
+    private:
+        std::shared_ptr<State> state_;
+        int timeout_ms_;
+    };
+
+private:
+    std::shared_ptr<State> state_;
+};
+
+} // namespace pebble
+
+#endif // __cpp_impl_coroutine
+
+#endif  // _PEBBLE_COMMON_COROUTINE_AWAIT_H_
@@ -2,11 +2,12 @@
 /**
  * @brief DataStore 的具备协程能力的装饰器类型。
  * @attention 除了定义变量语句和 Update() 以外，其他的操作都需要在协程中调用。
+ *   在 handler 中使用时，请通过 ObjectProcessor::set_coroutine_schedule() 让每个请求运行在协程中。
  */
 class CoroutinueDataStore:public Updateable
 {
 public:
-	CoroutinueDataStore(DataStore* data_store, CoroutinueDataStore* schdule);
+	CoroutinueDataStore(DataStore* data_store, pebble::CoroutineSchedule* schdule);
 	virtual ~CoroutinueDataStore();
 	
 	int Init(Config* config, std::string* err_msg);
@@ -39,6 +40,6 @@ public:
 protected:
 private:
 	DataStore* data_store_;
-	CoroutinueSchdule* schdule_;
+	pebble::CoroutineSchedule* schdule_;
 	
 };
\ No newline at end of file
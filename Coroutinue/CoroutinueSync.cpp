@@ -0,0 +1,109 @@
+/*
+ * Tencent is pleased to support the open source community by making Pebble available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License
+ * is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express
+ * or implied. See the License for the specific language governing permissions and limitations under
+ * the License.
+ *
+ */
+
+
+#include "CoroutinueSync.h"
+
+namespace pebble {
+
+CoMutex::CoMutex() : locked_(false) {
+}
+
+int32_t CoMutex::Lock(int timeout_ms) {
+    if (!locked_) {
+        locked_ = true;
+        return 0;
+    }
+    // 被唤醒时锁已经由Unlock转交过来，locked_保持为true
+    return co_wait(&waiters_, timeout_ms);
+}
+
+bool CoMutex::TryLock() {
+    if (locked_) {
+        return false;
+    }
+    locked_ = true;
+    return true;
+}
+
+void CoMutex::LockUninterruptible() {
+    if (!locked_) {
+        locked_ = true;
+        return;
+    }
+    // 被其他方式提前恢复时锁还没有转交过来，重新排队
+    while (co_wait_uninterruptible(&waiters_) != 0) {
+        if (!locked_) {
+            locked_ = true;
+            return;
+        }
+    }
+}
+
+void CoMutex::Unlock() {
+    if (co_notify_one(&waiters_) == INVALID_CO_ID) {
+        locked_ = false;
+    }
+}
+
+int32_t CoCondVar::Wait(CoMutex* mutex, int timeout_ms) {
+    // 不在协程中时无法等待重新加锁，解锁前就返回
+    if (co_self() == NULL) {
+        return kCO_NOT_IN_COROUTINE;
+    }
+    mutex->Unlock();
+    int32_t ret = co_wait(&waiters_, timeout_ms);
+    mutex->LockUninterruptible();
+    return ret;
+}
+
+int32_t CoCondVar::Wait(int timeout_ms) {
+    return co_wait(&waiters_, timeout_ms);
+}
+
+void CoCondVar::NotifyOne() {
+    co_notify_one(&waiters_);
+}
+
+void CoCondVar::NotifyAll() {
+    co_notify_all(&waiters_);
+}
+
+CoSemaphore::CoSemaphore(int64_t count) : count_(count) {
+}
+
+int32_t CoSemaphore::Acquire(int timeout_ms) {
+    if (count_ > 0) {
+        count_--;
+        return 0;
+    }
+    // 被唤醒时计数已经由Release直接转交
+    return co_wait(&waiters_, timeout_ms);
+}
+
+bool CoSemaphore::TryAcquire() {
+    if (count_ <= 0) {
+        return false;
+    }
+    count_--;
+    return true;
+}
+
+void CoSemaphore::Release(int64_t count) {
+    while (count > 0 && co_notify_one(&waiters_) != INVALID_CO_ID) {
+        count--;
+    }
+    count_ += count;
+}
+
+} // namespace pebble
@@ -0,0 +1,249 @@
+/*
+ * Tencent is pleased to support the open source community by making Pebble available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License
+ * is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express
+ * or implied. See the License for the specific language governing permissions and limitations under
+ * the License.
+ *
+ */
+
+
+#ifndef _PEBBLE_COMMON_COROUTINE_SYNC_H_
+#define _PEBBLE_COMMON_COROUTINE_SYNC_H_
+
+#include <deque>
+
+#include "common/coroutine.h"
+
+
+namespace pebble {
+
+// 协程同步原语
+//
+// 等待时只挂起当前协程，线程继续调度其他协程；唤醒的协程放入就绪队列，在下一次co_update中恢复。
+// 都不使用系统锁，只能在同一个线程(同一个调度器)的协程之间使用，跨线程请使用CoWorkerPool提交任务。
+// 协程中使用pthread_mutex等系统锁会阻塞整个线程上的所有协程，甚至在锁的持有者也是本线程的协程时死锁。
+
+/// @brief 类:CoMutex 协程互斥锁
+/// @note 解锁时直接把锁交给等待最久的协程，不会被后来的协程插队
+class CoMutex {
+public:
+    CoMutex();
+
+    /// @brief 加锁，锁被其他协程持有时挂起等待
+    /// @param timeout_ms 超时时间，<0表示一直等待
+    /// @return 0 成功，kCO_TIMEOUT 超时，kCO_NOT_IN_COROUTINE 需要等待但不在协程中
+    int32_t Lock(int timeout_ms = -1);
+
+    /// @brief 尝试加锁，不等待，可以在主循环中调用
+    bool TryLock();
+
+    /// @brief 解锁，有协程在等待时直接转交给队列头部的协程
+    void Unlock();
+
+    inline bool locked() const {
+        return locked_;
+    }
+
+private:
+    friend class CoCondVar;
+
+    // 一直等到拿到锁，不受截止时间和取消令牌影响
+    void LockUninterruptible();
+
+    bool locked_;
+    co_wait_queue waiters_;
+};
+
+/// @brief 类:CoLockGuard 作用域内持有CoMutex
+/// @note 协程被取消、超过截止时间或被其他方式恢复时Lock会失败，必须检查owns_lock()，
+///   没有拿到锁时析构也不会解锁
+class CoLockGuard {
+public:
+    explicit CoLockGuard(CoMutex* mutex, int timeout_ms = -1)
+        : mutex_(mutex), owns_(mutex->Lock(timeout_ms) == 0) {
+    }
+    ~CoLockGuard() {
+        if (owns_) {
+            mutex_->Unlock();
+        }
+    }
+
+    inline bool owns_lock() const {
+        return owns_;
+    }
+
+private:
+    CoLockGuard(const CoLockGuard&);
+    CoLockGuard& operator=(const CoLockGuard&);
+
+    CoMutex* mutex_;
+    bool owns_;
+};
+
+/// @brief 类:CoCondVar 协程条件变量
+class CoCondVar {
+public:
+    /// @brief 解锁mutex并挂起，被唤醒或超时后重新加锁再返回
+    /// @param mutex 调用者已经持有的锁
+    /// @param timeout_ms 超时时间，<0表示一直等待
+    /// @return 0 被唤醒，kCO_TIMEOUT 超时(包括被取消)，kCO_NOT_IN_COROUTINE 不在协程中，此时不会解锁
+    /// @note 与pthread_cond_wait一样，醒来后需要重新检查条件；无论返回什么，返回时都持有mutex，
+    ///   重新加锁不受截止时间和取消令牌影响
+    int32_t Wait(CoMutex* mutex, int timeout_ms = -1);
+
+    /// @brief 在不持有锁的情况下等待，单线程调度下检查条件和挂起之间不会被其他协程打断
+    int32_t Wait(int timeout_ms = -1);
+
+    void NotifyOne();
+
+    void NotifyAll();
+
+private:
+    co_wait_queue waiters_;
+};
+
+/// @brief 类:CoSemaphore 协程信号量
+class CoSemaphore {
+public:
+    explicit CoSemaphore(int64_t count = 0);
+
+    /// @brief 获取一个计数，计数为0时挂起等待
+    /// @param timeout_ms 超时时间，<0表示一直等待
+    /// @return 0 成功，kCO_TIMEOUT 超时，kCO_NOT_IN_COROUTINE 需要等待但不在协程中
+    int32_t Acquire(int timeout_ms = -1);
+
+    /// @brief 尝试获取一个计数，不等待
+    bool TryAcquire();
+
+    /// @brief 释放计数，有协程在等待时直接转交给它们
+    void Release(int64_t count = 1);
+
+    inline int64_t count() const {
+        return count_;
+    }
+
+private:
+    int64_t count_;
+    co_wait_queue waiters_;
+};
+
+/// @brief 类:CoChannel 有界的协程消息队列
+///
+/// 队列满时Send挂起，队列空时Recv挂起。Close之后不能再发送，接收方取完剩余的消息后返回kCO_CHANNEL_CLOSED
+template<typename T>
+class CoChannel {
+public:
+    /// @param capacity 队列容量，至少为1
+    explicit CoChannel(size_t capacity)
+        : capacity_(capacity > 0 ? capacity : 1), closed_(false) {
+    }
+
+    /// @brief 发送一个消息，队列满时挂起等待
+    /// @param timeout_ms 超时时间，<0表示一直等待
+    /// @return 0 成功，kCO_TIMEOUT 超时，kCO_CHANNEL_CLOSED 已关闭，kCO_NOT_IN_COROUTINE 需要等待但不在协程中
+    int32_t Send(const T& value, int timeout_ms = -1) {
+        unsigned long long deadline = timeout_ms < 0 ? 0 : co_clock_ms() + timeout_ms;
+        while (!closed_ && queue_.size() >= capacity_) {
+            int wait_ms = Remaining(timeout_ms, deadline);
+            if (wait_ms == 0) {
+                return kCO_TIMEOUT;
+            }
+            int32_t ret = co_wait(&send_waiters_, wait_ms);
+            if (ret != 0 && ret != kCO_TIMEOUT) {
+                return ret;
+            }
+        }
+        if (closed_) {
+            return kCO_CHANNEL_CLOSED;
+        }
+        queue_.push_back(value);
+        co_notify_one(&recv_waiters_);
+        return 0;
+    }
+
+    /// @brief 尝试发送，队列满或已关闭时返回false
+    bool TrySend(const T& value) {
+        if (closed_ || queue_.size() >= capacity_) {
+            return false;
+        }
+        queue_.push_back(value);
+        co_notify_one(&recv_waiters_);
+        return true;
+    }
+
+    /// @brief 接收一个消息，队列空时挂起等待
+    /// @param value 输出参数
+    /// @param timeout_ms 超时时间，<0表示一直等待
+    /// @return 0 成功，kCO_TIMEOUT 超时，kCO_CHANNEL_CLOSED 已关闭并且没有剩余消息
+    int32_t Recv(T* value, int timeout_ms = -1) {
+        unsigned long long deadline = timeout_ms < 0 ? 0 : co_clock_ms() + timeout_ms;
+        while (!closed_ && queue_.empty()) {
+            int wait_ms = Remaining(timeout_ms, deadline);
+            if (wait_ms == 0) {
+                return kCO_TIMEOUT;
+            }
+            int32_t ret = co_wait(&recv_waiters_, wait_ms);
+            if (ret != 0 && ret != kCO_TIMEOUT) {
+                return ret;
+            }
+        }
+        if (queue_.empty()) {
+            return kCO_CHANNEL_CLOSED;
+        }
+        *value = queue_.front();
+        queue_.pop_front();
+        co_notify_one(&send_waiters_);
+        return 0;
+    }
+
+    /// @brief 尝试接收，队列空时返回false
+    bool TryRecv(T* value) {
+        if (queue_.empty()) {
+            return false;
+        }
+        *value = queue_.front();
+        queue_.pop_front();
+        co_notify_one(&send_waiters_);
+        return true;
+    }
+
+    /// @brief 关闭channel，唤醒所有等待的协程
+    void Close() {
+        closed_ = true;
+        co_notify_all(&send_waiters_);
+        co_notify_all(&recv_waiters_);
+    }
+
+    inline size_t size() const {
+        return queue_.size();
+    }
+
+    inline bool closed() const {
+        return closed_;
+    }
+
+private:
+    // 醒来后条件可能又被其他协程改变，重新等待时只等剩余的时间
+    static int Remaining(int timeout_ms, unsigned long long deadline) {
+        if (timeout_ms < 0) {
+            return -1;
+        }
+        unsigned long long now = co_clock_ms();
+        return now >= deadline ? 0 : static_cast<int>(deadline - now);
+    }
+
+    size_t capacity_;
+    bool closed_;
+    std::deque<T> queue_;
+    co_wait_queue send_waiters_;
+    co_wait_queue recv_waiters_;
+};
+
+} // namespace pebble
+
+#endif  // _PEBBLE_COMMON_COROUTINE_SYNC_H_
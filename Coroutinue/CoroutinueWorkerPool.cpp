@@ -0,0 +1,261 @@
+/*
+ * Tencent is pleased to support the open source community by making Pebble available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License
+ * is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express
+ * or implied. See the License for the specific language governing permissions and limitations under
+ * the License.
+ *
+ */
+
+
+#include <string.h>
+
+#include "CoroutinueWorkerPool.h"
+#include "common/log.h"
+
+namespace pebble {
+
+// 每轮循环最多启动的任务数，避免大量新任务让已有协程的事件和超时得不到处理
+static const int kMaxStartPerLoop = 64;
+
+static __thread int g_current_worker = -1;
+
+CoWorkerPool::CoWorkerPool()
+        : stack_size_(0),
+          share_stack_num_(0),
+          stop_(false),
+          next_worker_(0),
+          pending_num_(0) {
+}
+
+CoWorkerPool::~CoWorkerPool() {
+    Stop();
+}
+
+int CoWorkerPool::Start(int worker_num, uint32_t stack_size, int32_t share_stack_num) {
+    if (worker_num <= 0 || !workers_.empty()) {
+        return kCO_INVALID_PARAM;
+    }
+    stack_size_ = stack_size;
+    share_stack_num_ = share_stack_num;
+    stop_ = false;
+
+    for (int i = 0; i < worker_num; i++) {
+        Worker* worker = new Worker;
+        worker->pool = this;
+        worker->index = i;
+        worker->stolen_num = 0;
+        worker->schedule = NULL;
+        worker->notified = false;
+        worker->sleeping = false;
+        pthread_mutex_init(&worker->mutex, NULL);
+        workers_.push_back(worker);
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++) {
+        int ret = pthread_create(&workers_[i]->thread, NULL, WorkerMain, workers_[i]);
+        if (ret != 0) {
+            PLOG_ERROR("create coroutine worker %zu failed : %s", i, strerror(ret));
+            Shutdown(i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void CoWorkerPool::Stop() {
+    Shutdown(workers_.size());
+}
+
+void CoWorkerPool::Shutdown(size_t started_num) {
+    __atomic_store_n(&stop_, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < started_num; i++) {
+        pthread_mutex_lock(&workers_[i]->mutex);
+        Wake(workers_[i]);
+        pthread_mutex_unlock(&workers_[i]->mutex);
+    }
+    for (size_t i = 0; i < started_num; i++) {
+        pthread_join(workers_[i]->thread, NULL);
+    }
+    for (size_t i = 0; i < workers_.size(); i++) {
+        pthread_mutex_destroy(&workers_[i]->mutex);
+        delete workers_[i];
+    }
+    workers_.clear();
+    pending_num_ = 0;
+}
+
+int CoWorkerPool::Submit(const cxx::function<void()>& task, int worker, bool stealable) {
+    if (workers_.empty() || __atomic_load_n(&stop_, __ATOMIC_ACQUIRE)) {
+        return kCO_INVALID_PARAM;
+    }
+    if (worker < 0) {
+        worker = __atomic_fetch_add(&next_worker_, 1, __ATOMIC_RELAXED) % workers_.size();
+    } else if (worker >= static_cast<int>(workers_.size())) {
+        return kCO_INVALID_PARAM;
+    }
+
+    Worker* w = workers_[worker];
+    __atomic_fetch_add(&pending_num_, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&w->mutex);
+    if (stealable) {
+        w->stealable.push_back(task);
+    } else {
+        w->pinned.push_back(task);
+    }
+    bool busy = !w->sleeping;
+    Wake(w);
+    pthread_mutex_unlock(&w->mutex);
+
+    // 目标线程正忙时再叫醒一个空闲的线程来窃取，空闲线程阻塞在co_update中不会自己来取
+    if (stealable && busy) {
+        for (size_t i = 1; i < workers_.size(); i++) {
+            Worker* idle = workers_[(worker + i) % workers_.size()];
+            pthread_mutex_lock(&idle->mutex);
+            bool woken = idle->sleeping;
+            if (woken) {
+                Wake(idle);
+            }
+            pthread_mutex_unlock(&idle->mutex);
+            if (woken) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+void CoWorkerPool::Wake(Worker* worker) {
+    if (worker->schedule != NULL && !worker->notified) {
+        worker->notified = true;
+        worker->schedule->Wakeup();
+    }
+}
+
+int64_t CoWorkerPool::pending_num() const {
+    return __atomic_load_n(&pending_num_, __ATOMIC_RELAXED);
+}
+
+int64_t CoWorkerPool::stolen_num() const {
+    int64_t num = 0;
+    for (size_t i = 0; i < workers_.size(); i++) {
+        num += __atomic_load_n(&workers_[i]->stolen_num, __ATOMIC_RELAXED);
+    }
+    return num;
+}
+
+int CoWorkerPool::CurrentWorker() {
+    return g_current_worker;
+}
+
+void* CoWorkerPool::WorkerMain(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    g_current_worker = worker->index;
+    worker->pool->Run(worker);
+    g_current_worker = -1;
+    return NULL;
+}
+
+void CoWorkerPool::Run(Worker* worker) {
+    // 协程环境按线程区分，每个工作线程都有自己的调度器、epoll和超时队列
+    CoroutineSchedule schedule;
+    if (schedule.Init(NULL, stack_size_, share_stack_num_) != 0) {
+        PLOG_ERROR("coroutine worker %d init schedule failed", worker->index);
+        return;
+    }
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->schedule = &schedule;
+    pthread_mutex_unlock(&worker->mutex);
+
+    cxx::function<void()> task;
+    while (!__atomic_load_n(&stop_, __ATOMIC_ACQUIRE)) {
+        // 先清除通知再取任务，取完之后的提交一定会再写一次eventfd
+        pthread_mutex_lock(&worker->mutex);
+        worker->notified = false;
+        worker->sleeping = false;
+        pthread_mutex_unlock(&worker->mutex);
+
+        int started = 0;
+        for (; started < kMaxStartPerLoop; started++) {
+            if (!PopLocal(worker, &task) && !Steal(worker, &task)) {
+                break;
+            }
+            __atomic_fetch_sub(&pending_num_, 1, __ATOMIC_RELAXED);
+            CommonCoroutineTask* co_task = schedule.NewPooledTask<CommonCoroutineTask>();
+            if (co_task == NULL) {
+                PLOG_ERROR("coroutine worker %d create task failed, run it outside coroutine",
+                    worker->index);
+                task();
+                continue;
+            }
+            co_task->Init(task);
+            if (co_task->Start(true) < 0) {
+                PLOG_ERROR("coroutine worker %d start task failed, run it outside coroutine",
+                    worker->index);
+                schedule.ReleaseTask(co_task);
+                task();
+            }
+        }
+
+        // 任务没有取完时不阻塞，只处理已经就绪的事件；否则一直等到有事件、协程超时或者被Submit唤醒
+        if (started == kMaxStartPerLoop) {
+            co_update(0);
+            continue;
+        }
+        pthread_mutex_lock(&worker->mutex);
+        worker->sleeping = !worker->notified;
+        pthread_mutex_unlock(&worker->mutex);
+        co_update(-1);
+    }
+
+    pthread_mutex_lock(&worker->mutex);
+    worker->schedule = NULL;
+    pthread_mutex_unlock(&worker->mutex);
+    schedule.Close();
+}
+
+bool CoWorkerPool::PopLocal(Worker* worker, cxx::function<void()>* task) {
+    bool found = false;
+    pthread_mutex_lock(&worker->mutex);
+    if (!worker->pinned.empty()) {
+        task->swap(worker->pinned.front());
+        worker->pinned.pop_front();
+        found = true;
+    } else if (!worker->stealable.empty()) {
+        // 本线程从尾部取，刚提交的任务数据还在缓存中
+        task->swap(worker->stealable.back());
+        worker->stealable.pop_back();
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->mutex);
+    return found;
+}
+
+bool CoWorkerPool::Steal(Worker* worker, cxx::function<void()>* task) {
+    size_t num = workers_.size();
+    for (size_t i = 1; i < num; i++) {
+        Worker* victim = workers_[(worker->index + i) % num];
+        if (pthread_mutex_trylock(&victim->mutex) != 0) {
+            continue;
+        }
+        bool found = false;
+        if (!victim->stealable.empty()) {
+            task->swap(victim->stealable.front());
+            victim->stealable.pop_front();
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->mutex);
+        if (found) {
+            __atomic_fetch_add(&worker->stolen_num, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace pebble
@@ -0,0 +1,114 @@
+/*
+ * Tencent is pleased to support the open source community by making Pebble available.
+ * Copyright (C) 2016 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the MIT License (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ * http://opensource.org/licenses/MIT
+ * Unless required by applicable law or agreed to in writing, software distributed under the License
+ * is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express
+ * or implied. See the License for the specific language governing permissions and limitations under
+ * the License.
+ *
+ */
+
+
+#ifndef _PEBBLE_COMMON_COROUTINE_WORKER_POOL_H_
+#define _PEBBLE_COMMON_COROUTINE_WORKER_POOL_H_
+
+#include <deque>
+#include <pthread.h>
+#include <vector>
+
+#include "common/coroutine.h"
+
+
+namespace pebble {
+
+/// @brief 类:CoWorkerPool 多线程协程调度
+///
+/// 启动多个工作线程，每个线程有自己的CoroutineSchedule、epoll和超时队列，
+/// 提交的任务在工作线程上以协程方式运行，可以使用Yield和被hook的系统调用。\n
+/// 任务默认固定在提交时指定(或轮流选择)的线程上运行；标记为可窃取的任务在本线程忙碌时
+/// 可以被空闲线程取走运行，适合寻路、掉落计算这类只依赖参数的CPU密集任务。
+/// 没有任务时工作线程阻塞在co_update中不占用CPU，Submit会通过调度器的eventfd立即唤醒它。
+/// @note 只有还未开始运行的任务会被窃取，协程一旦开始运行就一直留在同一个线程上：
+///   协程栈上的地址、注册在本线程epoll中的事件以及线程局部变量都不能跨线程迁移
+class CoWorkerPool {
+public:
+    CoWorkerPool();
+
+    /// @brief 析构时会停止所有工作线程
+    ~CoWorkerPool();
+
+    /// @brief 启动工作线程
+    /// @param worker_num 工作线程数量
+    /// @param stack_size 协程栈大小，@see CoroutineSchedule::Init
+    /// @param share_stack_num 每个工作线程的共享栈数量，@see CoroutineSchedule::Init
+    /// @return 0 成功，其他值失败
+    int Start(int worker_num, uint32_t stack_size = 256 * 1024, int32_t share_stack_num = 0);
+
+    /// @brief 停止所有工作线程，还未开始运行的任务被丢弃，还未结束的协程被强制清理
+    /// @note 不能与Submit同时调用
+    void Stop();
+
+    /// @brief 提交一个任务，线程安全
+    /// @param task 任务的执行体，在工作线程的协程中运行
+    /// @param worker 指定运行的工作线程，<0时轮流选择
+    /// @param stealable 是否允许被其他空闲线程窃取运行，访问线程局部数据的任务必须为false
+    /// @return 0 成功，其他值失败
+    int Submit(const cxx::function<void()>& task, int worker = -1, bool stealable = false);
+
+    /// @brief 工作线程数量
+    inline int worker_num() const {
+        return static_cast<int>(workers_.size());
+    }
+
+    /// @brief 已提交还未开始运行的任务数量
+    int64_t pending_num() const;
+
+    /// @brief 被其他线程窃取运行的任务总数
+    int64_t stolen_num() const;
+
+    /// @brief 返回当前线程所属的工作线程下标，不在工作线程中返回-1
+    static int CurrentWorker();
+
+private:
+    struct Worker {
+        CoWorkerPool* pool;
+        int index;
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        std::deque<cxx::function<void()> > pinned;      // 只能在本线程运行的任务
+        std::deque<cxx::function<void()> > stealable;   // 本线程从尾部取，其他线程从头部窃取
+        int64_t stolen_num;
+        CoroutineSchedule* schedule;    // 工作线程运行期间有效，受mutex保护，用来唤醒它
+        bool notified;                  // 已经唤醒还没有取任务，避免每次提交都写eventfd
+        bool sleeping;                  // 没有任务，正阻塞在co_update中
+    };
+
+    // 唤醒阻塞在co_update中的工作线程，调用者持有worker->mutex
+    static void Wake(Worker* worker);
+
+    // 通知并等待前started_num个已经启动的线程退出，然后释放所有工作线程的数据
+    void Shutdown(size_t started_num);
+
+    static void* WorkerMain(void* arg);
+    void Run(Worker* worker);
+
+    // 取本线程的任务，固定任务优先
+    bool PopLocal(Worker* worker, cxx::function<void()>* task);
+
+    // 从其他线程窃取一个可窃取的任务，使用trylock，不和忙碌的线程争抢锁
+    bool Steal(Worker* worker, cxx::function<void()>* task);
+
+    std::vector<Worker*> workers_;
+    uint32_t stack_size_;
+    int32_t share_stack_num_;
+    bool stop_;
+    uint32_t next_worker_;
+    int64_t pending_num_;
+};
+
+} // namespace pebble
+
+#endif  // _PEBBLE_COMMON_COROUTINE_WORKER_POOL_H_
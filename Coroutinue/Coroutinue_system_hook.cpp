@@ -14,12 +14,17 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -42,6 +47,9 @@ struct rpchook_t
 
     struct timeval read_timeout;
     struct timeval write_timeout;
+
+    stCoFdEvent_t *fd_event;    // 第一次需要等待时注册到epoll，close时释放
+    int in_use;                 // 记录直接放在fd表中，用它代替空指针表示fd是否被hook
 };
 
 static inline pid_t GetPid()
@@ -49,14 +57,52 @@ static inline pid_t GetPid()
     char **p = reinterpret_cast<char**>(pthread_self());
     return p ? *reinterpret_cast<pid_t*>(p + 18) : getpid();
 }
-static rpchook_t *g_rpchook_socket_fd[ 102400 ] = { 0 };
+// 两级fd表：第一级固定大小，第二级每块1024个记录，fd第一次出现时才分配所在的块，
+// 共支持4M个fd。块一旦分配就不再释放，读取不需要加锁；多个线程同时分配同一块时用CAS决定
+enum {
+    kFdChunkBits = 10,
+    kFdChunkSize = 1 << kFdChunkBits,
+    kFdChunkNum  = 4096,
+};
+static rpchook_t *g_rpchook_fd_table[ kFdChunkNum ] = { 0 };
+
+static inline rpchook_t* get_fd_record(int fd, bool create)
+{
+    if (fd < 0 || fd >= kFdChunkNum * kFdChunkSize) {
+        return NULL;
+    }
+    rpchook_t **slot = g_rpchook_fd_table + (fd >> kFdChunkBits);
+    rpchook_t *chunk = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (!chunk) {
+        if (!create) {
+            return NULL;
+        }
+        rpchook_t *fresh = reinterpret_cast<rpchook_t*>(calloc(kFdChunkSize, sizeof(rpchook_t)));
+        if (!fresh) {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(slot, &chunk, fresh, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            chunk = fresh;
+        } else {
+            free(fresh);
+        }
+    }
+    return chunk + (fd & (kFdChunkSize - 1));
+}
 
 typedef int (*socket_pfn_t)(int domain, int type, int protocol);
 typedef int (*connect_pfn_t)(int socket, const struct sockaddr *address, socklen_t address_len);
+typedef int (*accept_pfn_t)(int socket, struct sockaddr *address, socklen_t *address_len);
 typedef int (*close_pfn_t)(int fd);
 
 typedef ssize_t (*read_pfn_t)(int fildes, void *buf, size_t nbyte);
 typedef ssize_t (*write_pfn_t)(int fildes, const void *buf, size_t nbyte);
+typedef ssize_t (*readv_pfn_t)(int fildes, const struct iovec *iov, int iovcnt);
+typedef ssize_t (*writev_pfn_t)(int fildes, const struct iovec *iov, int iovcnt);
+typedef ssize_t (*pread_pfn_t)(int fildes, void *buf, size_t nbyte, off_t offset);
+typedef ssize_t (*pwrite_pfn_t)(int fildes, const void *buf, size_t nbyte, off_t offset);
+typedef int (*fsync_pfn_t)(int fildes);
 
 typedef ssize_t (*sendto_pfn_t)(int socket, const void *message, size_t length,
                 int flags, const struct sockaddr *dest_addr,
@@ -68,8 +114,15 @@ typedef ssize_t (*recvfrom_pfn_t)(int socket, void *buffer, size_t length,
 
 typedef size_t (*send_pfn_t)(int socket, const void *buffer, size_t length, int flags);
 typedef ssize_t (*recv_pfn_t)(int socket, void *buffer, size_t length, int flags);
+typedef ssize_t (*sendmsg_pfn_t)(int socket, const struct msghdr *message, int flags);
+typedef ssize_t (*recvmsg_pfn_t)(int socket, struct msghdr *message, int flags);
 
 typedef int (*poll_pfn_t)(struct pollfd fds[], nfds_t nfds, int timeout);
+typedef int (*epoll_wait_pfn_t)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+typedef int (*nanosleep_pfn_t)(const struct timespec *req, struct timespec *rem);
+typedef int (*usleep_pfn_t)(useconds_t usec);
+typedef unsigned int (*sleep_pfn_t)(unsigned int seconds);
+typedef struct hostent *(*gethostbyname_pfn_t)(const char *name);
 typedef int (*setsockopt_pfn_t)(int socket, int level, int option_name,
                 const void *option_value, socklen_t option_len);
 
@@ -85,18 +138,32 @@ typedef int (*pthread_rwlock_unlock_pfn_t)(pthread_rwlock_t *rwlock);
 
 static socket_pfn_t g_sys_socket_func     = (socket_pfn_t)dlsym(RTLD_NEXT, "socket");
 static connect_pfn_t g_sys_connect_func = (connect_pfn_t)dlsym(RTLD_NEXT, "connect");
+static accept_pfn_t g_sys_accept_func     = (accept_pfn_t)dlsym(RTLD_NEXT, "accept");
 static close_pfn_t g_sys_close_func     = (close_pfn_t)dlsym(RTLD_NEXT, "close");
 
 static read_pfn_t g_sys_read_func         = (read_pfn_t)dlsym(RTLD_NEXT, "read");
 static write_pfn_t g_sys_write_func     = (write_pfn_t)dlsym(RTLD_NEXT, "write");
+static readv_pfn_t g_sys_readv_func     = (readv_pfn_t)dlsym(RTLD_NEXT, "readv");
+static writev_pfn_t g_sys_writev_func     = (writev_pfn_t)dlsym(RTLD_NEXT, "writev");
+static pread_pfn_t g_sys_pread_func     = (pread_pfn_t)dlsym(RTLD_NEXT, "pread");
+static pwrite_pfn_t g_sys_pwrite_func     = (pwrite_pfn_t)dlsym(RTLD_NEXT, "pwrite");
+static fsync_pfn_t g_sys_fsync_func     = (fsync_pfn_t)dlsym(RTLD_NEXT, "fsync");
 
 static sendto_pfn_t g_sys_sendto_func     = (sendto_pfn_t)dlsym(RTLD_NEXT, "sendto");
 static recvfrom_pfn_t g_sys_recvfrom_func = (recvfrom_pfn_t)dlsym(RTLD_NEXT, "recvfrom");
 
 static send_pfn_t g_sys_send_func         = (send_pfn_t)dlsym(RTLD_NEXT, "send");
 static recv_pfn_t g_sys_recv_func         = (recv_pfn_t)dlsym(RTLD_NEXT, "recv");
+static sendmsg_pfn_t g_sys_sendmsg_func   = (sendmsg_pfn_t)dlsym(RTLD_NEXT, "sendmsg");
+static recvmsg_pfn_t g_sys_recvmsg_func   = (recvmsg_pfn_t)dlsym(RTLD_NEXT, "recvmsg");
 
 static poll_pfn_t g_sys_poll_func         = (poll_pfn_t)dlsym(RTLD_NEXT, "poll");
+static epoll_wait_pfn_t g_sys_epoll_wait_func = (epoll_wait_pfn_t)dlsym(RTLD_NEXT, "epoll_wait");
+static nanosleep_pfn_t g_sys_nanosleep_func = (nanosleep_pfn_t)dlsym(RTLD_NEXT, "nanosleep");
+static usleep_pfn_t g_sys_usleep_func     = (usleep_pfn_t)dlsym(RTLD_NEXT, "usleep");
+static sleep_pfn_t g_sys_sleep_func       = (sleep_pfn_t)dlsym(RTLD_NEXT, "sleep");
+static gethostbyname_pfn_t g_sys_gethostbyname_func
+                                        = (gethostbyname_pfn_t)dlsym(RTLD_NEXT, "gethostbyname");
 
 static setsockopt_pfn_t g_sys_setsockopt_func
                                         = (setsockopt_pfn_t)dlsym(RTLD_NEXT, "setsockopt");
@@ -124,39 +191,170 @@ static inline int64_t diff_ms(const struct timeval &begin, const struct timeval
 
 static inline rpchook_t* get_by_fd(int fd)
 {
-    int array_size = sizeof(g_rpchook_socket_fd) / sizeof(g_rpchook_socket_fd[0]);
-    if (fd > -1 && fd < array_size) {
-        return g_rpchook_socket_fd[fd];
+    rpchook_t *lp = get_fd_record(fd, false);
+    if (lp && __atomic_load_n(&lp->in_use, __ATOMIC_ACQUIRE)) {
+        return lp;
     }
     return NULL;
 }
 
+// 同一个fd同一时刻只属于一个线程，记录本身不需要加锁，in_use保证其他线程看到完整的记录
 static inline rpchook_t* alloc_by_fd(int fd)
 {
-    int array_size = sizeof(g_rpchook_socket_fd) / sizeof(g_rpchook_socket_fd[0]);
-    if (fd > -1 && fd < array_size) {
-        rpchook_t *lp = reinterpret_cast<rpchook_t*>(calloc(1, sizeof(rpchook_t)));
+    rpchook_t *lp = get_fd_record(fd, true);
+    if (lp) {
+        memset(lp, 0, sizeof(rpchook_t));
         lp->read_timeout.tv_sec = 1;
         lp->write_timeout.tv_sec = 1;
-        g_rpchook_socket_fd[fd] = lp;
-        return lp;
+        __atomic_store_n(&lp->in_use, 1, __ATOMIC_RELEASE);
     }
-    return NULL;
+    return lp;
 }
 
 static inline void free_by_fd(int fd)
 {
-    int array_size = sizeof(g_rpchook_socket_fd) / sizeof(g_rpchook_socket_fd[0]);
-    if (fd > -1 && fd < array_size) {
-        rpchook_t *lp = g_rpchook_socket_fd[fd];
-        if (lp) {
-            g_rpchook_socket_fd[fd] = NULL;
-            free(lp);
-        }
+    rpchook_t *lp = get_by_fd(fd);
+    if (lp) {
+        co_fd_event_free(lp->fd_event);
+        lp->fd_event = NULL;
+        __atomic_store_n(&lp->in_use, 0, __ATOMIC_RELEASE);
     }
     return;
 }
 
+// 读写返回EAGAIN后等待fd就绪，返回值同poll，timeout从start开始计算。
+// fd第一次需要等待时以边缘触发的方式注册到本线程的epoll中，之后一直保留到close，
+// 每次等待只是挂起协程，不再有epoll_ctl的开销；注册失败时退回到co_poll
+static int wait_fd_ready(rpchook_t *lp, int fd, short events, int timeout,
+                         unsigned long long start)
+{
+    if (timeout >= 0) {
+        unsigned long long elapsed = co_clock_ms() - start;
+        if (elapsed >= static_cast<unsigned long long>(timeout)) {
+            return 0;
+        }
+        timeout -= static_cast<int>(elapsed);
+    }
+
+    if (!lp->fd_event) {
+        lp->fd_event = co_fd_event_alloc(fd);
+    }
+    if (lp->fd_event) {
+        return co_fd_wait(lp->fd_event, events, timeout);
+    }
+
+    struct pollfd pf;
+    memset(&pf, 0, sizeof(pf));
+    pf.fd = fd;
+    pf.events = (events | POLLERR | POLLHUP);
+    return co_poll(co_get_epoll_ct(), &pf, 1, timeout);
+}
+
+// 普通文件的读写对epoll来说总是就绪的，协程无法等待，只能放到后台线程中执行
+enum {
+    kFileRead,
+    kFileWrite,
+    kFileReadv,
+    kFileWritev,
+    kFilePread,
+    kFilePwrite,
+    kFileFsync,
+};
+
+struct file_io_req_t {
+    int op;
+    int fd;
+    void *buf;
+    const struct iovec *iov;
+    int iovcnt;
+    size_t nbyte;
+    off_t offset;
+
+    ssize_t ret;
+    int err;
+};
+
+static int g_file_io_offload = 0;
+
+void co_set_file_io_offload(bool enable)
+{
+    __atomic_store_n(&g_file_io_offload, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+// 被hook的socket有记录，其他fd只有在打开offload、不在共享栈上并且是普通文件时才需要放到后台
+static inline bool need_offload_file_io(int fd)
+{
+    if (!__atomic_load_n(&g_file_io_offload, __ATOMIC_RELAXED)
+        || !co_is_enable_sys_hook() || co_is_share_stack(co_self())) {
+        return false;
+    }
+    struct stat st;
+    return 0 == fstat(fd, &st) && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+}
+
+static void do_file_io(file_io_req_t *req)
+{
+    switch (req->op) {
+        case kFileRead:
+            req->ret = g_sys_read_func(req->fd, req->buf, req->nbyte);
+            break;
+        case kFileWrite:
+            req->ret = g_sys_write_func(req->fd, req->buf, req->nbyte);
+            break;
+        case kFileReadv:
+            req->ret = g_sys_readv_func(req->fd, req->iov, req->iovcnt);
+            break;
+        case kFileWritev:
+            req->ret = g_sys_writev_func(req->fd, req->iov, req->iovcnt);
+            break;
+        case kFilePread:
+            req->ret = g_sys_pread_func(req->fd, req->buf, req->nbyte, req->offset);
+            break;
+        case kFilePwrite:
+            req->ret = g_sys_pwrite_func(req->fd, req->buf, req->nbyte, req->offset);
+            break;
+        case kFileFsync:
+            req->ret = g_sys_fsync_func(req->fd);
+            break;
+    }
+    req->err = errno;
+}
+
+static ssize_t offload_file_io(int op, int fd, const void *buf, size_t nbyte,
+                               const struct iovec *iov, int iovcnt, off_t offset)
+{
+    file_io_req_t req;
+    memset(&req, 0, sizeof(req));
+    req.op = op;
+    req.fd = fd;
+    req.buf = const_cast<void*>(buf);
+    req.nbyte = nbyte;
+    req.iov = iov;
+    req.iovcnt = iovcnt;
+    req.offset = offset;
+    req.ret = -1;
+    req.err = EIO;
+
+    co_offload(cxx::bind(do_file_io, &req));
+    errno = req.err;
+    return req.ret;
+}
+
+// 记录新的socket，把它设置为非阻塞，与hook的fcntl(F_SETFL)相同只记录用户设置的标志
+static void hook_new_fd(int fd, int domain)
+{
+    rpchook_t *lp = alloc_by_fd(fd);
+    if (!lp) {
+        return;
+    }
+    lp->domain = domain;
+
+    int flag = g_sys_fcntl_func(fd, F_GETFL, 0);
+    if (flag >= 0 && 0 == g_sys_fcntl_func(fd, F_SETFL, flag | O_NONBLOCK)) {
+        lp->user_flag = flag;
+    }
+}
+
 int socket(int domain, int type, int protocol)
 {
     HOOK_SYS_FUNC(socket);
@@ -169,25 +367,49 @@ int socket(int domain, int type, int protocol)
         return fd;
     }
 
-    rpchook_t *lp = alloc_by_fd(fd);
-    lp->domain = domain;
-
-    fcntl(fd, F_SETFL, g_sys_fcntl_func(fd, F_GETFL, 0));
+    hook_new_fd(fd, domain);
 
     return fd;
 }
 
-int co_accept(int fd, struct sockaddr *addr, socklen_t *len)
+int accept(int fd, struct sockaddr *addr, socklen_t *len)
 {
-    int cli = accept(fd, addr, len);
-    if (cli < 0)
-    {
+    HOOK_SYS_FUNC(accept);
+
+    if (!co_is_enable_sys_hook()) {
+        return g_sys_accept_func(fd, addr, len);
+    }
+    rpchook_t *lp = get_by_fd(fd);
+
+    if (!lp || (O_NONBLOCK & lp->user_flag)) {
+        return g_sys_accept_func(fd, addr, len);
+    }
+    int timeout = (lp->read_timeout.tv_sec * 1000)
+                + (lp->read_timeout.tv_usec / 1000);
+
+    int cli = g_sys_accept_func(fd, addr, len);
+    if (cli < 0 && EAGAIN == errno) {
+        unsigned long long start = co_clock_ms();
+        int pollret = 1;
+        while (cli < 0 && EAGAIN == errno && pollret > 0) {
+            pollret = wait_fd_ready(lp, fd, POLLIN, timeout, start);
+            cli = g_sys_accept_func(fd, addr, len);
+        }
+    }
+    if (cli < 0) {
         return cli;
     }
-    // rpchook_t *lp = alloc_by_fd(cli);
+
+    // 新连接和监听socket一样交给协程调度
+    hook_new_fd(cli, lp->domain);
     return cli;
 }
 
+int co_accept(int fd, struct sockaddr *addr, socklen_t *len)
+{
+    return pebble::accept(fd, addr, len);
+}
+
 int connect(int fd, const struct sockaddr *address, socklen_t address_len)
 {
     HOOK_SYS_FUNC(connect);
@@ -234,6 +456,9 @@ ssize_t read(int fd, void *buf, size_t nbyte)
     }
     rpchook_t *lp = get_by_fd(fd);
 
+    if (!lp && need_offload_file_io(fd)) {
+        return offload_file_io(kFileRead, fd, buf, nbyte, NULL, 0, 0);
+    }
     if (!lp || (O_NONBLOCK & lp->user_flag)) {
         ssize_t ret = g_sys_read_func(fd, buf, nbyte);
         return ret;
@@ -241,13 +466,16 @@ ssize_t read(int fd, void *buf, size_t nbyte)
     int timeout = (lp->read_timeout.tv_sec * 1000)
                 + (lp->read_timeout.tv_usec / 1000);
 
-    struct pollfd pf = { 0 };
-    pf.fd = fd;
-    pf.events = (POLLIN | POLLERR | POLLHUP);
-
-    int pollret = poll(&pf, 1, timeout);
-
+    // 先直接读，只有EAGAIN时才挂起协程等待
     ssize_t readret = g_sys_read_func(fd, reinterpret_cast<char*>(buf), nbyte);
+    int pollret = 1;
+    if (readret < 0 && EAGAIN == errno) {
+        unsigned long long start = co_clock_ms();
+        while (readret < 0 && EAGAIN == errno && pollret > 0) {
+            pollret = wait_fd_ready(lp, fd, POLLIN, timeout, start);
+            readret = g_sys_read_func(fd, reinterpret_cast<char*>(buf), nbyte);
+        }
+    }
 
     if (readret < 0) {
         co_log_err("CO_ERR: read fd %d ret %ld errno %d poll ret %d timeout %d",
@@ -265,6 +493,9 @@ ssize_t write(int fd, const void *buf, size_t nbyte)
     }
     rpchook_t *lp = get_by_fd(fd);
 
+    if (!lp && need_offload_file_io(fd)) {
+        return offload_file_io(kFileWrite, fd, buf, nbyte, NULL, 0, 0);
+    }
     if (!lp || (O_NONBLOCK & lp->user_flag)) {
         ssize_t ret = g_sys_write_func(fd, buf, nbyte);
         return ret;
@@ -279,23 +510,158 @@ ssize_t write(int fd, const void *buf, size_t nbyte)
     if (writeret > 0) {
         wrotelen += writeret;
     }
+    unsigned long long start = co_clock_ms();
     while (wrotelen < nbyte) {
-
-        struct pollfd pf = {0};
-        pf.fd = fd;
-        pf.events = (POLLOUT | POLLERR | POLLHUP);
-        poll(&pf, 1, timeout);
+        // 只写了一部分说明发送缓冲区已满，与EAGAIN一样等待可写
+        if (writeret == 0 || (writeret < 0 && EAGAIN != errno)) {
+            break;
+        }
+        if (wait_fd_ready(lp, fd, POLLOUT, timeout, start) <= 0) {
+            break;
+        }
 
         writeret = g_sys_write_func(fd, (const char*)buf + wrotelen, nbyte - wrotelen);
 
-        if (writeret <= 0) {
-            break;
+        if (writeret > 0) {
+            wrotelen += writeret;
         }
-        wrotelen += writeret;
     }
     return wrotelen;
 }
 
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    HOOK_SYS_FUNC(readv);
+
+    if (!co_is_enable_sys_hook()) {
+        return g_sys_readv_func(fd, iov, iovcnt);
+    }
+    rpchook_t *lp = get_by_fd(fd);
+
+    if (!lp && need_offload_file_io(fd)) {
+        return offload_file_io(kFileReadv, fd, NULL, 0, iov, iovcnt, 0);
+    }
+    if (!lp || (O_NONBLOCK & lp->user_flag)) {
+        return g_sys_readv_func(fd, iov, iovcnt);
+    }
+    int timeout = (lp->read_timeout.tv_sec * 1000)
+                + (lp->read_timeout.tv_usec / 1000);
+
+    ssize_t readret = g_sys_readv_func(fd, iov, iovcnt);
+    if (readret < 0 && EAGAIN == errno) {
+        unsigned long long start = co_clock_ms();
+        int pollret = 1;
+        while (readret < 0 && EAGAIN == errno && pollret > 0) {
+            pollret = wait_fd_ready(lp, fd, POLLIN, timeout, start);
+            readret = g_sys_readv_func(fd, iov, iovcnt);
+        }
+    }
+    return readret;
+}
+
+// 跳过iovec中已经写出的n个字节
+static inline void advance_iov(struct iovec **iov, int *iovcnt, size_t n)
+{
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0 && n > 0) {
+        (*iov)->iov_base = reinterpret_cast<char*>((*iov)->iov_base) + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    HOOK_SYS_FUNC(writev);
+
+    if (!co_is_enable_sys_hook()) {
+        return g_sys_writev_func(fd, iov, iovcnt);
+    }
+    rpchook_t *lp = get_by_fd(fd);
+
+    if (!lp && need_offload_file_io(fd)) {
+        return offload_file_io(kFileWritev, fd, NULL, 0, iov, iovcnt, 0);
+    }
+    if (!lp || (O_NONBLOCK & lp->user_flag)) {
+        return g_sys_writev_func(fd, iov, iovcnt);
+    }
+    int timeout = (lp->write_timeout.tv_sec * 1000)
+                + (lp->write_timeout.tv_usec / 1000);
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    ssize_t writeret = g_sys_writev_func(fd, iov, iovcnt);
+    if (writeret >= static_cast<ssize_t>(total) || (writeret < 0 && EAGAIN != errno)) {
+        return writeret;
+    }
+
+    // 与write一样写完为止，只写了一部分时复制一份iovec，跳过已经写出的部分
+    size_t wrotelen = writeret > 0 ? writeret : 0;
+    struct iovec *rest_buf = reinterpret_cast<struct iovec*>(malloc(iovcnt * sizeof(struct iovec)));
+    if (!rest_buf) {
+        return writeret;
+    }
+    memcpy(rest_buf, iov, iovcnt * sizeof(struct iovec));
+    struct iovec *rest = rest_buf;
+    int rest_cnt = iovcnt;
+    advance_iov(&rest, &rest_cnt, wrotelen);
+
+    unsigned long long start = co_clock_ms();
+    while (wrotelen < total) {
+        if (writeret == 0 || (writeret < 0 && EAGAIN != errno)) {
+            break;
+        }
+        if (wait_fd_ready(lp, fd, POLLOUT, timeout, start) <= 0) {
+            break;
+        }
+
+        writeret = g_sys_writev_func(fd, rest, rest_cnt);
+
+        if (writeret > 0) {
+            wrotelen += writeret;
+            advance_iov(&rest, &rest_cnt, writeret);
+        }
+    }
+    free(rest_buf);
+
+    return wrotelen > 0 ? static_cast<ssize_t>(wrotelen) : writeret;
+}
+
+ssize_t pread(int fd, void *buf, size_t nbyte, off_t offset)
+{
+    HOOK_SYS_FUNC(pread);
+
+    if (need_offload_file_io(fd)) {
+        return offload_file_io(kFilePread, fd, buf, nbyte, NULL, 0, offset);
+    }
+    return g_sys_pread_func(fd, buf, nbyte, offset);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t nbyte, off_t offset)
+{
+    HOOK_SYS_FUNC(pwrite);
+
+    if (need_offload_file_io(fd)) {
+        return offload_file_io(kFilePwrite, fd, buf, nbyte, NULL, 0, offset);
+    }
+    return g_sys_pwrite_func(fd, buf, nbyte, offset);
+}
+
+int fsync(int fd)
+{
+    HOOK_SYS_FUNC(fsync);
+
+    if (need_offload_file_io(fd)) {
+        return offload_file_io(kFileFsync, fd, NULL, 0, NULL, 0, 0);
+    }
+    return g_sys_fsync_func(fd);
+}
+
 ssize_t sendto(int socket, const void *message, size_t length,
                int flags, const struct sockaddr *dest_addr,
                socklen_t dest_len)
@@ -316,12 +682,12 @@ ssize_t sendto(int socket, const void *message, size_t length,
         int timeout = (lp->write_timeout.tv_sec * 1000)
                     + (lp->write_timeout.tv_usec / 1000);
 
-        struct pollfd pf = {0};
-        pf.fd = socket;
-        pf.events = (POLLOUT | POLLERR | POLLHUP);
-        poll(&pf, 1, timeout);
-
-        ret = g_sys_sendto_func(socket, message, length, flags, dest_addr, dest_len);
+        unsigned long long start = co_clock_ms();
+        int pollret = 1;
+        while (ret < 0 && EAGAIN == errno && pollret > 0) {
+            pollret = wait_fd_ready(lp, socket, POLLOUT, timeout, start);
+            ret = g_sys_sendto_func(socket, message, length, flags, dest_addr, dest_len);
+        }
     }
     return ret;
 }
@@ -343,12 +709,15 @@ ssize_t recvfrom(int socket, void *buffer, size_t length,
     int timeout = (lp->read_timeout.tv_sec * 1000)
                 + (lp->read_timeout.tv_usec / 1000);
 
-    struct pollfd pf = {0};
-    pf.fd = socket;
-    pf.events = (POLLIN | POLLERR | POLLHUP);
-    poll(&pf, 1, timeout);
-
     ssize_t ret = g_sys_recvfrom_func(socket, buffer, length, flags, address, address_len);
+    if (ret < 0 && EAGAIN == errno) {
+        unsigned long long start = co_clock_ms();
+        int pollret = 1;
+        while (ret < 0 && EAGAIN == errno && pollret > 0) {
+            pollret = wait_fd_ready(lp, socket, POLLIN, timeout, start);
+            ret = g_sys_recvfrom_func(socket, buffer, length, flags, address, address_len);
+        }
+    }
     return ret;
 }
 
@@ -374,20 +743,21 @@ ssize_t send(int socket, const void *buffer, size_t length, int flags)
         wrotelen += writeret;
     }
 
+    unsigned long long start = co_clock_ms();
     while (wrotelen < length) {
-
-        struct pollfd pf = {0};
-        pf.fd = socket;
-        pf.events = (POLLOUT | POLLERR | POLLHUP);
-        poll(&pf, 1, timeout);
+        if (writeret == 0 || (writeret < 0 && EAGAIN != errno)) {
+            break;
+        }
+        if (wait_fd_ready(lp, socket, POLLOUT, timeout, start) <= 0) {
+            break;
+        }
 
         writeret = g_sys_send_func(socket,
                 (const char*)buffer + wrotelen, length - wrotelen, flags);
 
-        if (writeret <= 0) {
-            break;
+        if (writeret > 0) {
+            wrotelen += writeret;
         }
-        wrotelen += writeret;
     }
 
     return wrotelen;
@@ -408,13 +778,15 @@ ssize_t recv(int socket, void *buffer, size_t length, int flags)
     int timeout = (lp->read_timeout.tv_sec * 1000)
                 + (lp->read_timeout.tv_usec / 1000);
 
-    struct pollfd pf = {0};
-    pf.fd = socket;
-    pf.events = (POLLIN | POLLERR | POLLHUP);
-
-    int pollret = poll(&pf, 1, timeout);
-
     ssize_t readret = g_sys_recv_func(socket, buffer, length, flags);
+    int pollret = 1;
+    if (readret < 0 && EAGAIN == errno) {
+        unsigned long long start = co_clock_ms();
+        while (readret < 0 && EAGAIN == errno && pollret > 0) {
+            pollret = wait_fd_ready(lp, socket, POLLIN, timeout, start);
+            readret = g_sys_recv_func(socket, buffer, length, flags);
+        }
+    }
 
     if (readret < 0) {
         co_log_err("CO_ERR: read fd %d ret %ld errno %d poll ret %d timeout %d",
@@ -424,6 +796,61 @@ ssize_t recv(int socket, void *buffer, size_t length, int flags)
     return readret;
 }
 
+ssize_t sendmsg(int socket, const struct msghdr *message, int flags)
+{
+    HOOK_SYS_FUNC(sendmsg);
+
+    if (!co_is_enable_sys_hook()) {
+        return g_sys_sendmsg_func(socket, message, flags);
+    }
+    rpchook_t *lp = get_by_fd(socket);
+
+    if (!lp || (O_NONBLOCK & lp->user_flag)) {
+        return g_sys_sendmsg_func(socket, message, flags);
+    }
+
+    ssize_t ret = g_sys_sendmsg_func(socket, message, flags);
+    if (ret < 0 && EAGAIN == errno) {
+        int timeout = (lp->write_timeout.tv_sec * 1000)
+                    + (lp->write_timeout.tv_usec / 1000);
+
+        unsigned long long start = co_clock_ms();
+        int pollret = 1;
+        while (ret < 0 && EAGAIN == errno && pollret > 0) {
+            pollret = wait_fd_ready(lp, socket, POLLOUT, timeout, start);
+            ret = g_sys_sendmsg_func(socket, message, flags);
+        }
+    }
+    return ret;
+}
+
+ssize_t recvmsg(int socket, struct msghdr *message, int flags)
+{
+    HOOK_SYS_FUNC(recvmsg);
+
+    if (!co_is_enable_sys_hook()) {
+        return g_sys_recvmsg_func(socket, message, flags);
+    }
+    rpchook_t *lp = get_by_fd(socket);
+
+    if (!lp || (O_NONBLOCK & lp->user_flag)) {
+        return g_sys_recvmsg_func(socket, message, flags);
+    }
+    int timeout = (lp->read_timeout.tv_sec * 1000)
+                + (lp->read_timeout.tv_usec / 1000);
+
+    ssize_t ret = g_sys_recvmsg_func(socket, message, flags);
+    if (ret < 0 && EAGAIN == errno) {
+        unsigned long long start = co_clock_ms();
+        int pollret = 1;
+        while (ret < 0 && EAGAIN == errno && pollret > 0) {
+            pollret = wait_fd_ready(lp, socket, POLLIN, timeout, start);
+            ret = g_sys_recvmsg_func(socket, message, flags);
+        }
+    }
+    return ret;
+}
+
 int poll(struct pollfd fds[], nfds_t nfds, int timeout)
 {
     HOOK_SYS_FUNC(poll);
@@ -432,8 +859,175 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout)
         return g_sys_poll_func(fds, nfds, timeout);
     }
 
+    // 已经持久注册的fd不能再被co_poll加入同一个epoll：
+    // 只等一个fd时使用它的注册，先检查一次当前状态，没有就绪时边缘触发的通知不会遗漏；
+    // 同时等多个fd时先取消注册，下次读写需要等待时再注册
+    if (nfds == 1) {
+        rpchook_t *lp = get_by_fd(fds[0].fd);
+        if (lp && lp->fd_event) {
+            int ret = g_sys_poll_func(fds, nfds, 0);
+            unsigned long long start = co_clock_ms();
+            while (ret == 0 && timeout != 0) {
+                if (wait_fd_ready(lp, fds[0].fd, fds[0].events, timeout, start) <= 0) {
+                    break;
+                }
+                ret = g_sys_poll_func(fds, nfds, 0);
+            }
+            return ret;
+        }
+    } else {
+        for (nfds_t i = 0; i < nfds; i++) {
+            rpchook_t *lp = get_by_fd(fds[i].fd);
+            if (lp && lp->fd_event) {
+                co_fd_event_free(lp->fd_event);
+                lp->fd_event = NULL;
+            }
+        }
+    }
+
     return co_poll(co_get_epoll_ct(), fds, nfds, timeout);
 }
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    HOOK_SYS_FUNC(epoll_wait);
+
+    if (!co_is_enable_sys_hook() || 0 == timeout) {
+        return g_sys_epoll_wait_func(epfd, events, maxevents, timeout);
+    }
+
+    // epoll fd本身也可以被等待，其中有事件就绪时它变为可读
+    int ret = g_sys_epoll_wait_func(epfd, events, maxevents, 0);
+    if (ret != 0) {
+        return ret;
+    }
+    struct pollfd pf;
+    memset(&pf, 0, sizeof(pf));
+    pf.fd = epfd;
+    pf.events = POLLIN;
+    if (co_poll(co_get_epoll_ct(), &pf, 1, timeout) <= 0) {
+        return 0;
+    }
+    return g_sys_epoll_wait_func(epfd, events, maxevents, 0);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    HOOK_SYS_FUNC(nanosleep);
+
+    if (!co_is_enable_sys_hook() || !req) {
+        return g_sys_nanosleep_func(req, rem);
+    }
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000L) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // 超时队列的精度是1ms，不足1ms的部分向上取整
+    long long ms = req->tv_sec * 1000LL + (req->tv_nsec + 999999) / 1000000;
+    if (ms > INT_MAX) {
+        ms = INT_MAX;
+    }
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    co_poll(co_get_epoll_ct(), NULL, 0, static_cast<int>(ms));
+
+    // 协程的截止时间到达或被取消时提前返回，与被信号打断一样报告EINTR和没有睡完的时间
+    if (co_remaining_ms() != 0) {
+        return 0;
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long left = (req->tv_sec - (end.tv_sec - begin.tv_sec)) * 1000000000LL
+        + req->tv_nsec - (end.tv_nsec - begin.tv_nsec);
+    if (left <= 0) {
+        return 0;
+    }
+    if (rem) {
+        rem->tv_sec = left / 1000000000LL;
+        rem->tv_nsec = left % 1000000000LL;
+    }
+    errno = EINTR;
+    return -1;
+}
+
+int usleep(useconds_t usec)
+{
+    HOOK_SYS_FUNC(usleep);
+
+    if (!co_is_enable_sys_hook()) {
+        return g_sys_usleep_func(usec);
+    }
+    struct timespec req;
+    req.tv_sec = usec / 1000000;
+    req.tv_nsec = (usec % 1000000) * 1000;
+    return pebble::nanosleep(&req, NULL);
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+    HOOK_SYS_FUNC(sleep);
+
+    if (!co_is_enable_sys_hook()) {
+        return g_sys_sleep_func(seconds);
+    }
+    struct timespec req;
+    req.tv_sec = seconds;
+    req.tv_nsec = 0;
+    struct timespec rem;
+    if (pebble::nanosleep(&req, &rem) == 0) {
+        return 0;
+    }
+    // 与原函数一样返回没有睡完的秒数
+    return rem.tv_sec + (rem.tv_nsec > 0 ? 1 : 0);
+}
+
+// 解析结果放在堆上，后台线程写入时协程栈可能已经被换出(共享栈)
+struct dns_req_t {
+    char *name;
+    struct hostent host;
+    struct hostent *result;
+    int err;
+    char buf[8192];
+};
+
+static void do_gethostbyname(dns_req_t *req)
+{
+    int ret = gethostbyname_r(req->name, &req->host, req->buf, sizeof(req->buf),
+                              &req->result, &req->err);
+    if (ret != 0) {
+        req->result = NULL;
+    }
+}
+
+// 与原函数一样，返回的结果在本线程下一次gethostbyname完成时被覆盖
+static __thread dns_req_t *g_last_dns_req = NULL;
+
+struct hostent *gethostbyname(const char *name)
+{
+    HOOK_SYS_FUNC(gethostbyname);
+
+    if (!co_is_enable_sys_hook() || !name) {
+        return g_sys_gethostbyname_func(name);
+    }
+
+    dns_req_t *req = reinterpret_cast<dns_req_t*>(calloc(1, sizeof(dns_req_t)));
+    if (!req) {
+        return g_sys_gethostbyname_func(name);
+    }
+    req->name = strdup(name);
+    req->err = HOST_NOT_FOUND;
+    co_offload(cxx::bind(do_gethostbyname, req));
+
+    if (g_last_dns_req) {
+        free(g_last_dns_req->name);
+        free(g_last_dns_req);
+    }
+    g_last_dns_req = req;
+
+    h_errno = req->err;
+    return req->result;
+}
 int setsockopt(int fd, int level, int option_name,
                const void *option_value, socklen_t option_len)
 {
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <math.h>
+
+#include "ConsistentHashRouter.h"
+
+ConsistentHashRouter::ConsistentHashRouter(int virtual_nodes, double load_factor)
+	: virtual_nodes_(virtual_nodes > 0 ? virtual_nodes : 1),
+	  load_factor_(load_factor > 1.0 ? load_factor : 1.0),
+	  cache_(NULL),
+	  cache_size_(0)
+{
+	pthread_mutex_init(&mutex_, NULL);
+}
+
+ConsistentHashRouter::~ConsistentHashRouter()
+{
+	pthread_mutex_destroy(&mutex_);
+}
+
+uint64_t ConsistentHashRouter::HashString(const std::string& data, uint64_t seed)
+{
+	// FNV-1a 64
+	uint64_t h = 14695981039346656037ULL ^ seed;
+	for (size_t i = 0; i < data.size(); i++) {
+		h ^= static_cast<unsigned char>(data[i]);
+		h *= 1099511628211ULL;
+	}
+	return HashKey(h);
+}
+
+uint64_t ConsistentHashRouter::HashKey(uint64_t key)
+{
+	// splitmix64 的混淆步骤，连续的玩家 ID 也能均匀分布在环上
+	key += 0x9E3779B97F4A7C15ULL;
+	key = (key ^ (key >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	key = (key ^ (key >> 27)) * 0x94D049BB133111EBULL;
+	return key ^ (key >> 31);
+}
+
+void ConsistentHashRouter::RouteToSevice(const ContractCache& cache, std::string* content,
+                                         void* route_param)
+{
+	if (route_param == NULL) {
+		Router::RouteToSevice(cache, content, route_param);
+		return;
+	}
+
+	uint64_t route_key = *static_cast<uint64_t*>(route_param);
+
+	pthread_mutex_lock(&mutex_);
+	// 每次调用都哈希所有合同代价太高，只比较集合的地址和数量，其他变化由 Rebuild() 通知
+	if (CacheChanged(cache)) {
+		RebuildRing(cache);
+	}
+	if (!members_.empty()) {
+		std::map<uint64_t, int>::iterator pos = assigned_.find(route_key);
+		if (pos != assigned_.end()) {
+			*content = members_[pos->second];
+		} else {
+			int index = PickMember(route_key);
+			loads_[index]++;
+			assigned_[route_key] = index;
+			*content = members_[index];
+		}
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+void ConsistentHashRouter::Rebuild(const ContractCache& cache)
+{
+	pthread_mutex_lock(&mutex_);
+	RebuildRing(cache);
+	pthread_mutex_unlock(&mutex_);
+}
+
+bool ConsistentHashRouter::CacheChanged(const ContractCache& cache) const
+{
+	return &cache != cache_ || cache.size() != cache_size_;
+}
+
+void ConsistentHashRouter::RebuildRing(const ContractCache& cache)
+{
+	std::vector<std::string> members;
+	for (ContractCache::const_iterator it = cache.begin(); it != cache.end(); ++it) {
+		if (!it->empty()) {
+			members.push_back(*it);
+		}
+	}
+	std::sort(members.begin(), members.end());
+	members.erase(std::unique(members.begin(), members.end()), members.end());
+
+	// 旧下标 -> 新下标，被删除的合同为 -1
+	std::vector<int> remap(members_.size(), -1);
+	for (size_t i = 0; i < members_.size(); i++) {
+		std::vector<std::string>::iterator found =
+			std::lower_bound(members.begin(), members.end(), members_[i]);
+		if (found != members.end() && *found == members_[i]) {
+			remap[i] = static_cast<int>(found - members.begin());
+		}
+	}
+
+	std::vector<int> loads(members.size(), 0);
+	std::map<uint64_t, int>::iterator pos = assigned_.begin();
+	while (pos != assigned_.end()) {
+		int index = remap[pos->second];
+		if (index < 0) {
+			// 原来的进程已经离开集群，下次路由时重新选择
+			assigned_.erase(pos++);
+			continue;
+		}
+		pos->second = index;
+		loads[index]++;
+		++pos;
+	}
+
+	ring_.clear();
+	ring_.reserve(members.size() * virtual_nodes_);
+	for (size_t i = 0; i < members.size(); i++) {
+		for (int v = 0; v < virtual_nodes_; v++) {
+			ring_.push_back(std::make_pair(HashString(members[i], v), static_cast<int>(i)));
+		}
+	}
+	std::sort(ring_.begin(), ring_.end());
+
+	members_.swap(members);
+	loads_.swap(loads);
+	cache_ = &cache;
+	cache_size_ = cache.size();
+}
+
+int ConsistentHashRouter::PickMember(uint64_t route_key) const
+{
+	int capacity = static_cast<int>(
+		ceil(load_factor_ * (assigned_.size() + 1) / members_.size()));
+
+	uint64_t h = HashKey(route_key);
+	size_t start = std::lower_bound(ring_.begin(), ring_.end(),
+	                                std::make_pair(h, 0)) - ring_.begin();
+	for (size_t i = 0; i < ring_.size(); i++) {
+		int index = ring_[(start + i) % ring_.size()].second;
+		if (loads_[index] < capacity) {
+			return index;
+		}
+	}
+	// 总容量一定大于总键数，理论上不会走到这里
+	return ring_[start % ring_.size()].second;
+}
+
+void ConsistentHashRouter::Release(uint64_t route_key)
+{
+	pthread_mutex_lock(&mutex_);
+	std::map<uint64_t, int>::iterator pos = assigned_.find(route_key);
+	if (pos != assigned_.end()) {
+		loads_[pos->second]--;
+		assigned_.erase(pos);
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+void ConsistentHashRouter::ClearAssignments()
+{
+	pthread_mutex_lock(&mutex_);
+	assigned_.clear();
+	std::fill(loads_.begin(), loads_.end(), 0);
+	pthread_mutex_unlock(&mutex_);
+}
+
+int ConsistentHashRouter::GetLoad(const std::string& contract) const
+{
+	int load = 0;
+	pthread_mutex_lock(&mutex_);
+	std::vector<std::string>::const_iterator found =
+		std::lower_bound(members_.begin(), members_.end(), contract);
+	if (found != members_.end() && *found == contract) {
+		load = loads_[found - members_.begin()];
+	}
+	pthread_mutex_unlock(&mutex_);
+	return load;
+}
+
+int ConsistentHashRouter::assigned_num() const
+{
+	pthread_mutex_lock(&mutex_);
+	int num = static_cast<int>(assigned_.size());
+	pthread_mutex_unlock(&mutex_);
+	return num;
+}
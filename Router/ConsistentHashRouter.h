@@ -0,0 +1,97 @@
+#ifndef _ROUTER_CONSISTENT_HASH_ROUTER_H_
+#define _ROUTER_CONSISTENT_HASH_ROUTER_H_
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * @brief 基于一致性哈希（带负载上限）的粘性路由器
+ * 以 route_param 指向的 uint64_t 作为路由键（如玩家 ID、公会 ID），在 ContractCache 的合同上
+ * 建立带虚拟节点的哈希环。同一个路由键在合同集合不变时总是落在同一个进程上，集合变化时只有
+ * 落在被删除进程上的键需要重新选择，新增进程只承接新的路由键，下游服务因此可以把玩家状态
+ * 一直保留在内存中。
+ * 为了避免热点，每个合同承接的路由键数量不会超过 ceil(load_factor * (总键数 + 1) / 合同数)，
+ * 超过上限时沿哈希环顺时针选择下一个合同。
+ * @note 路由键会被一直记住，当玩家下线等不再需要粘性时，应调用 Release() 释放。
+ * @note 哈希环和记住的路由键只对应一个合同集合，每个服务必须使用单独的路由器对象。
+ * @note 路由时不逐个比较合同内容，只在传入的合同集合对象或者合同数量变化时重建哈希环。
+ *       Center 每次合同变化都会发布新的快照，通过 Center::RouteContract() 路由时不需要额外处理；
+ *       自行维护合同集合并原地修改、合同数量又不变时（如替换一个进程），修改后需要调用 Rebuild()。
+ *       所有接口内部加锁，同一个路由器可以在多个线程中使用。
+ */
+class ConsistentHashRouter : public Router
+{
+public:
+	/**
+	 * @param virtual_nodes 每个合同在哈希环上的虚拟节点数
+	 * @param load_factor 负载上限系数，小于 1.0 时按 1.0 处理，越小分布越均匀，但重新选择的键越多
+	 */
+	explicit ConsistentHashRouter(int virtual_nodes = 160, double load_factor = 1.25);
+
+	virtual ~ConsistentHashRouter();
+
+	/**
+	 * @brief 根据路由键选择合同
+	 * @param cache 需要选择的所有合同的缓存集合
+	 * @param content 输出参数，具体选择的合同的内容，集合为空时不修改
+	 * @param route_param 指向 uint64_t 路由键的指针，为 NULL 时退化为 Router 的默认实现
+	 */
+	virtual void RouteToSevice(const ContractCache& cache, std::string* content,
+	                           void* route_param = NULL);
+
+	/**
+	 * @brief 合同集合的成员变化后重建哈希环，已分配到仍然存在的合同上的键保持不变
+	 * @param cache 最新的合同集合，之后的 RouteToSevice() 应传入同一个对象
+	 */
+	void Rebuild(const ContractCache& cache);
+
+	/**
+	 * @brief 释放一个路由键占用的负载，以后同样的键会重新选择合同
+	 * @param route_key 路由键
+	 */
+	void Release(uint64_t route_key);
+
+	/// @brief 清除所有记住的路由键
+	void ClearAssignments();
+
+	/**
+	 * @brief 获取某个合同当前承接的路由键数量
+	 * @return 合同不存在返回 0
+	 */
+	int GetLoad(const std::string& contract) const;
+
+	/// @brief 当前记住的路由键数量
+	int assigned_num() const;
+
+private:
+	// 合同集合变化时重建哈希环，已分配到仍然存在的合同上的键保持不变，调用者持有 mutex_
+	void RebuildRing(const ContractCache& cache);
+
+	// 传入的合同集合与建立哈希环时不是同一个对象或者数量不同，调用者持有 mutex_
+	bool CacheChanged(const ContractCache& cache) const;
+
+	// 在哈希环上选出第一个未达到负载上限的合同下标，调用者持有 mutex_
+	int PickMember(uint64_t route_key) const;
+
+	static uint64_t HashString(const std::string& data, uint64_t seed);
+	static uint64_t HashKey(uint64_t key);
+
+	mutable pthread_mutex_t mutex_;                     // 保护下面所有可变的成员
+
+	int virtual_nodes_;
+	double load_factor_;
+
+	const ContractCache* cache_;                        // 建立哈希环时的合同集合，只用来比较地址
+	size_t cache_size_;                                 // 建立哈希环时的合同数量
+	std::vector<std::string> members_;                  // 排好序的合同内容
+	std::vector<int> loads_;                            // 与 members_ 一一对应的负载
+	std::vector<std::pair<uint64_t, int> > ring_;       // 排好序的哈希环：虚拟节点哈希 -> members_ 下标
+	std::map<uint64_t, int> assigned_;                  // 路由键 -> members_ 下标
+};
+
+#endif  // _ROUTER_CONSISTENT_HASH_ROUTER_H_
@@ -46,6 +46,15 @@ public:
 	{
 		return -1;
 	}
+
+	/**
+	 * 每个请求都覆盖 req_obj_，多个请求在协程中同时挂起时会互相覆盖并泄漏，不能在协程中处理
+	 * @see ObjectHandler::IsCoroutineSafe
+	 */
+	virtual bool IsCoroutineSafe() const
+	{
+		return false;
+	}
 protected:
 	REQ* req_obj_;
 	const RES* res_obj_;
@@ -0,0 +1,81 @@
+#include "common/coroutine.h"
+
+#include "ObjectProcessor.h"
+
+/**
+ * @brief 在协程中处理一个请求的任务，对象由调度器按类型缓存复用。
+ * 请求和对端信息会复制一份，Process() 返回之后网络层可以继续复用原来的缓冲区。
+ */
+class ObjectProcessTask : public pebble::CoroutineTask
+{
+public:
+	ObjectProcessTask() : processor_(NULL), handler_(NULL), server_(NULL)
+	{
+	}
+
+	void Init(ObjectProcessor* processor, ObjectHandler* handler,
+		const Request& request, const Peer& peer, Server* server)
+	{
+		processor_ = processor;
+		handler_ = handler;
+		request_ = request;
+		peer_ = peer;
+		server_ = server;
+	}
+
+	virtual void Run()
+	{
+		if (processor_->ProcessBy(request_, peer_, handler_, server_) != 0) {
+			processor_->coroutine_error_num_++;
+		}
+	}
+
+protected:
+	// request_ 和 peer_ 保留下来，下一个请求复制时可以复用它们已经分配的内存
+	virtual void Reset()
+	{
+		processor_ = NULL;
+		handler_ = NULL;
+		server_ = NULL;
+	}
+
+private:
+	ObjectProcessor* processor_;
+	ObjectHandler* handler_;
+	Request request_;
+	Peer peer_;
+	Server* server_;
+};
+
+void ObjectProcessor::set_coroutine_schedule(pebble::CoroutineSchedule* schedule, int prewarm_num)
+{
+	schedule_ = schedule;
+	if (schedule_ != NULL && prewarm_num > 0) {
+		schedule_->Prewarm(prewarm_num);
+	}
+}
+
+int ObjectProcessor::Dispatch(const Request& request, const Peer& peer,
+	ObjectHandler* handler, Server* server)
+{
+	// handler 在协程中再次调用 Process()（例如转发给本进程的其他服务）时，直接在当前协程中处理；
+	// 请求数据保存在 handler 中的，多个请求同时挂起会互相覆盖，只能在主循环中处理
+	if (schedule_ == NULL || schedule_->CurrentTaskId() != INVALID_CO_ID
+		|| !handler->IsCoroutineSafe()) {
+		return ProcessBy(request, peer, handler, server);
+	}
+
+	ObjectProcessTask* task = schedule_->NewPooledTask<ObjectProcessTask>();
+	if (task == NULL) {
+		return ProcessBy(request, peer, handler, server);
+	}
+	task->Init(this, handler, request, peer, server);
+
+	// 立即执行到第一次挂起，不需要等待的请求和直接调用一样在这里处理完
+	if (task->Start(true) < 0) {
+		// 协程没有建立起来，任务放回对象池，请求在主循环中直接处理
+		schedule_->ReleaseTask(task);
+		return ProcessBy(request, peer, handler, server);
+	}
+	return 0;
+}
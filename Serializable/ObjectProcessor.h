@@ -1,6 +1,10 @@
 
 #include <iostream>
 
+namespace pebble {
+class CoroutineSchedule;
+}
+
 class ObjectProcessor: public ProcessorHelper
 {
 public:
@@ -11,9 +15,36 @@ public:
 	// 继承自 Processor 处理器函数
 	virtual int Init(Server* server, Config* config = NULL);
     
+    /**
+     * @brief 找到 request 对应的 handler 并处理。
+     * 目前不经过 Dispatch()，设置了协程调度器也仍然在调用线程中直接处理。
+     */
     virtual int Process(const Request& request, const Peer& peer);
     virtual int Process(const Request& request, const Peer& peer, Server* server);
 
+    /**
+     * @brief 设置协程调度器，设置后经过 Dispatch() 的请求的 ProcessRequest 在一个独立的协程中执行，
+     * handler 可以直接调用 CoroutinueDataStore 的 Get()/Put() 或者同步的 RPC，等待时只挂起
+     * 本请求的协程，主循环继续处理其他请求，一个线程上可以同时有成千上万个请求在处理中。
+     * 协程和任务对象都来自调度器的对象池，每个请求不需要分配内存。
+     * @param schedule 已经 Init() 的协程调度器，传入 NULL 恢复为在主循环中直接处理。
+     *   处理请求的线程需要在主循环中调用 co_update()，挂起的协程才会被唤醒。
+     * @param prewarm_num 预先创建的协程数量，一般取预期的并发请求数，@see CoroutineSchedule::Prewarm
+     * @attention 同一个 handler 对象会被多个挂起中的请求共用，反序列化得到的请求保存在 handler 中，
+     *   挂起期间会被后来的请求覆盖。只有 IsCoroutineSafe() 返回 true 的 handler 才在协程中处理，
+     *   其他的（包括 ObjectHandlerCast）仍然在主循环中直接处理。要让 handler 在协程中处理，
+     *   覆盖 IsCoroutineSafe() 返回 true，并在 ProcessRequest 第一次挂起之前把请求复制到局部变量，
+     *   之后只读取局部变量。
+     * @note Process() 目前还没有调用 Dispatch()，@see Process
+     */
+    void set_coroutine_schedule(pebble::CoroutineSchedule* schedule, int prewarm_num = 0);
+
+    ///@brief 在协程中处理失败的请求数
+    inline int64_t coroutine_error_num() const
+    {
+    	return coroutine_error_num_;
+    }
+
 
     ///@brief 设置默认处理器，所有没有注册具体服务名字的消息都会用这个消息处理
     inline void set_default_handler(ObjectHandler* default_handler)
@@ -39,13 +70,24 @@ public:
     ///@brief 关闭此服务
     virtual int Close();
 private:
+	friend class ObjectProcessTask;
+
 	std::map<std::string,ObjectHandler*> handler_table_;
 	Config* config_;
 	ObjectHandler*default_handler_;
+	pebble::CoroutineSchedule* schedule_ = NULL;
+	int64_t coroutine_error_num_ = 0;
 
 	int ProcessBy(const Request& request, const Peer& peer,
 		ObjectHandler* handler, Server* server = NULL);
 
+	/**
+     * 没有设置协程调度器，或者已经在协程中时直接调用 ProcessBy()，否则把请求交给一个新的协程，
+     * 并立即执行到第一次挂起为止。
+     */
+	int Dispatch(const Request& request, const Peer& peer,
+		ObjectHandler* handler, Server* server = NULL);
+
 	int DefaultProcess(const Request& request, const Peer& peer,
 		Server* server = NULL);
 
@@ -80,6 +122,17 @@ public:
 
 	virtual int Init(Server* service, Config* config);
 
+	/**
+     * 设置了协程调度器时，ObjectProcessor 只把返回 true 的 handler 放到协程中处理。
+     * 请求反序列化到 handler 自身（或 ObjectHandlerCast 的 req_obj_），挂起的请求会被后来的请求覆盖，
+     * 所以默认返回 false；ProcessRequest 在第一次挂起之前把请求复制到局部变量、之后不再读取
+     * handler 中的请求数据时，可以覆盖此方法返回 true。
+     */
+	virtual bool IsCoroutineSafe() const
+	{
+		return false;
+	}
+
 	/**
      * 如果需要在主循环中进行操作，可以实现此方法。
      * 返回值小于 0 的话，此任务会被移除循环